@@ -0,0 +1,482 @@
+/* Copyright 2024 Vulcalien
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// Benchmark and regression checks for the data-structs library.
+//
+// usage: bench-ds [--save] [--threshold <ratio>] [baseline-file]
+//
+// Each benchmark is run a few times and the best time is kept. If a
+// baseline file is given, the results are compared against it and the
+// program fails if any of them is slower by more than the threshold
+// (default 0.25, meaning 25%). With --save, the results are written to
+// the baseline file instead.
+
+#include "luag-console.h"
+
+#include "data-structs/hashtable.h"
+#include "data-structs/array-list.h"
+#include "data-structs/circular-list.h"
+#include "data-structs/char-queue.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#ifdef __GLIBC__
+    #include <malloc.h>
+#endif
+
+#define REPETITIONS (5)
+
+// below this difference (in ns/op), results are considered noise
+#define NOISE_FLOOR (2.0)
+
+#define MAX_RESULTS (64)
+
+static const u32 sizes[] = { 64, 1024, 16384, 131072 };
+#define SIZES_COUNT (sizeof(sizes) / sizeof(sizes[0]))
+
+static struct {
+    char name[64];
+    double ns_per_op;
+} results[MAX_RESULTS];
+static u32 results_count = 0;
+
+static bool failed = false;
+
+static char **keys;
+static char **missing_keys;
+
+// prevents the compiler from removing the benchmarked code
+static volatile u64 sink;
+
+static u64 now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (u64) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// allocated bytes, including large blocks allocated with mmap
+static i64 heap_usage(void) {
+    #ifdef __GLIBC__
+        #if __GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33)
+            struct mallinfo2 info = mallinfo2();
+        #else
+            struct mallinfo info = mallinfo();
+        #endif
+        return (i64) info.uordblks + info.hblkhd;
+    #else
+        return -1;
+    #endif
+}
+
+static void check(bool condition, const char *what) {
+    if(!condition) {
+        fprintf(stderr, "FAIL: %s\n", what);
+        failed = true;
+    }
+}
+
+static void add_result(const char *name, u32 size, double ns_per_op) {
+    if(results_count == MAX_RESULTS)
+        return;
+
+    snprintf(
+        results[results_count].name, sizeof(results[0].name),
+        "%s/%u", name, size
+    );
+    results[results_count].ns_per_op = ns_per_op;
+    results_count++;
+
+    printf("%-32s %10.2f ns/op\n", results[results_count - 1].name, ns_per_op);
+}
+
+static void print_memory(const char *name, u32 size, i64 bytes) {
+    if(bytes < 0)
+        return;
+    printf(
+        "%-32s %10.2f bytes/element\n",
+        name, (double) bytes / size
+    );
+}
+
+// === Hashtable ===
+
+static void bench_hashtable(u32 size) {
+    double best_insert = 1e30;
+    double best_hit    = 1e30;
+    double best_miss   = 1e30;
+    double best_iter   = 1e30;
+    double best_remove = 1e30;
+
+    for(u32 r = 0; r < REPETITIONS; r++) {
+        i64 heap_before = heap_usage();
+
+        u64 t0 = now_ns();
+        struct Hashtable *table = hashtable_create(16);
+        for(u32 i = 0; i < size; i++)
+            hashtable_set(table, keys[i], keys[i]);
+        u64 t1 = now_ns();
+
+        i64 heap_after = heap_usage();
+
+        u64 found = 0;
+        for(u32 i = 0; i < size; i++) {
+            void *value;
+            if(!hashtable_get(table, keys[i], &value) && value == keys[i])
+                found++;
+        }
+        u64 t2 = now_ns();
+
+        u64 not_found = 0;
+        for(u32 i = 0; i < size; i++) {
+            void *value;
+            if(hashtable_get(table, missing_keys[i], &value))
+                not_found++;
+        }
+        u64 t3 = now_ns();
+
+        u32 iterator = 0;
+        u32 iterated = 0;
+        const char *key;
+        void *value;
+        while(hashtable_next(table, &iterator, &key, &value))
+            iterated++;
+        u64 t4 = now_ns();
+
+        u64 removed = 0;
+        for(u32 i = 0; i < size; i++)
+            removed += !hashtable_remove(table, keys[i], NULL);
+        u64 t5 = now_ns();
+
+        check(found == size, "hashtable: all keys are found");
+        check(not_found == size, "hashtable: missing keys are not found");
+        check(iterated == size, "hashtable: iteration visits all entries");
+        check(removed == size, "hashtable: all keys are removed");
+        check(hashtable_count(table) == 0, "hashtable: empty after removal");
+
+        hashtable_destroy(table, NULL);
+        sink += found + not_found + iterated;
+
+        #define BEST(var, time) \
+            if((double) (time) / size < var) var = (double) (time) / size
+
+        BEST(best_insert, t1 - t0);
+        BEST(best_hit,    t2 - t1);
+        BEST(best_miss,   t3 - t2);
+        BEST(best_iter,   t4 - t3);
+        BEST(best_remove, t5 - t4);
+
+        if(r == 0 && heap_before >= 0) {
+            char name[64];
+            snprintf(name, sizeof(name), "hashtable-memory/%u", size);
+            print_memory(name, size, heap_after - heap_before);
+        }
+    }
+
+    add_result("hashtable-insert",   size, best_insert);
+    add_result("hashtable-get-hit",  size, best_hit);
+    add_result("hashtable-get-miss", size, best_miss);
+    add_result("hashtable-iterate",  size, best_iter);
+    add_result("hashtable-remove",   size, best_remove);
+
+    // updating an existing key must not add a new entry
+    struct Hashtable *table = hashtable_create(16);
+    hashtable_set(table, "key", keys[0]);
+    check(
+        hashtable_set(table, "key", keys[1]) == keys[0],
+        "hashtable: set returns the old value"
+    );
+    check(hashtable_count(table) == 1, "hashtable: set updates the key");
+    hashtable_destroy(table, NULL);
+}
+
+// === ArrayList ===
+
+static void bench_arraylist(u32 size) {
+    double best_add = 1e30;
+    double best_get = 1e30;
+
+    for(u32 r = 0; r < REPETITIONS; r++) {
+        i64 heap_before = heap_usage();
+
+        u64 t0 = now_ns();
+        struct ArrayList *list = arraylist_create(16, 16);
+        for(u32 i = 0; i < size; i++)
+            arraylist_add(list, keys[i]);
+        u64 t1 = now_ns();
+
+        i64 heap_after = heap_usage();
+
+        u64 matching = 0;
+        for(u32 i = 0; i < size; i++)
+            matching += (arraylist_get(list, i) == keys[i]);
+        u64 t2 = now_ns();
+
+        check(arraylist_count(list) == size, "arraylist: count");
+        check(matching == size, "arraylist: get returns added values");
+        check(arraylist_get(list, size) == NULL, "arraylist: out of bounds");
+
+        arraylist_destroy(list, NULL);
+        sink += matching;
+
+        BEST(best_add, t1 - t0);
+        BEST(best_get, t2 - t1);
+
+        if(r == 0 && heap_before >= 0) {
+            char name[64];
+            snprintf(name, sizeof(name), "arraylist-memory/%u", size);
+            print_memory(name, size, heap_after - heap_before);
+        }
+    }
+
+    add_result("arraylist-add", size, best_add);
+    add_result("arraylist-get", size, best_get);
+}
+
+// === CircularList ===
+
+static void bench_circularlist(u32 size) {
+    double best_add = 1e30;
+    double best_get = 1e30;
+
+    // half the size, so that elements get overwritten
+    const u32 capacity = size / 2;
+
+    for(u32 r = 0; r < REPETITIONS; r++) {
+        u64 t0 = now_ns();
+        struct CircularList *list = circularlist_create(capacity);
+        for(u32 i = 0; i < size; i++)
+            circularlist_add(list, keys[i], NULL);
+        u64 t1 = now_ns();
+
+        // index 0 is the last added element
+        u64 matching = 0;
+        for(u32 i = 0; i < capacity; i++)
+            matching += (circularlist_get(list, i) == keys[size - 1 - i]);
+        u64 t2 = now_ns();
+
+        check(circularlist_count(list) == capacity, "circularlist: count");
+        check(matching == capacity, "circularlist: get order");
+
+        circularlist_destroy(list, NULL);
+        sink += matching;
+
+        BEST(best_add, t1 - t0);
+        BEST(best_get, (double) (t2 - t1) * size / capacity);
+    }
+
+    add_result("circularlist-add", size, best_add);
+    add_result("circularlist-get", size, best_get);
+}
+
+// === CharQueue ===
+
+static void bench_charqueue(u32 size) {
+    double best = 1e30;
+
+    for(u32 r = 0; r < REPETITIONS; r++) {
+        struct CharQueue *queue = charqueue_create(size);
+
+        u64 t0 = now_ns();
+        for(u32 i = 0; i < size; i++)
+            charqueue_enqueue(queue, 'a' + i % 26);
+
+        check(charqueue_is_full(queue), "charqueue: full");
+        check(!charqueue_enqueue(queue, 'x'), "charqueue: reject when full");
+
+        u64 matching = 0;
+        for(u32 i = 0; i < size; i++)
+            matching += (charqueue_dequeue(queue) == 'a' + i % 26);
+        u64 t1 = now_ns();
+
+        check(matching == size, "charqueue: FIFO order");
+        check(charqueue_is_empty(queue), "charqueue: empty");
+
+        charqueue_destroy(queue);
+        sink += matching;
+
+        // each element is enqueued and dequeued
+        BEST(best, (t1 - t0) / 2.0);
+    }
+
+    add_result("charqueue-enqueue-dequeue", size, best);
+
+    // bulk operations, in chunks of 100 characters
+    char *chunk = malloc(100 * sizeof(char));
+    char *out   = malloc(size * sizeof(char));
+    for(u32 i = 0; i < 100; i++)
+        chunk[i] = 'a' + i % 26;
+
+    best = 1e30;
+    for(u32 r = 0; r < REPETITIONS; r++) {
+        struct CharQueue *queue = charqueue_create(64);
+
+        // start from the middle, so that copies wrap around
+        for(u32 i = 0; i < 32; i++)
+            charqueue_enqueue(queue, 'a' + i % 26);
+        charqueue_dequeue_bulk(queue, out, 32);
+
+        u64 t0 = now_ns();
+        u32 enqueued = 0;
+        while(enqueued < size) {
+            u32 len = size - enqueued < 100 ? size - enqueued : 100;
+
+            if(charqueue_size(queue) - charqueue_count(queue) < len)
+                charqueue_resize(queue, charqueue_size(queue) * 2);
+            enqueued += charqueue_enqueue_bulk(queue, chunk, len);
+        }
+
+        u32 dequeued = charqueue_dequeue_bulk(queue, out, size);
+        u64 t1 = now_ns();
+
+        u64 matching = 0;
+        for(u32 i = 0; i < size; i++)
+            matching += (out[i] == 'a' + (i % 100) % 26);
+
+        check(dequeued == size, "charqueue: bulk dequeue count");
+        check(matching == size, "charqueue: bulk order after resize");
+        check(charqueue_is_empty(queue), "charqueue: empty after bulk");
+
+        charqueue_destroy(queue);
+        sink += matching;
+
+        BEST(best, (t1 - t0) / 2.0);
+    }
+    free(chunk);
+    free(out);
+
+    add_result("charqueue-bulk", size, best);
+}
+
+#undef BEST
+
+// === Baseline ===
+
+static int save_baseline(const char *filename) {
+    FILE *file = fopen(filename, "w");
+    if(!file) {
+        fprintf(stderr, "could not create baseline file '%s'\n", filename);
+        return -1;
+    }
+
+    for(u32 i = 0; i < results_count; i++)
+        fprintf(file, "%s %.2f\n", results[i].name, results[i].ns_per_op);
+    fclose(file);
+
+    printf("Baseline saved: '%s'\n", filename);
+    return 0;
+}
+
+static int compare_baseline(const char *filename, double threshold) {
+    FILE *file = fopen(filename, "r");
+    if(!file) {
+        printf(
+            "No baseline found ('%s'): run with --save to create it\n",
+            filename
+        );
+        return 0;
+    }
+
+    u32 regressions = 0;
+
+    char name[64];
+    double baseline;
+    while(fscanf(file, "%63s %lf", name, &baseline) == 2) {
+        for(u32 i = 0; i < results_count; i++) {
+            if(strcmp(name, results[i].name))
+                continue;
+
+            double current = results[i].ns_per_op;
+            if(current > baseline * (1 + threshold) &&
+               current - baseline > NOISE_FLOOR) {
+                printf(
+                    "REGRESSION: %s: %.2f ns/op (baseline %.2f ns/op)\n",
+                    name, current, baseline
+                );
+                regressions++;
+            }
+            break;
+        }
+    }
+    fclose(file);
+
+    if(regressions) {
+        printf("%u regressions (threshold: %.0f%%)\n",
+               regressions, threshold * 100);
+        return -1;
+    }
+    printf("No regressions (threshold: %.0f%%)\n", threshold * 100);
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    bool save = false;
+    double threshold = 0.25;
+    const char *baseline_file = NULL;
+
+    for(int i = 1; i < argc; i++) {
+        if(!strcmp(argv[i], "--save")) {
+            save = true;
+        } else if(!strcmp(argv[i], "--threshold") && i + 1 < argc) {
+            threshold = atof(argv[++i]);
+        } else {
+            baseline_file = argv[i];
+        }
+    }
+
+    const u32 max_size = sizes[SIZES_COUNT - 1];
+
+    // prepare the keys beforehand, so that it is not measured
+    keys         = malloc(max_size * sizeof(char *));
+    missing_keys = malloc(max_size * sizeof(char *));
+    for(u32 i = 0; i < max_size; i++) {
+        keys[i]         = malloc(16 * sizeof(char));
+        missing_keys[i] = malloc(16 * sizeof(char));
+
+        snprintf(keys[i],         16, "key-%u", i);
+        snprintf(missing_keys[i], 16, "missing-%u", i);
+    }
+
+    for(u32 i = 0; i < SIZES_COUNT; i++) {
+        bench_hashtable(sizes[i]);
+        bench_arraylist(sizes[i]);
+        bench_circularlist(sizes[i]);
+        bench_charqueue(sizes[i]);
+    }
+
+    for(u32 i = 0; i < max_size; i++) {
+        free(keys[i]);
+        free(missing_keys[i]);
+    }
+    free(keys);
+    free(missing_keys);
+
+    if(failed) {
+        fputs("Some checks failed\n", stderr);
+        return 1;
+    }
+
+    if(baseline_file) {
+        if(save) {
+            if(save_baseline(baseline_file))
+                return 1;
+        } else if(compare_baseline(baseline_file, threshold)) {
+            return 1;
+        }
+    }
+    return 0;
+}
@@ -21,7 +21,25 @@
 extern int archiveutil_extract(const char *archive_filename,
                                const char *dest_folder);
 
+struct archiveutil_PackStats {
+    u32 files;
+    u32 reused;
+    u32 threads;
+
+    // size of the uncompressed and compressed archive
+    u64 input_size;
+    u64 output_size;
+
+    u32 time_ms;
+};
+
+// Packs 'src_folder' into a reproducible gzip-compressed tar archive,
+// compressing files in parallel using 'threads' threads (0 = one per
+// CPU). Files that did not change since the last pack, according to
+// the manifest saved next to the archive, are not recompressed.
+// If 'stats' is not NULL, it is filled on success.
 extern int archiveutil_pack(const char *archive_filename,
-                            const char *src_folder);
+                            const char *src_folder, u32 threads,
+                            struct archiveutil_PackStats *stats);
 
 #endif // VULC_LUAG_ARCHIVE_UTIL
@@ -0,0 +1,60 @@
+/* Copyright 2024 Vulcalien
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef VULC_LUAG_BROADPHASE
+#define VULC_LUAG_BROADPHASE
+
+#include "luag-console.h"
+#include "display.h"
+
+// entity ids go from 0 to BROADPHASE_MAX_ENTITIES - 1
+#define BROADPHASE_MAX_ENTITIES (65536)
+
+// the cell size is a multiple of SPRITE_SIZE
+#define BROADPHASE_DEFAULT_CELL_SIZE (2 * SPRITE_SIZE)
+#define BROADPHASE_MAX_CELL_SIZE     (256 * SPRITE_SIZE)
+
+// Removes all entities and restores the default cell size
+extern void broadphase_reset(void);
+
+// Changes the size of the cells, in pixels. The entities are kept,
+// except those that would overlap too many cells.
+// Returns nonzero if the size is invalid.
+extern int broadphase_set_cell_size(u32 size);
+
+// Entities are rectangles, in pixels. Overlapping means sharing at
+// least one pixel: rectangles that only touch do not overlap.
+
+// An entity can overlap at most 4096 cells.
+// Returns nonzero if the id is already used or the arguments are
+// invalid.
+extern int broadphase_insert(u32 id, i32 x, i32 y, u32 w, u32 h);
+
+// Returns nonzero if the entity does not exist or the arguments are
+// invalid. Entities that stay in the same cells are not reinserted.
+extern int broadphase_move(u32 id, i32 x, i32 y, u32 w, u32 h);
+
+extern void broadphase_remove(u32 id);
+
+// Sets 'ids' to the entities overlapping the rectangle and returns
+// their number. 'ids' is valid until the next query.
+extern u32 broadphase_query(i32 x, i32 y, u32 w, u32 h, const u32 **ids);
+
+// Sets 'pairs' to the ids of the pairs of overlapping entities, two
+// for each pair (the smaller first), and returns the number of pairs.
+// 'pairs' is valid until the next query.
+extern u32 broadphase_pairs(const u32 **pairs);
+
+#endif // VULC_LUAG_BROADPHASE
@@ -18,6 +18,8 @@
 
 #include "luag-console.h"
 
+#include "sound.h"
+
 #define CARTRIDGE_DEFAULT_MAJOR_V (2)
 #define CARTRIDGE_DEFAULT_MINOR_V (1)
 
@@ -25,6 +27,9 @@ struct cartridge_Info {
     // library version
     u32 major_v;
     u32 minor_v;
+
+    // overrides of the install sound configuration
+    struct sound_Config audio;
 };
 
 extern struct cartridge_Info cartridge_info;
@@ -18,4 +18,7 @@
 
 #define PERFORMANCE_THREAD
 
+// reveal the terminal output gradually (only affects rendering)
+#define TERMINAL_TYPING_EFFECT
+
 #endif // VULC_LUAG_COMPILE_OPTIONS
@@ -33,4 +33,22 @@ extern bool charqueue_enqueue(struct CharQueue *queue, char c);
 // returns '\0' if the queue is empty
 extern char charqueue_dequeue(struct CharQueue *queue);
 
+// Enqueues up to 'len' characters.
+// Returns the number of characters actually enqueued
+extern u32 charqueue_enqueue_bulk(struct CharQueue *queue,
+                                  const char *chars, u32 len);
+
+// Dequeues up to 'len' characters into 'chars'.
+// Returns the number of characters actually dequeued
+extern u32 charqueue_dequeue_bulk(struct CharQueue *queue,
+                                  char *chars, u32 len);
+
+extern u32 charqueue_count(struct CharQueue *queue);
+extern u32 charqueue_size(struct CharQueue *queue);
+
+// Changes the size of the queue, keeping its content.
+// Returns nonzero if 'size' is smaller than the number of characters
+// in the queue or if memory could not be allocated
+extern int charqueue_resize(struct CharQueue *queue, u32 size);
+
 #endif // VULC_LUAG_CHARQUEUE
@@ -20,16 +20,42 @@
 
 struct Hashtable;
 
+// 'size' is the initial number of slots: the table grows as needed
 extern struct Hashtable *hashtable_create(u32 size);
 
 // if destroy_value_fn is NULL, the value object is not destroyed
 extern void hashtable_destroy(struct Hashtable *table,
                               void (*destroy_value_fn)(void *));
 
-extern void hashtable_set(struct Hashtable *table,
-                          const char *key, void *value);
+// Inserts the key or updates its value if already present.
+// Returns the old value, or NULL if the key was not present.
+extern void *hashtable_set(struct Hashtable *table,
+                           const char *key, void *value);
+
+// returns nonzero if the key is not present
+extern int hashtable_update(struct Hashtable *table,
+                            const char *key, void *value);
 
 extern int hashtable_get(struct Hashtable *table,
                          const char *key, void **value);
 
+// Returns nonzero if the key is not present.
+// If destroy_value_fn is NULL, the value object is not destroyed
+extern int hashtable_remove(struct Hashtable *table, const char *key,
+                            void (*destroy_value_fn)(void *));
+
+extern u32 hashtable_count(struct Hashtable *table);
+
+// Iterates over the entries, in no particular order. 'iterator' must
+// be set to 0 before the first call. Returns false when there are no
+// more entries. The table must not be modified while iterating.
+//
+// example:
+//   u32 it = 0;
+//   const char *key;
+//   void *value;
+//   while(hashtable_next(table, &it, &key, &value)) { ... }
+extern bool hashtable_next(struct Hashtable *table, u32 *iterator,
+                           const char **key, void **value);
+
 #endif // VULC_LUAG_HASHTABLE
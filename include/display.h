@@ -42,9 +42,24 @@ extern int display_update_atlas(SDL_Surface *surface, SDL_Texture **texture);
 
 extern void display_atlas_set_color_key(u32 color, bool active_flag);
 
+// incremented when the content of render targets is lost
+extern u32 display_target_generation;
+
 extern void display_refresh(void);
 extern void display_toggle_fullscreen(void);
 
+// Creates a DISPLAY_WIDTH x DISPLAY_HEIGHT texture that can be used as
+// render target. Returns NULL on failure.
+extern SDL_Texture *display_create_target(void);
+
+// Creates a texture with the size, format and content of 'surface',
+// that can be changed with SDL_UpdateTexture. Returns NULL on failure.
+extern SDL_Texture *display_create_streaming_texture(SDL_Surface *surface);
+
+// if 'target' is NULL, the screen becomes the render target
+extern void display_set_target(SDL_Texture *target);
+extern void display_draw_target(SDL_Texture *target);
+
 extern void display_clear(u32 color);
 extern void display_fill(u32 x, u32 y, u32 w, u32 h, u32 color, u8 alpha);
 extern void display_write(const char *text, u32 color,
@@ -0,0 +1,46 @@
+/* Copyright 2024 Vulcalien
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef VULC_LUAG_FLOOD_FILL
+#define VULC_LUAG_FLOOD_FILL
+
+#include "luag-console.h"
+
+// rectangle from (x0, y0) to (x1, y1), both included
+struct flood_Rect {
+    u32 x0, y0;
+    u32 x1, y1;
+};
+
+// Returns true if the cell (x, y) has to be filled
+typedef bool (*FloodMatchFn)(void *data, u32 x, u32 y);
+
+// Fills the cells from (x0, y) to (x1, y): after that, they must not
+// match anymore. Returns false if the cells could not be filled.
+typedef bool (*FloodSpanFn)(void *data, u32 x0, u32 x1, u32 y);
+
+// Fills the cells that match and are connected to (x, y) horizontally
+// or vertically, without leaving 'bounds'. The cells are filled by
+// rows, using an explicit stack instead of recursion. If 'changed' is
+// not NULL, it is set to the rectangle containing the filled cells
+// (x0 > x1 if there are none).
+// Returns the number of cells filled, or a negative value if memory
+// could not be allocated or a span could not be filled (some cells
+// may have been filled anyway).
+extern i64 flood_fill(u32 x, u32 y, const struct flood_Rect *bounds,
+                      FloodMatchFn matches, FloodSpanFn fill_span,
+                      void *data, struct flood_Rect *changed);
+
+#endif // VULC_LUAG_FLOOD_FILL
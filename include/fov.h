@@ -0,0 +1,67 @@
+/* Copyright 2024 Vulcalien
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef VULC_LUAG_FOV
+#define VULC_LUAG_FOV
+
+#include "luag-console.h"
+
+#define FOV_MAX_RADIUS (256)
+
+// visibility of a tile
+#define FOV_UNSEEN   (0)
+#define FOV_EXPLORED (1) // seen before, but not visible now
+#define FOV_VISIBLE  (2)
+
+// Restores the default options (no opaque tiles, layer 0) and forgets
+// the visibility of all tiles.
+extern void fov_reset(void);
+
+extern void fov_set_opaque(u8 tile, bool flag);
+extern bool fov_is_opaque(u8 tile);
+
+// Sets the map layer used to read the tiles
+extern void fov_set_layer(u32 layer);
+
+// Casts a ray from (x0, y0) to (x1, y1), in tiles: the tile (x, y)
+// goes from x to x + 1. Returns 1 and sets 'hit_x' and 'hit_y' to the
+// first opaque tile crossed after the starting one, 0 if the line is
+// clear, or a negative value if a point is outside the map.
+extern int fov_raycast(double x0, double y0, double x1, double y1,
+                       u32 *hit_x, u32 *hit_y);
+
+// Computes the tiles visible from (x, y) within 'radius', using
+// recursive shadowcasting. Opaque tiles are visible, but hide what is
+// behind them. If 'clear' is true, the tiles that were visible become
+// explored first, otherwise the new tiles are added to the visible
+// ones (e.g. to have more than one viewer).
+// Returns nonzero if the arguments are invalid.
+extern int fov_compute(u32 x, u32 y, u32 radius, bool clear);
+
+// Makes the visible tiles explored or, if 'forget' is true, makes all
+// tiles unseen.
+extern void fov_clear(bool forget);
+
+// x and y must be inside the map
+extern u8 fov_get(u32 x, u32 y);
+
+// Returns the visibility of the tiles of a map chunk, or NULL if all
+// of them are unseen.
+extern const u8 *fov_chunk(u32 chunk_x, u32 chunk_y);
+
+// Called when the whole map is replaced or resized
+extern void fov_map_changed(void);
+
+#endif // VULC_LUAG_FOV
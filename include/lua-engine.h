@@ -29,4 +29,12 @@ extern void engine_ask_exit(i8 code, const char *msg);
 extern void engine_tick(void);
 extern void engine_render(void);
 
+// In low-power mode, the console waits up to 'max_wait' ticks for
+// input before ticking the cartridge again. 0 disables it.
+extern void engine_set_low_power(u32 max_wait);
+
+// Returns how many milliseconds the console can wait for input before
+// ticking the cartridge, or 0 if low-power mode is disabled.
+extern u32 engine_idle_time(void);
+
 #endif // VULC_LUAG_LUA_ENGINE
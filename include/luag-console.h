@@ -31,6 +31,10 @@ extern bool should_quit;
 
 extern bool dev_mode;
 
+// In batch mode, commands are given on the command line and the
+// terminal output is printed to stdout and stderr.
+extern bool batch_mode;
+
 extern char *res_folder;
 extern char *config_folder;
 extern char *game_folder;
@@ -38,4 +42,8 @@ extern char *game_folder;
 extern void tick(void);
 extern void render(void);
 
+// Returns how many milliseconds the main loop can wait for events
+// before calling 'tick' again, or 0 if it should not wait.
+extern u32 idle_time(void);
+
 #endif // VULC_LUAG_CORE
@@ -18,10 +18,47 @@
 
 #include "luag-console.h"
 
+#include <SDL.h>
+
+// maps can have up to MAP_MAX_SIZE x MAP_MAX_SIZE tiles
+#define MAP_MAX_SIZE (65536)
+
+#define MAP_MAX_LAYERS (8)
+
+#define MAP_CHUNK_SHIFT (5)
+#define MAP_CHUNK_SIZE  (1 << MAP_CHUNK_SHIFT)
+#define MAP_CHUNK_MASK  (MAP_CHUNK_SIZE - 1)
+#define MAP_CHUNK_TILES (MAP_CHUNK_SIZE * MAP_CHUNK_SIZE)
+
+// The tiles are stored in chunks of MAP_CHUNK_SIZE x MAP_CHUNK_SIZE,
+// allocated only when a tile different from 'fill' is set.
+struct map_Layer {
+    // NULL chunks are filled with 'fill'
+    u8 **chunks;
+    u8 fill;
+
+    bool visible;
+
+    // scrolling speed, in percent of the camera's movement
+    i32 parallax_x;
+    i32 parallax_y;
+
+    // offset in pixels, added after parallax
+    i32 offset_x;
+    i32 offset_y;
+};
+
+// All layers have the same size. Layer 0 is the background: in the
+// other layers, tile 0 is empty and is not drawn.
 struct Map {
     u32 width;
     u32 height;
-    u8 *tiles;
+
+    u32 chunks_w;
+    u32 chunks_h;
+
+    u32 layer_count;
+    struct map_Layer layers[MAP_MAX_LAYERS];
 };
 
 extern struct Map map;
@@ -29,14 +66,136 @@ extern struct Map map;
 extern int map_init(void);
 extern void map_destroy(void);
 
+// Loads the map file. On Unix systems, the file is mapped in memory
+// (copy-on-write), so pages are read only when used.
 extern int map_load(char *filename);
 
-#define map_get_tile(x, y)\
-    map.tiles[x + y * map.width]
+// Replaces the map with a new one, with one layer filled with 'fill'
+extern int map_create(u32 width, u32 height, u8 fill);
+
+// Changes the size of the map, keeping the tiles that are still
+// inside. New tiles of layer 0 are set to 'fill', the ones of the
+// other layers are empty.
+extern int map_resize(u32 width, u32 height, u8 fill);
+
+// Adds empty layers or removes the last ones.
+// Returns nonzero if 'count' is invalid.
+extern int map_set_layer_count(u32 count);
+
+// Saves a copy of the map in a background thread. The file is written
+// to a temporary file and then renamed, so it is never left partially
+// written. Returns nonzero if the save could not be started.
+extern int map_save(const char *filename);
+
+// Waits for the last save to finish and returns its result.
+extern int map_save_wait(void);
+
+// Region functions: the rectangle must be inside the map, otherwise
+// nothing is done and nonzero is returned. Tiles are stored by rows.
+extern int map_read_region(u32 layer, u32 x, u32 y, u32 w, u32 h,
+                           u8 *tiles);
+extern int map_write_region(u32 layer, u32 x, u32 y, u32 w, u32 h,
+                            const u8 *tiles);
+extern int map_fill(u32 layer, u32 x, u32 y, u32 w, u32 h, u8 tile);
+
+// The source and destination rectangles can overlap.
+extern int map_copy(u32 layer, u32 src_x, u32 src_y, u32 w, u32 h,
+                    u32 dst_x, u32 dst_y);
+
+// Called after each span of a row, from x0 to x1 (included), is filled
+typedef void (*MapFillSpanFn)(void *data, u32 x0, u32 x1, u32 y);
+
+// Replaces the tiles equal to the one at (x, y) that are connected to
+// it horizontally or vertically. 'on_span' can be NULL.
+// Returns the number of tiles changed, or a negative value on failure.
+extern i64 map_flood_fill(u32 layer, u32 x, u32 y, u8 tile,
+                          MapFillSpanFn on_span, void *span_data);
+
+#define MAP_ANIM_MAX_FRAMES (32)
+
+// Makes the tiles with id 'tile' be drawn as 'frames', each one for
+// 'period' ticks, without changing the map. If 'frame_count' is 0, the
+// animation is removed. Returns nonzero if the arguments are invalid.
+extern int map_set_animation(u8 tile, const u8 *frames, u32 frame_count,
+                             u32 period);
+
+// Removes all animations
+extern void map_reset_animations(void);
+
+// Advances the animations by one tick. Called by the engine.
+extern void map_animate(void);
+
+// How map_render uses the visibility computed by the fov module
+enum map_Fog {
+    MAP_FOG_NONE,
+
+    // tiles never seen are hidden, explored tiles are dimmed
+    MAP_FOG_DIM,
+
+    // only the visible tiles are drawn
+    MAP_FOG_HIDE
+};
+
+// Draws the visible layers selected by 'layer_mask' (bit n = layer n),
+// from first to last, applying the animations. The camera is at
+// (xoff, yoff): if 'parallax' is false, the parallax and offset of the
+// layers are ignored.
+extern void map_render(SDL_Texture *atlas, u32 layer_mask, u32 scale,
+                       i32 xoff, i32 yoff, bool parallax,
+                       enum map_Fog fog);
+
+// Notifies the modules that depend on the tiles (e.g. pathfinding)
+extern void map_tiles_changed(u32 layer, u32 x, u32 y, u32 w, u32 h);
+
+// Allocates the chunk containing the tile (x, y), filled with the
+// layer's fill tile. Returns NULL if allocation fails.
+extern u8 *map_alloc_chunk(u32 layer, u32 x, u32 y);
+
+// layer, x and y must be inside the map
+static inline u8 map_layer_get_tile(u32 layer, u32 x, u32 y) {
+    const struct map_Layer *l = &map.layers[layer];
+    const u8 *chunk = l->chunks[
+        (y >> MAP_CHUNK_SHIFT) * map.chunks_w + (x >> MAP_CHUNK_SHIFT)
+    ];
+    if(!chunk)
+        return l->fill;
+    return chunk[
+        (y & MAP_CHUNK_MASK) << MAP_CHUNK_SHIFT | (x & MAP_CHUNK_MASK)
+    ];
+}
+
+// layer, x and y must be inside the map
+static inline void map_layer_set_tile(u32 layer, u32 x, u32 y, u8 tile) {
+    const struct map_Layer *l = &map.layers[layer];
+    u8 *chunk = l->chunks[
+        (y >> MAP_CHUNK_SHIFT) * map.chunks_w + (x >> MAP_CHUNK_SHIFT)
+    ];
+    if(!chunk) {
+        if(tile == l->fill)
+            return;
+
+        chunk = map_alloc_chunk(layer, x, y);
+        if(!chunk)
+            return;
+    }
+
+    u8 *old_tile = &chunk[
+        (y & MAP_CHUNK_MASK) << MAP_CHUNK_SHIFT | (x & MAP_CHUNK_MASK)
+    ];
+    if(*old_tile != tile) {
+        *old_tile = tile;
+        map_tiles_changed(layer, x, y, 1, 1);
+    }
+}
+
+// x and y must be inside the map
+static inline u8 map_get_tile(u32 x, u32 y) {
+    return map_layer_get_tile(0, x, y);
+}
 
-#define map_set_tile(x, y, tile)\
-    do{\
-        map.tiles[x + y * map.width] = tile;\
-    }while(0)
+// x and y must be inside the map
+static inline void map_set_tile(u32 x, u32 y, u8 tile) {
+    map_layer_set_tile(0, x, y, tile);
+}
 
 #endif // VULC_LUAG_MAP
@@ -0,0 +1,79 @@
+/* Copyright 2024 Vulcalien
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef VULC_LUAG_PATHFIND
+#define VULC_LUAG_PATHFIND
+
+#include "luag-console.h"
+
+#define PATHFIND_MAX_FIELDS      (64)
+#define PATHFIND_FIELD_MAX_TILES (1024 * 1024)
+
+// default limit of nodes visited by an A* search
+#define PATHFIND_DEFAULT_MAX_NODES (65536)
+
+// flow field directions: 0 = east, then clockwise (y goes down)
+#define PATHFIND_DIR_TARGET      (8)
+#define PATHFIND_DIR_UNREACHABLE (255)
+
+extern const i8 pathfind_dir_x[8];
+extern const i8 pathfind_dir_y[8];
+
+// Restores the default options (all tiles cost 1, layer 0, no
+// diagonal movement) and destroys all flow fields.
+extern void pathfind_reset(void);
+
+// The cost of entering a tile: 0 means that the tile is impassable.
+extern void pathfind_set_cost(u8 tile, u8 cost);
+extern u8 pathfind_get_cost(u8 tile);
+
+// Sets the map layer used to read the tiles
+extern void pathfind_set_layer(u32 layer);
+
+// Diagonal moves cost about 1.4 times more and cannot cut corners
+extern void pathfind_set_diagonal(bool flag);
+
+// Finds a path from (x0, y0) to (x1, y1), visiting at most 'max_nodes'
+// tiles. Returns the number of steps and sets 'path' to the tile
+// indexes (y * map.width + x) after the start, or returns a negative
+// value if there is no path. 'path' is valid until the next search.
+extern i32 pathfind_astar(u32 x0, u32 y0, u32 x1, u32 y1,
+                          u32 max_nodes, const u32 **path);
+
+// Creates a flow field toward (target_x, target_y), covering the given
+// area of the map. Returns the field's id, or a negative value.
+extern i32 pathfind_flow_create(u32 target_x, u32 target_y,
+                                u32 x, u32 y, u32 w, u32 h);
+extern void pathfind_flow_destroy(u32 id);
+
+// Returns the direction to follow from (x, y): a PATHFIND_DIR_*
+// value or an index of pathfind_dir_x/y.
+extern u8 pathfind_flow_dir(u32 id, u32 x, u32 y);
+
+// Returns nonzero if the field does not exist.
+extern int pathfind_flow_area(u32 id, u32 *x, u32 *y, u32 *w, u32 *h);
+
+// Writes the direction of every tile of the field's area, by rows.
+// Returns nonzero if the field does not exist.
+extern int pathfind_flow_dirs(u32 id, u8 *dirs);
+
+// Called when tiles of the map change. Single tiles are repaired
+// locally, larger changes make the fields be recalculated.
+extern void pathfind_tiles_changed(u32 layer, u32 x, u32 y, u32 w, u32 h);
+
+// Called when the whole map is replaced or resized
+extern void pathfind_map_changed(void);
+
+#endif // VULC_LUAG_PATHFIND
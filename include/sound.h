@@ -18,17 +18,75 @@
 
 #include "luag-console.h"
 
+#define SOUND_DEFAULT_FREQUENCY   (44100)
+#define SOUND_DEFAULT_BUFFER_SIZE (2048)
+
+#define SOUND_LOW_LATENCY_FREQUENCY   (48000)
+#define SOUND_LOW_LATENCY_BUFFER_SIZE (256)
+
+// values <= 0 mean "not set"
+struct sound_Config {
+    i32 frequency;
+
+    // in sample frames
+    i32 buffer_size;
+};
+
+struct sound_Stats {
+    // obtained device spec
+    i32 frequency;
+    i32 channels;
+    u32 format;
+
+    // in sample frames, as seen by the mixer callback
+    u32 buffer_size;
+
+    // mixer callback intervals, in microseconds
+    u32 callbacks;
+    u32 expected_interval;
+    u32 min_interval;
+    u32 max_interval;
+    u32 avg_interval;
+    u32 jitter;
+};
+
 // call init after initializing the display
 extern int sound_init(void);
 
 // call destroy before destroying the display
 extern void sound_destroy(void);
 
+// Sets 'key' of 'config' based on 'value'. Recognized keys are:
+// 'preset' ("default" or "low-latency"), 'frequency' and 'buffer-size'.
+// Returns nonzero if the key or the value is invalid.
+extern int sound_parse_option(struct sound_Config *config,
+                              const char *key, const char *value);
+
+// Reopens the audio device if the configuration is different from the
+// current one. Fields that are not set in 'config' are taken from the
+// install configuration. If 'config' is NULL, the install configuration
+// is used. Call this before loading sounds.
+extern int sound_apply_config(const struct sound_Config *config);
+
+// false if sound_init was not called or failed
+extern bool sound_is_open(void);
+
+// resets the mixer callback statistics
+extern void sound_measure_reset(void);
+extern void sound_measure_get(struct sound_Stats *stats);
+
 extern int sound_load(char *sfx_folder);
 
 extern int sound_play(const char *name, i32 loops);
 extern int sound_stop(const char *name);
 
+// Sound ids are valid until the next call to sound_load.
+// Returns -1 if the sound does not exist.
+extern i32 sound_get_id(const char *name);
+
+extern int sound_play_id(i32 id, i32 loops);
+extern int sound_stop_id(i32 id);
+
 extern void sound_stop_all(void);
 
 #endif // VULC_LUAG_SOUND
@@ -0,0 +1,46 @@
+/* Copyright 2024 Vulcalien
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef VULC_LUAG_SPRITE_MASK
+#define VULC_LUAG_SPRITE_MASK
+
+#include "luag-console.h"
+
+#include <SDL.h>
+
+// A sprite drawn at (x, y), as done by display_draw_from_atlas:
+// flipped first, then rotated clockwise by 'rot' * 90 degrees.
+struct mask_Sprite {
+    u8 id;
+    i32 x, y;
+
+    u8 rot;
+    bool h_flip;
+    bool v_flip;
+};
+
+// Calculates the opacity masks of the atlas cells. Transparent pixels
+// (alpha = 0) and pixels of the color key, if set, are not opaque.
+extern void mask_update(SDL_Surface *atlas);
+
+// Returns the mask of a transformed sprite: one byte for each row,
+// with the leftmost pixel in the most significant bit.
+extern const u8 *mask_get(u8 id, u8 rot, bool h_flip, bool v_flip);
+
+// Returns true if an opaque pixel of 'a' overlaps one of 'b'
+extern bool mask_overlap(const struct mask_Sprite *a,
+                         const struct mask_Sprite *b);
+
+#endif // VULC_LUAG_SPRITE_MASK
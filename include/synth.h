@@ -0,0 +1,80 @@
+/* Copyright 2024 Vulcalien
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef VULC_LUAG_SYNTH
+#define VULC_LUAG_SYNTH
+
+#include "luag-console.h"
+
+#define SYNTH_VOICES (4)
+
+#define SYNTH_WAVETABLE_SIZE (32)
+#define SYNTH_PATTERN_MAX    (256)
+
+// notes 0-127 are MIDI note numbers
+#define SYNTH_NOTE_COUNT (128)
+#define SYNTH_REST       (128)
+#define SYNTH_HOLD       (129)
+
+#define SYNTH_MAX_VOLUME (15)
+
+enum synth_Waveform {
+    SYNTH_SQUARE,
+    SYNTH_TRIANGLE,
+    SYNTH_NOISE,
+    SYNTH_WAVE
+};
+
+struct synth_Instrument {
+    enum synth_Waveform waveform;
+
+    // 0 to SYNTH_MAX_VOLUME
+    u8 volume;
+
+    // square wave duty cycle: 0 = 12.5%, 1 = 25%, 2 = 50%, 3 = 75%
+    u8 duty;
+};
+
+// Sets the format of the audio stream. Only signed 16 bit samples are
+// supported: if the format is different, the synthesizer is disabled.
+// Voices are stopped.
+extern void synth_set_format(i32 frequency, u16 format, i32 channels);
+
+// Adds the voices to 'stream'. Called by the audio thread.
+extern void synth_render(u8 *stream, u32 len);
+
+// Plays 'note' on 'voice' for 'length' ticks.
+// Returns nonzero if the voice or the note is invalid.
+extern int synth_note(u32 voice, u32 note, u32 length,
+                      const struct synth_Instrument *instrument);
+
+// Plays a sequence of notes on 'voice', each lasting 'step' ticks.
+// 'notes' contains note names separated by spaces (e.g. "C4 D#4 Eb4"),
+// '-' for a rest and '.' to hold the previous note.
+// Returns nonzero if the arguments are invalid.
+extern int synth_pattern(u32 voice, const char *notes, u32 step, bool loop,
+                         const struct synth_Instrument *instrument);
+
+// if voice is negative, all voices are stopped
+extern void synth_stop(i32 voice);
+
+// 'samples' are SYNTH_WAVETABLE_SIZE 4 bit values (0 to 15)
+extern void synth_set_wavetable(const u8 *samples);
+
+// Converts a note name (e.g. "C4", "F#2", "Bb3") into a MIDI note
+// number. Returns -1 if the name is invalid.
+extern i32 synth_parse_note(const char *name, u32 len);
+
+#endif // VULC_LUAG_SYNTH
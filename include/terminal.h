@@ -24,9 +24,20 @@ extern void terminal_destroy(void);
 extern void terminal_tick(void);
 extern void terminal_render(void);
 
+// Returns how many milliseconds can pass before the terminal needs to
+// be ticked again, or 0 if it has work to do.
+extern u32 terminal_idle_time(void);
+
 extern void terminal_receive_input(const char *c);
 extern void terminal_scroll(i32 amount);
 
+// Sets how many rows are kept in the scrollback, keeping the newest.
+// Returns nonzero if 'rows' is invalid or allocation fails.
+extern int terminal_set_scrollback(u32 rows);
+
+// number of error messages written
+extern u32 terminal_error_count;
+
 extern void terminal_clear(void);
 extern void terminal_write(const char *text, bool is_error);
 
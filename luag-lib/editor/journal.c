@@ -0,0 +1,176 @@
+/* Copyright 2024 Vulcalien
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#include "journal.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+static inline struct journal_Entry *get_entry(struct Journal *journal,
+                                              u32 i) {
+    return &journal->entries[(journal->first + i) % JOURNAL_MAX_ENTRIES];
+}
+
+static void free_entry(struct Journal *journal,
+                       struct journal_Entry *entry) {
+    journal->bytes -= entry->size * sizeof(struct journal_Run);
+
+    free(entry->runs);
+    *entry = (struct journal_Entry) { 0 };
+}
+
+static void drop_oldest(struct Journal *journal) {
+    free_entry(journal, get_entry(journal, 0));
+
+    journal->first = (journal->first + 1) % JOURNAL_MAX_ENTRIES;
+    journal->undo_count--;
+}
+
+static void drop_redo(struct Journal *journal) {
+    for(u32 i = 0; i < journal->redo_count; i++)
+        free_entry(journal, get_entry(journal, journal->undo_count + i));
+    journal->redo_count = 0;
+}
+
+void journal_begin(struct Journal *journal) {
+    journal->grouping = true;
+    journal->open = false;
+}
+
+void journal_end(struct Journal *journal) {
+    journal->grouping = false;
+    journal->open = false;
+}
+
+// A run that continues the previous one is merged with it
+static bool merge_run(struct journal_Entry *entry,
+                      const struct journal_Run *run) {
+    if(entry->count == 0)
+        return false;
+
+    struct journal_Run *last = &entry->runs[entry->count - 1];
+    if(last->layer     != run->layer     || last->y != run->y ||
+       last->old_value != run->old_value ||
+       last->new_value != run->new_value)
+        return false;
+
+    if(last->x + last->len == run->x) {
+        last->len += run->len;
+        return true;
+    }
+    if(run->x + run->len == last->x) {
+        last->x = run->x;
+        last->len += run->len;
+        return true;
+    }
+    return false;
+}
+
+static bool add_run(struct Journal *journal, struct journal_Entry *entry,
+                    const struct journal_Run *run) {
+    if(merge_run(entry, run))
+        return true;
+
+    if(entry->count == entry->size) {
+        u32 new_size = entry->size ? entry->size * 2 : 4;
+        struct journal_Run *new_runs = realloc(
+            entry->runs, new_size * sizeof(struct journal_Run)
+        );
+        if(!new_runs)
+            return false;
+
+        journal->bytes += (new_size - entry->size) *
+                          sizeof(struct journal_Run);
+        entry->runs = new_runs;
+        entry->size = new_size;
+    }
+    entry->runs[entry->count++] = *run;
+    return true;
+}
+
+void journal_record(struct Journal *journal,
+                    const struct journal_Run *run) {
+    drop_redo(journal);
+
+    if(!journal->open) {
+        if(journal->undo_count == JOURNAL_MAX_ENTRIES)
+            drop_oldest(journal);
+
+        journal->undo_count++;
+        journal->open = journal->grouping;
+    }
+
+    struct journal_Entry *entry = get_entry(
+        journal, journal->undo_count - 1
+    );
+    if(!add_run(journal, entry, run)) {
+        // an incomplete entry could not be undone correctly
+        fputs("Editor: could not record the edit, history cleared\n",
+              stderr);
+        journal_clear(journal);
+        return;
+    }
+
+    // the last entry is kept, even if it exceeds the limit alone
+    while(journal->bytes > JOURNAL_MAX_BYTES && journal->undo_count > 1)
+        drop_oldest(journal);
+}
+
+bool journal_undo(struct Journal *journal, JournalApplyFn apply) {
+    if(journal->undo_count == 0)
+        return false;
+    journal->open = false;
+
+    const struct journal_Entry *entry = get_entry(
+        journal, journal->undo_count - 1
+    );
+
+    // later runs can overwrite earlier ones: go backwards
+    for(u32 i = entry->count; i > 0; i--) {
+        const struct journal_Run *run = &entry->runs[i - 1];
+        apply(run, run->old_value);
+    }
+
+    journal->undo_count--;
+    journal->redo_count++;
+    return true;
+}
+
+bool journal_redo(struct Journal *journal, JournalApplyFn apply) {
+    if(journal->redo_count == 0)
+        return false;
+    journal->open = false;
+
+    const struct journal_Entry *entry = get_entry(
+        journal, journal->undo_count
+    );
+    for(u32 i = 0; i < entry->count; i++) {
+        const struct journal_Run *run = &entry->runs[i];
+        apply(run, run->new_value);
+    }
+
+    journal->undo_count++;
+    journal->redo_count--;
+    return true;
+}
+
+void journal_clear(struct Journal *journal) {
+    drop_redo(journal);
+    while(journal->undo_count > 0)
+        drop_oldest(journal);
+
+    journal->first = 0;
+    journal->open = false;
+}
@@ -0,0 +1,81 @@
+/* Copyright 2024 Vulcalien
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef VULC_LUAG_EDITOR_JOURNAL
+#define VULC_LUAG_EDITOR_JOURNAL
+
+#include "luag-console.h"
+
+#include <stddef.h>
+
+// When a limit is exceeded, the oldest entries are forgotten
+#define JOURNAL_MAX_ENTRIES (256)
+#define JOURNAL_MAX_BYTES   (4 * 1024 * 1024)
+
+// 'len' consecutive values of a row, all changed from 'old_value' to
+// 'new_value'. The layer is only used by map edits.
+struct journal_Run {
+    u32 layer;
+    u32 x, y;
+    u32 len;
+
+    u32 old_value;
+    u32 new_value;
+};
+
+struct journal_Entry {
+    struct journal_Run *runs;
+    u32 count;
+    u32 size;
+};
+
+// The entries are stored in a ring: the ones that can be undone come
+// first, followed by the ones that can be redone.
+struct Journal {
+    struct journal_Entry entries[JOURNAL_MAX_ENTRIES];
+    u32 first;
+    u32 undo_count;
+    u32 redo_count;
+
+    size_t bytes;
+
+    // between journal_begin and journal_end
+    bool grouping;
+
+    // the last entry can still receive runs
+    bool open;
+};
+
+// Writes 'value' in the cells of the run
+typedef void (*JournalApplyFn)(const struct journal_Run *run, u32 value);
+
+// The edits recorded between journal_begin and journal_end (e.g. a
+// brush stroke) are undone together. Other edits get an entry each.
+extern void journal_begin(struct Journal *journal);
+extern void journal_end(struct Journal *journal);
+
+// Adds an edit that was just made. The edits that could be redone are
+// forgotten.
+extern void journal_record(struct Journal *journal,
+                           const struct journal_Run *run);
+
+// Return false if there is nothing to undo or redo
+extern bool journal_undo(struct Journal *journal, JournalApplyFn apply);
+extern bool journal_redo(struct Journal *journal, JournalApplyFn apply);
+
+// Forgets all entries, e.g. when the edited data is replaced
+extern void journal_clear(struct Journal *journal);
+
+#endif // VULC_LUAG_EDITOR_JOURNAL
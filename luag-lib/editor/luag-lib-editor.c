@@ -27,12 +27,26 @@
 #include "display.h"
 #include "input.h"
 #include "map.h"
+#include "flood-fill.h"
+
+#include "journal.h"
 
 #define F(name) static int name(lua_State *L)
 
 static SDL_Surface *atlas_surface = NULL;
 static SDL_Texture *atlas_texture = NULL;
 
+// Pixel edits only change the surface: the rectangle containing them
+// is copied to the (streaming) texture before the atlas is drawn, so
+// at most once per frame.
+static bool atlas_dirty = false;
+static i32 dirty_x0, dirty_y0;
+static i32 dirty_x1, dirty_y1;
+
+// edits that can be undone, one journal for each editor
+static struct Journal atlas_journal;
+static struct Journal map_journal;
+
 static void throw_lua_error(lua_State *L, char *msg_format, ...) {
     va_list args;
     va_start(args, msg_format);
@@ -51,6 +65,57 @@ static inline u32 *atlas_get_row(u32 y) {
     return (u32 *)(pixels + pitch * y);
 }
 
+// (x0, y0) and (x1, y1) are included
+static void atlas_mark_dirty(i32 x0, i32 y0, i32 x1, i32 y1) {
+    if(!atlas_dirty) {
+        atlas_dirty = true;
+        dirty_x0 = x0;
+        dirty_y0 = y0;
+        dirty_x1 = x1;
+        dirty_y1 = y1;
+        return;
+    }
+
+    if(x0 < dirty_x0) dirty_x0 = x0;
+    if(y0 < dirty_y0) dirty_y0 = y0;
+    if(x1 > dirty_x1) dirty_x1 = x1;
+    if(y1 > dirty_y1) dirty_y1 = y1;
+}
+
+static void atlas_flush(void) {
+    if(!atlas_dirty)
+        return;
+    atlas_dirty = false;
+
+    SDL_Rect rect = {
+        .x = dirty_x0,                .y = dirty_y0,
+        .w = dirty_x1 - dirty_x0 + 1, .h = dirty_y1 - dirty_y0 + 1
+    };
+
+    const u32 *first_pixel = atlas_get_row(dirty_y0) + dirty_x0;
+    if(SDL_UpdateTexture(atlas_texture, &rect,
+                         first_pixel, atlas_surface->pitch)) {
+        fprintf(
+            stderr,
+            "SDL: could not update editor's atlas texture\n"
+            " - SDL_UpdateTexture: %s\n", SDL_GetError()
+        );
+    }
+}
+
+static void atlas_apply_run(const struct journal_Run *run, u32 value) {
+    u32 *row = atlas_get_row(run->y);
+    for(u32 x = run->x; x < run->x + run->len; x++)
+        row[x] = value;
+
+    atlas_mark_dirty(run->x, run->y, run->x + run->len - 1, run->y);
+}
+
+static void map_apply_run(const struct journal_Run *run, u32 value) {
+    // the journal is cleared when the map changes size
+    map_fill(run->layer, run->x, run->y, run->len, 1, value);
+}
+
 static int load_atlas(lua_State *L, char *filename) {
     SDL_Surface *tmp_surface = NULL;
     if(display_load_atlas(filename, &tmp_surface, &atlas_texture)) {
@@ -73,26 +138,44 @@ static int load_atlas(lua_State *L, char *filename) {
             );
             return -2;
         }
+
+        // replace the texture with one that can be partially updated
+        SDL_Texture *streaming_texture =
+            display_create_streaming_texture(atlas_surface);
+        if(!streaming_texture)
+            return -3;
+
+        SDL_DestroyTexture(atlas_texture);
+        atlas_texture = streaming_texture;
+        atlas_dirty = false;
+
+        journal_clear(&atlas_journal);
     }
 
     return 0;
 }
 
-static void load_map(lua_State *L, char *filename) {
-    if(map_load(filename)) {
-        map = (struct Map) {
-            .width = 10,
-            .height = 10,
-            .tiles = calloc(10 * 10, sizeof(u8))
-        };
-    }
-
-    // update value of map_w and map_h
+// update value of map_w, map_h, map_layers and map_max_layers
+static void update_map_globals(lua_State *L) {
     lua_pushinteger(L, map.width);
     lua_setglobal(L, "map_w");
 
     lua_pushinteger(L, map.height);
     lua_setglobal(L, "map_h");
+
+    lua_pushinteger(L, map.layer_count);
+    lua_setglobal(L, "map_layers");
+
+    lua_pushinteger(L, MAP_MAX_LAYERS);
+    lua_setglobal(L, "map_max_layers");
+}
+
+static void load_map(lua_State *L, char *filename) {
+    if(map_load(filename))
+        map_create(10, 10, 0);
+
+    journal_clear(&map_journal);
+    update_map_globals(L);
 }
 
 F(editor_load_files) {
@@ -110,43 +193,9 @@ F(editor_load_files) {
     return 1;
 }
 
-static int fwrite_u32_big_endian(u32 num, FILE *file) {
-    u8 b[4] = { num >> 24, num >> 16, num >> 8, num };
-
-    if(fwrite(b, sizeof(u8), 4, file) < 4)
-        return -1;
-
-    return 0;
-}
-
+// The map is saved in a background thread: errors are only logged.
 F(editor_save_map) {
-    int err = 0;
-
-    #define filename (USERDATA_FOLDER "/map")
-    FILE *file = fopen(filename, "wb");
-
-    if(!file) {
-        fprintf(stderr, "Editor: could not create map file '%s'\n", filename);
-        err = -1;
-        goto exit;
-    }
-    #undef filename
-
-    if(fwrite_u32_big_endian(map.width, file) ||
-       fwrite_u32_big_endian(map.height, file)) {
-        fputs("Editor: could not write map header\n", stderr);
-        goto exit;
-    }
-
-    u32 map_size = map.width * map.height;
-    if(fwrite(map.tiles, sizeof(u8), map_size, file) < map_size) {
-        fputs("Editor: could not write map content\n", stderr);
-        goto exit;
-    }
-
-    exit:
-    if(file)
-        fclose(file);
+    int err = map_save(USERDATA_FOLDER "/map");
 
     lua_pushinteger(L, err);
     return 1;
@@ -175,48 +224,168 @@ F(editor_update_map_size) {
     lua_Integer selected = luaL_checkinteger(L, 3);
 
     if(w >= 0) {
-        if(w > 8192)
-            w = 8192;
+        if(w > MAP_MAX_SIZE)
+            w = MAP_MAX_SIZE;
     } else {
         w = map.width;
     }
 
     if(h >= 0) {
-        if(h > 8192)
-            h = 8192;
+        if(h > MAP_MAX_SIZE)
+            h = MAP_MAX_SIZE;
     } else {
         h = map.height;
     }
 
-    u8 *new_tiles = malloc((w * h) * sizeof(u8));
+    if(map_resize(w, h, selected)) {
+        throw_lua_error(L, "could not resize the map");
+        return 0;
+    }
 
-    memset(new_tiles, selected, (w * h) * sizeof(u8));
+    // the recorded tiles may be outside the map
+    journal_clear(&map_journal);
+    update_map_globals(L);
+    return 0;
+}
 
-    u32 row_len = map.width < w ? map.width : w;
-    u32 col_len = map.height < h ? map.height : h;
-    for(u32 i = 0; i < col_len; i++) {
-        memcpy(
-            new_tiles + w * i,
-            map.tiles + map.width * i,
-            row_len * sizeof(u8)
-        );
+F(editor_set_layer_count) {
+    lua_Integer count = luaL_checkinteger(L, 1);
+
+    if(count < 1 || count > MAP_MAX_LAYERS) {
+        throw_lua_error(L, "bad argument: count");
+        return 0;
+    }
+
+    if(map_set_layer_count(count)) {
+        throw_lua_error(L, "could not change the number of layers");
+        return 0;
+    }
+
+    journal_clear(&map_journal);
+    update_map_globals(L);
+    return 0;
+}
+
+// Returns the visibility of the layer, after changing it if the flag
+// is set.
+F(editor_layer_visible) {
+    lua_Integer layer = luaL_checkinteger(L, 1);
+
+    if(layer < 0 || layer >= map.layer_count) {
+        throw_lua_error(L, "bad argument: layer");
+        return 0;
+    }
+
+    if(!lua_isnoneornil(L, 2))
+        map.layers[layer].visible = lua_toboolean(L, 2);
+
+    lua_pushboolean(L, map.layers[layer].visible);
+    return 1;
+}
+
+F(editor_set_tile) {
+    lua_Integer x     = luaL_checkinteger(L, 1);
+    lua_Integer y     = luaL_checkinteger(L, 2);
+    lua_Integer id    = luaL_checkinteger(L, 3);
+    lua_Integer layer = luaL_checkinteger(L, 4);
+
+    char *err_msg = NULL;
+    if(x < 0 || x >= map.width)
+        err_msg = "bad argument: x";
+    else if(y < 0 || y >= map.height)
+        err_msg = "bad argument: y";
+    else if(id < 0 || id >= 256)
+        err_msg = "bad argument: id";
+    else if(layer < 0 || layer >= map.layer_count)
+        err_msg = "bad argument: layer";
+
+    if(err_msg) {
+        throw_lua_error(L, err_msg);
+        return 0;
+    }
+
+    u8 old_tile = map_layer_get_tile(layer, x, y);
+    if(old_tile != id) {
+        map_layer_set_tile(layer, x, y, id);
+
+        journal_record(&map_journal, &(struct journal_Run) {
+            .layer = layer,
+            .x = x, .y = y,
+            .len = 1,
+            .old_value = old_tile,
+            .new_value = id
+        });
+    }
+    lua_pushboolean(L, old_tile != id);
+    return 1;
+}
+
+struct MapFill {
+    u32 layer;
+    u8 tile;
+    u8 target;
+};
+
+// records the spans filled by map_flood_fill
+static void map_fill_record(void *data, u32 x0, u32 x1, u32 y) {
+    const struct MapFill *fill = data;
+
+    journal_record(&map_journal, &(struct journal_Run) {
+        .layer = fill->layer,
+        .x = x0, .y = y,
+        .len = x1 - x0 + 1,
+        .old_value = fill->target,
+        .new_value = fill->tile
+    });
+}
+
+// Fills the area of equal tiles connected to (x, y).
+// Returns true if any tile was changed.
+F(editor_map_fill) {
+    lua_Integer x     = luaL_checkinteger(L, 1);
+    lua_Integer y     = luaL_checkinteger(L, 2);
+    lua_Integer id    = luaL_checkinteger(L, 3);
+    lua_Integer layer = luaL_checkinteger(L, 4);
+
+    char *err_msg = NULL;
+    if(x < 0 || x >= map.width)
+        err_msg = "bad argument: x";
+    else if(y < 0 || y >= map.height)
+        err_msg = "bad argument: y";
+    else if(id < 0 || id >= 256)
+        err_msg = "bad argument: id";
+    else if(layer < 0 || layer >= map.layer_count)
+        err_msg = "bad argument: layer";
+
+    if(err_msg) {
+        throw_lua_error(L, err_msg);
+        return 0;
     }
 
-    free(map.tiles);
-    map = (struct Map) {
-        .width = w,
-        .height = h,
-        .tiles = new_tiles
+    struct MapFill fill = {
+        .layer = layer,
+        .tile = id,
+        .target = map_layer_get_tile(layer, x, y)
     };
+    if(fill.target == id) {
+        lua_pushboolean(L, false);
+        return 1;
+    }
 
-    // update map_w and map_h
-    lua_pushinteger(L, map.width);
-    lua_setglobal(L, "map_w");
+    // the spans are recorded as a single entry
+    const bool was_grouping = map_journal.grouping;
+    if(!was_grouping)
+        journal_begin(&map_journal);
 
-    lua_pushinteger(L, map.height);
-    lua_setglobal(L, "map_h");
+    i64 filled = map_flood_fill(layer, x, y, id, map_fill_record, &fill);
+    if(filled < 0)
+        fputs("Editor: could not fill the map\n", stderr);
 
-    return 0;
+    if(!was_grouping)
+        journal_end(&map_journal);
+
+    lua_pushboolean(L, filled != 0);
+    return 1;
 }
 
 F(editor_atlas_set_pixel) {
@@ -234,11 +403,17 @@ F(editor_atlas_set_pixel) {
     }
 
     u32 *row = atlas_get_row(y);
-    row[x] = color;
-
-    // update atlas_texture
-    display_update_atlas(atlas_surface, &atlas_texture);
-
+    if(row[x] != color) {
+        journal_record(&atlas_journal, &(struct journal_Run) {
+            .x = x, .y = y,
+            .len = 1,
+            .old_value = row[x],
+            .new_value = color
+        });
+
+        row[x] = color;
+        atlas_mark_dirty(x, y, x, y);
+    }
     return 0;
 }
 
@@ -261,28 +436,30 @@ F(editor_atlas_get_pixel) {
     return 1;
 }
 
-// If the pixel (x, y) is the same as 'target_color' and (x, y) is
-// within the bounds (x0, y0, x1, y1), set the pixel (x, y) to 'color'
-// and recoursively try to do the same for adiacent pixels.
-static void fill(i32 x, i32 y, u32 color, u32 target_color,
-                 i32 x0, i32 y0, i32 x1, i32 y1) {
-    // check if (x, y) is within bounds
-    if(x < x0 || y < y0 || x > x1 || y > y1)
-        return;
-
-    u32 *row = atlas_get_row(y);
+struct AtlasFill {
+    u32 color;
+    u32 target_color;
+};
 
-    // check if (x, y) has the color 'target_color'
-    if(row[x] != target_color)
-        return;
+static bool atlas_fill_matches(void *data, u32 x, u32 y) {
+    const struct AtlasFill *fill = data;
+    return atlas_get_row(y)[x] == fill->target_color;
+}
 
-    row[x] = color;
+static bool atlas_fill_span(void *data, u32 x0, u32 x1, u32 y) {
+    const struct AtlasFill *fill = data;
 
-    // recoursively try to do the same for adiacent pixels
-    fill(x - 1, y,     color, target_color, x0, y0, x1, y1);
-    fill(x,     y - 1, color, target_color, x0, y0, x1, y1);
-    fill(x + 1, y,     color, target_color, x0, y0, x1, y1);
-    fill(x,     y + 1, color, target_color, x0, y0, x1, y1);
+    u32 *row = atlas_get_row(y);
+    for(u32 x = x0; x <= x1; x++)
+        row[x] = fill->color;
+
+    journal_record(&atlas_journal, &(struct journal_Run) {
+        .x = x0, .y = y,
+        .len = x1 - x0 + 1,
+        .old_value = fill->target_color,
+        .new_value = fill->color
+    });
+    return true;
 }
 
 F(editor_atlas_fill) {
@@ -328,13 +505,67 @@ F(editor_atlas_fill) {
     if(target_color == color)
         return 0;
 
-    // fill and update atlas_texture
-    fill(x, y, color, target_color, x0, y0, x1, y1);
-    display_update_atlas(atlas_surface, &atlas_texture);
+    struct AtlasFill fill = {
+        .color = color,
+        .target_color = target_color
+    };
+    const struct flood_Rect bounds = { x0, y0, x1, y1 };
+    struct flood_Rect changed;
+
+    // the spans are recorded as a single entry
+    const bool was_grouping = atlas_journal.grouping;
+    if(!was_grouping)
+        journal_begin(&atlas_journal);
+
+    flood_fill(
+        x, y, &bounds, atlas_fill_matches, atlas_fill_span, &fill,
+        &changed
+    );
+
+    if(!was_grouping)
+        journal_end(&atlas_journal);
+    if(changed.x0 <= changed.x1)
+        atlas_mark_dirty(changed.x0, changed.y0, changed.x1, changed.y1);
 
     return 0;
 }
 
+// Edits made between editor_journal_begin and editor_journal_end (e.g.
+// while the mouse button is held) are undone together.
+F(editor_journal_begin) {
+    journal_begin(&atlas_journal);
+    journal_begin(&map_journal);
+    return 0;
+}
+
+F(editor_journal_end) {
+    journal_end(&atlas_journal);
+    journal_end(&map_journal);
+    return 0;
+}
+
+// Undo and redo functions return true if anything changed
+
+F(editor_atlas_undo) {
+    lua_pushboolean(L, journal_undo(&atlas_journal, atlas_apply_run));
+    return 1;
+}
+
+F(editor_atlas_redo) {
+    lua_pushboolean(L, journal_redo(&atlas_journal, atlas_apply_run));
+    return 1;
+}
+
+F(editor_map_undo) {
+    lua_pushboolean(L, journal_undo(&map_journal, map_apply_run));
+    return 1;
+}
+
+F(editor_map_redo) {
+    lua_pushboolean(L, journal_redo(&map_journal, map_apply_run));
+    return 1;
+}
+
 F(editor_spr) {
     lua_Integer id = luaL_checkinteger(L, 1);
     lua_Integer x  = luaL_checkinteger(L, 2);
@@ -359,6 +590,7 @@ F(editor_spr) {
     if(err_msg) {
         throw_lua_error(L, err_msg);
     } else {
+        atlas_flush();
         display_draw_from_atlas(
             atlas_texture,
             id, x, y,
@@ -370,6 +602,7 @@ F(editor_spr) {
     return 0;
 }
 
+// Draws the visible layers, ignoring their parallax and offset
 F(editor_maprender) {
     lua_Integer scale = lua_isnoneornil(L, 1)
                         ? 1 : luaL_checkinteger(L, 1);
@@ -386,36 +619,11 @@ F(editor_maprender) {
     if(err_msg) {
         throw_lua_error(L, err_msg);
     } else {
-        const u32 tile_size = SPRITE_SIZE * scale;
-
-        i32 xt0 = xoff / tile_size;
-        if(xoff < 0) xt0--;
-
-        i32 yt0 = yoff / tile_size;
-        if(yoff < 0) yt0--;
-
-        i32 xt1 = xt0 + (DISPLAY_WIDTH / tile_size) + 1;
-        i32 yt1 = yt0 + (DISPLAY_HEIGHT / tile_size) + 1;
-
-        // check boundaries
-        if(xt0 < 0) xt0 = 0;
-        if(yt0 < 0) yt0 = 0;
-
-        if(xt1 > map.width) xt1 = map.width;
-        if(yt1 > map.height) yt1 = map.height;
-
-        for(u32 yt = yt0; yt < yt1; yt++) {
-            for(u32 xt = xt0; xt < xt1; xt++) {
-                u32 id = map_get_tile(xt, yt);
-                display_draw_from_atlas(
-                    atlas_texture,
-                    id, xt * tile_size - xoff, yt * tile_size - yoff,
-                    scale, 1, 1,
-                    0, false, false,
-                    0xff, 0xffffff
-                );
-            }
-        }
+        atlas_flush();
+        map_render(
+            atlas_texture, 0xffffffff, scale, xoff, yoff,
+            false, MAP_FOG_NONE
+        );
     }
     return 0;
 }
@@ -439,11 +647,22 @@ int luag_lib_load(lua_State *L) {
     lua_register(L, "editor_save_atlas", editor_save_atlas);
 
     lua_register(L, "editor_update_map_size", editor_update_map_size);
+    lua_register(L, "editor_set_layer_count", editor_set_layer_count);
+    lua_register(L, "editor_layer_visible", editor_layer_visible);
+    lua_register(L, "editor_set_tile", editor_set_tile);
+    lua_register(L, "editor_map_fill", editor_map_fill);
 
     lua_register(L, "editor_atlas_set_pixel", editor_atlas_set_pixel);
     lua_register(L, "editor_atlas_get_pixel", editor_atlas_get_pixel);
     lua_register(L, "editor_atlas_fill", editor_atlas_fill);
 
+    lua_register(L, "editor_journal_begin", editor_journal_begin);
+    lua_register(L, "editor_journal_end", editor_journal_end);
+    lua_register(L, "editor_atlas_undo", editor_atlas_undo);
+    lua_register(L, "editor_atlas_redo", editor_atlas_redo);
+    lua_register(L, "editor_map_undo", editor_map_undo);
+    lua_register(L, "editor_map_redo", editor_map_redo);
+
     lua_register(L, "editor_spr", editor_spr);
     lua_register(L, "editor_maprender", editor_maprender);
 
@@ -454,6 +673,9 @@ int luag_lib_load(lua_State *L) {
 }
 
 int luag_lib_destroy(void) {
+    journal_clear(&atlas_journal);
+    journal_clear(&map_journal);
+
     if(atlas_surface)
         SDL_FreeSurface(atlas_surface);
     if(atlas_texture)
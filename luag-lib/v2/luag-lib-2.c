@@ -18,8 +18,13 @@
 #include "display.h"
 #include "lua-engine.h"
 #include "map.h"
+#include "pathfind.h"
+#include "fov.h"
+#include "broadphase.h"
 #include "input.h"
 #include "sound.h"
+#include "synth.h"
+#include "sprite-mask.h"
 
 #include <stdio.h>
 #include <string.h>
@@ -131,6 +136,15 @@ F(luag_exit) {
     return 0;
 }
 
+F(low_power) {
+    lua_Integer max_wait = luaL_optinteger(L, 1, 0);
+    if(max_wait < 0)
+        max_wait = 0;
+
+    engine_set_low_power(max_wait);
+    return 0;
+}
+
 F(luag_log) {
     // TODO
     return 0;
@@ -279,24 +293,196 @@ F(scroll) {
 }
 
 // sound
-F(sfx) {
+F(sfx_id) {
     const char *name = luaL_checkstring(L, 1);
-    if(sound_play(name, 0))
+
+    i32 id = sound_get_id(name);
+    if(id < 0) {
         throw_lua_error(L, "bad argument: sound '%s' does not exist", name);
+        return 0;
+    }
+
+    lua_pushinteger(L, id);
+    return 1;
+}
+
+// accepts either a sound name or a sound id
+static void play_sound(lua_State *L, i32 loops) {
+    if(lua_isinteger(L, 1)) {
+        lua_Integer id = lua_tointeger(L, 1);
+        if(id < 0 || id > INT32_MAX || sound_play_id(id, loops))
+            throw_lua_error(L, "bad argument: sound '%I' does not exist", id);
+    } else {
+        const char *name = luaL_checkstring(L, 1);
+        if(sound_play(name, loops))
+            throw_lua_error(L, "bad argument: sound '%s' does not exist", name);
+    }
+}
+
+F(sfx) {
+    play_sound(L, 0);
     return 0;
 }
 
 F(sfx_loop) {
-    const char *name = luaL_checkstring(L, 1);
-    if(sound_play(name, -1))
-        throw_lua_error(L, "bad argument: sound '%s' does not exist", name);
+    play_sound(L, -1);
     return 0;
 }
 
 F(sfx_stop) {
-    const char *name = luaL_checkstring(L, 1);
-    if(sound_stop(name))
-        throw_lua_error(L, "bad argument: sound '%s' does not exist", name);
+    if(lua_isinteger(L, 1)) {
+        lua_Integer id = lua_tointeger(L, 1);
+        if(id < 0 || id > INT32_MAX || sound_stop_id(id))
+            throw_lua_error(L, "bad argument: sound '%I' does not exist", id);
+    } else {
+        const char *name = luaL_checkstring(L, 1);
+        if(sound_stop(name))
+            throw_lua_error(L, "bad argument: sound '%s' does not exist", name);
+    }
+    return 0;
+}
+
+// synth
+static int get_instrument(lua_State *L, int index,
+                          struct synth_Instrument *instrument) {
+    *instrument = (struct synth_Instrument) {
+        .waveform = SYNTH_SQUARE,
+        .volume   = SYNTH_MAX_VOLUME,
+        .duty     = 2
+    };
+
+    if(lua_isnoneornil(L, index))
+        return 0;
+    luaL_checktype(L, index, LUA_TTABLE);
+
+    lua_getfield(L, index, "wave");
+    const char *wave = luaL_optstring(L, -1, "square");
+
+    lua_getfield(L, index, "volume");
+    lua_Integer volume = luaL_optinteger(L, -1, SYNTH_MAX_VOLUME);
+
+    lua_getfield(L, index, "duty");
+    lua_Integer duty = luaL_optinteger(L, -1, 2);
+
+    if(!strcmp(wave, "square"))
+        instrument->waveform = SYNTH_SQUARE;
+    else if(!strcmp(wave, "triangle"))
+        instrument->waveform = SYNTH_TRIANGLE;
+    else if(!strcmp(wave, "noise"))
+        instrument->waveform = SYNTH_NOISE;
+    else if(!strcmp(wave, "wave"))
+        instrument->waveform = SYNTH_WAVE;
+    else {
+        throw_lua_error(L, "bad argument: wave '%s' does not exist", wave);
+        return -1;
+    }
+
+    if(volume < 0 || volume > SYNTH_MAX_VOLUME) {
+        throw_lua_error(L, "bad argument: volume");
+        return -1;
+    }
+    if(duty < 0 || duty > 3) {
+        throw_lua_error(L, "bad argument: duty");
+        return -1;
+    }
+
+    instrument->volume = volume;
+    instrument->duty   = duty;
+    return 0;
+}
+
+F(luag_synth_note) {
+    lua_Integer voice  = luaL_checkinteger(L, 1);
+    lua_Integer length = luaL_checkinteger(L, 3);
+
+    lua_Integer note;
+    if(lua_isinteger(L, 2)) {
+        note = lua_tointeger(L, 2);
+    } else {
+        size_t len;
+        const char *name = luaL_checklstring(L, 2, &len);
+        note = synth_parse_note(name, len);
+    }
+
+    struct synth_Instrument instrument;
+    if(get_instrument(L, 4, &instrument))
+        return 0;
+
+    char *err_msg = NULL;
+    if(voice < 0 || voice >= SYNTH_VOICES)
+        err_msg = "bad argument: voice";
+    else if(note < 0 || note >= SYNTH_NOTE_COUNT)
+        err_msg = "bad argument: note";
+    else if(length <= 0 || length > UINT32_MAX)
+        err_msg = "bad argument: length";
+
+    if(err_msg)
+        throw_lua_error(L, err_msg);
+    else
+        synth_note(voice, note, length, &instrument);
+    return 0;
+}
+
+F(luag_synth_pattern) {
+    lua_Integer voice = luaL_checkinteger(L, 1);
+    const char *notes = luaL_checkstring(L, 2);
+    lua_Integer step  = luaL_checkinteger(L, 3);
+
+    struct synth_Instrument instrument;
+    if(get_instrument(L, 4, &instrument))
+        return 0;
+
+    bool loop = false;
+    if(!lua_isnoneornil(L, 4)) {
+        lua_getfield(L, 4, "loop");
+        loop = lua_toboolean(L, -1);
+    }
+
+    char *err_msg = NULL;
+    if(voice < 0 || voice >= SYNTH_VOICES)
+        err_msg = "bad argument: voice";
+    else if(step <= 0 || step > UINT32_MAX)
+        err_msg = "bad argument: step";
+    else if(synth_pattern(voice, notes, step, loop, &instrument))
+        err_msg = "bad argument: notes";
+
+    if(err_msg)
+        throw_lua_error(L, err_msg);
+    return 0;
+}
+
+// synth_stop([voice]): without a voice, all voices are stopped
+F(luag_synth_stop) {
+    if(lua_isnoneornil(L, 1)) {
+        synth_stop(-1);
+        return 0;
+    }
+
+    lua_Integer voice = luaL_checkinteger(L, 1);
+    if(voice < 0 || voice >= SYNTH_VOICES)
+        throw_lua_error(L, "bad argument: voice");
+    else
+        synth_stop(voice);
+    return 0;
+}
+
+F(luag_synth_wave) {
+    luaL_checktype(L, 1, LUA_TTABLE);
+
+    u8 samples[SYNTH_WAVETABLE_SIZE];
+    for(u32 i = 0; i < SYNTH_WAVETABLE_SIZE; i++) {
+        lua_geti(L, 1, i + 1);
+        lua_Integer sample = luaL_checkinteger(L, -1);
+        lua_pop(L, 1);
+
+        if(sample < 0 || sample > 15) {
+            throw_lua_error(L, "bad argument: sample %d", (int) i + 1);
+            return 0;
+        }
+        samples[i] = sample;
+    }
+
+    synth_set_wavetable(samples);
     return 0;
 }
 
@@ -435,31 +621,96 @@ F(spr) {
     return 0;
 }
 
+// reads a table { id, x, y, rot, h_flip, v_flip }
+static char *check_mask_sprite(lua_State *L, int arg,
+                               struct mask_Sprite *sprite) {
+    luaL_checktype(L, arg, LUA_TTABLE);
+
+    lua_getfield(L, arg, "id");
+    lua_Integer id = luaL_checkinteger(L, -1);
+
+    lua_getfield(L, arg, "x");
+    lua_Integer x = luaL_checkinteger(L, -1);
+
+    lua_getfield(L, arg, "y");
+    lua_Integer y = luaL_checkinteger(L, -1);
+
+    lua_getfield(L, arg, "rot");
+    lua_Integer rot = luaL_optinteger(L, -1, 0);
+
+    lua_getfield(L, arg, "h_flip");
+    bool h_flip = lua_toboolean(L, -1);
+
+    lua_getfield(L, arg, "v_flip");
+    bool v_flip = lua_toboolean(L, -1);
+
+    lua_pop(L, 6);
+
+    if(id < 0 || id >= 256)
+        return "bad argument: id";
+    if(x < INT32_MIN || x > INT32_MAX)
+        return "bad argument: x";
+    if(y < INT32_MIN || y > INT32_MAX)
+        return "bad argument: y";
+
+    *sprite = (struct mask_Sprite) {
+        .id = id,
+        .x = x, .y = y,
+
+        // rotations are multiples of 90 degrees, as in 'spr'
+        .rot = ((rot % 4) + 4) % 4,
+        .h_flip = h_flip,
+        .v_flip = v_flip
+    };
+    return NULL;
+}
+
+// Returns true if the opaque pixels of two sprites overlap
+F(spr_overlap) {
+    struct mask_Sprite a, b;
+
+    char *err_msg = check_mask_sprite(L, 1, &a);
+    if(!err_msg)
+        err_msg = check_mask_sprite(L, 2, &b);
+
+    if(err_msg) {
+        throw_lua_error(L, err_msg);
+        return 0;
+    }
+
+    lua_pushboolean(L, mask_overlap(&a, &b));
+    return 1;
+}
+
 // map
 F(get_tile) {
-    lua_Integer x = luaL_checkinteger(L, 1);
-    lua_Integer y = luaL_checkinteger(L, 2);
+    lua_Integer x     = luaL_checkinteger(L, 1);
+    lua_Integer y     = luaL_checkinteger(L, 2);
+    lua_Integer layer = luaL_optinteger(L, 3, 0);
 
     char *err_msg = NULL;
     if(x < 0 || x >= map.width)
         err_msg = "bad argument: x";
     else if(y < 0 || y >= map.height)
         err_msg = "bad argument: y";
+    else if(layer < 0 || layer >= map.layer_count)
+        err_msg = "bad argument: layer";
 
     if(err_msg) {
         throw_lua_error(L, err_msg);
         return 0;
     } else {
-        u8 tile = map_get_tile(x, y);
+        u8 tile = map_layer_get_tile(layer, x, y);
         lua_pushinteger(L, tile);
         return 1;
     }
 }
 
 F(set_tile) {
-    lua_Integer x  = luaL_checkinteger(L, 1);
-    lua_Integer y  = luaL_checkinteger(L, 2);
-    lua_Integer id = luaL_checkinteger(L, 3);
+    lua_Integer x     = luaL_checkinteger(L, 1);
+    lua_Integer y     = luaL_checkinteger(L, 2);
+    lua_Integer id    = luaL_checkinteger(L, 3);
+    lua_Integer layer = luaL_optinteger(L, 4, 0);
 
     char *err_msg = NULL;
     if(x < 0 || x >= map.width)
@@ -468,65 +719,811 @@ F(set_tile) {
         err_msg = "bad argument: y";
     else if(id < 0 || id >= 256)
         err_msg = "bad argument: id";
+    else if(layer < 0 || layer >= map.layer_count)
+        err_msg = "bad argument: layer";
 
     if(err_msg) {
         throw_lua_error(L, err_msg);
         return 0;
     } else {
-        u8 old_tile = map_get_tile(x, y);
-        map_set_tile(x, y, id);
+        u8 old_tile = map_layer_get_tile(layer, x, y);
+        map_layer_set_tile(layer, x, y, id);
         lua_pushboolean(L, old_tile != id);
         return 1;
     }
 }
 
+F(map_layer) {
+    lua_Integer layer = luaL_checkinteger(L, 1);
+    if(layer < 0 || layer >= map.layer_count) {
+        throw_lua_error(L, "bad argument: layer");
+        return 0;
+    }
+    struct map_Layer *l = &map.layers[layer];
+
+    if(!lua_isnoneornil(L, 2)) {
+        luaL_checktype(L, 2, LUA_TTABLE);
+
+        lua_getfield(L, 2, "visible");
+        l->visible = luaL_opt(L, lua_toboolean, -1, l->visible);
+
+        lua_getfield(L, 2, "parallax_x");
+        l->parallax_x = luaL_optinteger(L, -1, l->parallax_x);
+
+        lua_getfield(L, 2, "parallax_y");
+        l->parallax_y = luaL_optinteger(L, -1, l->parallax_y);
+
+        lua_getfield(L, 2, "x");
+        l->offset_x = luaL_optinteger(L, -1, l->offset_x);
+
+        lua_getfield(L, 2, "y");
+        l->offset_y = luaL_optinteger(L, -1, l->offset_y);
+    }
+
+    lua_createtable(L, 0, 5);
+
+    lua_pushboolean(L, l->visible);
+    lua_setfield(L, -2, "visible");
+
+    lua_pushinteger(L, l->parallax_x);
+    lua_setfield(L, -2, "parallax_x");
+
+    lua_pushinteger(L, l->parallax_y);
+    lua_setfield(L, -2, "parallax_y");
+
+    lua_pushinteger(L, l->offset_x);
+    lua_setfield(L, -2, "x");
+
+    lua_pushinteger(L, l->offset_y);
+    lua_setfield(L, -2, "y");
+
+    return 1;
+}
+
 F(maprender) {
     lua_Integer scale = luaL_optinteger(L, 1, 1);
 
     lua_Integer xoff = luaL_optinteger(L, 2, 0);
     lua_Integer yoff = luaL_optinteger(L, 3, 0);
 
+    // layers: all, a single one or a list
+    u32 layer_mask = 0xffffffff;
+    if(lua_istable(L, 4)) {
+        layer_mask = 0;
+
+        lua_Integer len = luaL_len(L, 4);
+        for(lua_Integer i = 1; i <= len; i++) {
+            lua_geti(L, 4, i);
+            lua_Integer layer = luaL_checkinteger(L, -1);
+            lua_pop(L, 1);
+
+            if(layer < 0 || layer >= map.layer_count) {
+                throw_lua_error(L, "bad argument: layers");
+                return 0;
+            }
+            layer_mask |= 1 << layer;
+        }
+    } else if(!lua_isnoneornil(L, 4)) {
+        lua_Integer layer = luaL_checkinteger(L, 4);
+        if(layer < 0 || layer >= map.layer_count) {
+            throw_lua_error(L, "bad argument: layers");
+            return 0;
+        }
+        layer_mask = 1 << layer;
+    }
+
+    // fog: nil, "dim" or "hide"
+    enum map_Fog fog = MAP_FOG_NONE;
+    const char *fog_name = luaL_optstring(L, 5, NULL);
+
     char *err_msg = NULL;
     if(scale <= 0)
         err_msg = "bad argument: scale";
+    else if(fog_name && !strcmp(fog_name, "dim"))
+        fog = MAP_FOG_DIM;
+    else if(fog_name && !strcmp(fog_name, "hide"))
+        fog = MAP_FOG_HIDE;
+    else if(fog_name)
+        err_msg = "bad argument: fog";
+
+    if(err_msg)
+        throw_lua_error(L, err_msg);
+    else
+        map_render(NULL, layer_mask, scale, xoff, yoff, true, fog);
+    return 0;
+}
+
+// map_animation(tile, [frames, period]): 'frames' is a list of tile
+// ids, each drawn for 'period' ticks. Without frames, the animation of
+// the tile is removed.
+F(map_animation) {
+    lua_Integer tile = luaL_checkinteger(L, 1);
+    if(tile < 0 || tile >= 256) {
+        throw_lua_error(L, "bad argument: tile");
+        return 0;
+    }
+
+    if(lua_isnoneornil(L, 2)) {
+        map_set_animation(tile, NULL, 0, 1);
+        return 0;
+    }
+
+    luaL_checktype(L, 2, LUA_TTABLE);
+    lua_Integer period = luaL_checkinteger(L, 3);
+
+    lua_Integer frame_count = luaL_len(L, 2);
+    if(frame_count <= 0 || frame_count > MAP_ANIM_MAX_FRAMES) {
+        throw_lua_error(L, "bad argument: frames");
+        return 0;
+    }
+    if(period <= 0 || period > UINT32_MAX) {
+        throw_lua_error(L, "bad argument: period");
+        return 0;
+    }
+
+    u8 frames[MAP_ANIM_MAX_FRAMES];
+    for(lua_Integer i = 0; i < frame_count; i++) {
+        lua_geti(L, 2, i + 1);
+        lua_Integer frame = luaL_checkinteger(L, -1);
+        lua_pop(L, 1);
+
+        if(frame < 0 || frame >= 256) {
+            throw_lua_error(L, "bad argument: frames");
+            return 0;
+        }
+        frames[i] = frame;
+    }
+
+    map_set_animation(tile, frames, frame_count, period);
+    return 0;
+}
+
+// tile buffers
+#define TILE_BUFFER_METATABLE "luag.tile_buffer"
+
+struct TileBuffer {
+    lua_Integer size;
+    u8 tiles[];
+};
+
+F(tile_buffer) {
+    lua_Integer size = luaL_checkinteger(L, 1);
+    if(size < 0 || size > (lua_Integer) MAP_MAX_SIZE * MAP_MAX_SIZE) {
+        throw_lua_error(L, "bad argument: size");
+        return 0;
+    }
+
+    struct TileBuffer *buffer = lua_newuserdatauv(
+        L, sizeof(struct TileBuffer) + size, 0
+    );
+    buffer->size = size;
+    memset(buffer->tiles, 0, size);
+
+    luaL_setmetatable(L, TILE_BUFFER_METATABLE);
+    return 1;
+}
+
+// indexes start from 0, like tile coordinates
+F(tile_buffer_index) {
+    struct TileBuffer *buffer = luaL_checkudata(L, 1, TILE_BUFFER_METATABLE);
+    lua_Integer i = luaL_checkinteger(L, 2);
+
+    if(i < 0 || i >= buffer->size)
+        lua_pushnil(L);
+    else
+        lua_pushinteger(L, buffer->tiles[i]);
+    return 1;
+}
+
+F(tile_buffer_newindex) {
+    struct TileBuffer *buffer = luaL_checkudata(L, 1, TILE_BUFFER_METATABLE);
+    lua_Integer i  = luaL_checkinteger(L, 2);
+    lua_Integer id = luaL_checkinteger(L, 3);
+
+    char *err_msg = NULL;
+    if(i < 0 || i >= buffer->size)
+        err_msg = "bad index";
+    else if(id < 0 || id >= 256)
+        err_msg = "bad tile id";
+
+    if(err_msg)
+        throw_lua_error(L, err_msg);
+    else
+        buffer->tiles[i] = id;
+    return 0;
+}
+
+F(tile_buffer_len) {
+    struct TileBuffer *buffer = luaL_checkudata(L, 1, TILE_BUFFER_METATABLE);
+
+    lua_pushinteger(L, buffer->size);
+    return 1;
+}
+
+static void register_tile_buffer(lua_State *L) {
+    luaL_newmetatable(L, TILE_BUFFER_METATABLE);
+
+    lua_pushcfunction(L, tile_buffer_index);
+    lua_setfield(L, -2, "__index");
+
+    lua_pushcfunction(L, tile_buffer_newindex);
+    lua_setfield(L, -2, "__newindex");
+
+    lua_pushcfunction(L, tile_buffer_len);
+    lua_setfield(L, -2, "__len");
+
+    lua_pop(L, 1);
+}
+
+// map regions
+static char *check_region(lua_Integer x, lua_Integer y,
+                          lua_Integer w, lua_Integer h,
+                          lua_Integer layer) {
+    if(x < 0 || x > map.width)
+        return "bad argument: x";
+    if(y < 0 || y > map.height)
+        return "bad argument: y";
+    if(w < 0 || w > map.width - x)
+        return "bad argument: w";
+    if(h < 0 || h > map.height - y)
+        return "bad argument: h";
+    if(layer < 0 || layer >= map.layer_count)
+        return "bad argument: layer";
+    return NULL;
+}
+
+// Returns the tiles of a string or a tile buffer, or NULL if the value
+// at 'index' is neither of them.
+static const u8 *get_tiles(lua_State *L, int index, size_t *size) {
+    if(lua_type(L, index) == LUA_TSTRING)
+        return (const u8 *) lua_tolstring(L, index, size);
+
+    struct TileBuffer *buffer = luaL_testudata(
+        L, index, TILE_BUFFER_METATABLE
+    );
+    if(!buffer)
+        return NULL;
 
+    *size = buffer->size;
+    return buffer->tiles;
+}
+
+// map_read_region(x, y, w, h, [layer], [buffer])
+F(luag_map_read_region) {
+    lua_Integer x     = luaL_checkinteger(L, 1);
+    lua_Integer y     = luaL_checkinteger(L, 2);
+    lua_Integer w     = luaL_checkinteger(L, 3);
+    lua_Integer h     = luaL_checkinteger(L, 4);
+    lua_Integer layer = luaL_optinteger(L, 5, 0);
+
+    char *err_msg = check_region(x, y, w, h, layer);
     if(err_msg) {
         throw_lua_error(L, err_msg);
+        return 0;
+    }
+
+    // read into the buffer, if there is one
+    if(!lua_isnoneornil(L, 6)) {
+        struct TileBuffer *buffer = luaL_checkudata(
+            L, 6, TILE_BUFFER_METATABLE
+        );
+        if(buffer->size < w * h) {
+            throw_lua_error(L, "bad argument: buffer is too small");
+            return 0;
+        }
+
+        map_read_region(layer, x, y, w, h, buffer->tiles);
+        lua_pushvalue(L, 6);
+        return 1;
+    }
+
+    luaL_Buffer b;
+    char *tiles = luaL_buffinitsize(L, &b, w * h);
+    map_read_region(layer, x, y, w, h, (u8 *) tiles);
+    luaL_pushresultsize(&b, w * h);
+    return 1;
+}
+
+// map_write_region(x, y, w, h, tiles, [layer])
+F(luag_map_write_region) {
+    lua_Integer x     = luaL_checkinteger(L, 1);
+    lua_Integer y     = luaL_checkinteger(L, 2);
+    lua_Integer w     = luaL_checkinteger(L, 3);
+    lua_Integer h     = luaL_checkinteger(L, 4);
+    lua_Integer layer = luaL_optinteger(L, 6, 0);
+
+    size_t size;
+    const u8 *tiles = get_tiles(L, 5, &size);
+
+    char *err_msg = check_region(x, y, w, h, layer);
+    if(!err_msg) {
+        if(!tiles)
+            err_msg = "bad argument: tiles";
+        else if(size < (size_t) (w * h))
+            err_msg = "bad argument: tiles are too few";
+    }
+
+    if(err_msg) {
+        throw_lua_error(L, err_msg);
+        return 0;
+    }
+
+    if(map_write_region(layer, x, y, w, h, tiles))
+        throw_lua_error(L, "could not write the map");
+    return 0;
+}
+
+// map_fill(x, y, w, h, id, [layer])
+F(luag_map_fill) {
+    lua_Integer x     = luaL_checkinteger(L, 1);
+    lua_Integer y     = luaL_checkinteger(L, 2);
+    lua_Integer w     = luaL_checkinteger(L, 3);
+    lua_Integer h     = luaL_checkinteger(L, 4);
+    lua_Integer id    = luaL_checkinteger(L, 5);
+    lua_Integer layer = luaL_optinteger(L, 6, 0);
+
+    char *err_msg = check_region(x, y, w, h, layer);
+    if(!err_msg && (id < 0 || id >= 256))
+        err_msg = "bad argument: id";
+
+    if(err_msg) {
+        throw_lua_error(L, err_msg);
+        return 0;
+    }
+
+    if(map_fill(layer, x, y, w, h, id))
+        throw_lua_error(L, "could not write the map");
+    return 0;
+}
+
+// map_flood_fill(x, y, id, [layer]): replaces the area of equal tiles
+// connected to (x, y) and returns the number of tiles changed
+F(luag_map_flood_fill) {
+    lua_Integer x     = luaL_checkinteger(L, 1);
+    lua_Integer y     = luaL_checkinteger(L, 2);
+    lua_Integer id    = luaL_checkinteger(L, 3);
+    lua_Integer layer = luaL_optinteger(L, 4, 0);
+
+    char *err_msg = NULL;
+    if(x < 0 || x >= map.width)
+        err_msg = "bad argument: x";
+    else if(y < 0 || y >= map.height)
+        err_msg = "bad argument: y";
+    else if(id < 0 || id >= 256)
+        err_msg = "bad argument: id";
+    else if(layer < 0 || layer >= map.layer_count)
+        err_msg = "bad argument: layer";
+
+    if(err_msg) {
+        throw_lua_error(L, err_msg);
+        return 0;
+    }
+
+    i64 filled = map_flood_fill(layer, x, y, id, NULL, NULL);
+    if(filled < 0) {
+        throw_lua_error(L, "could not write the map");
+        return 0;
+    }
+
+    lua_pushinteger(L, filled);
+    return 1;
+}
+
+// map_copy(x, y, w, h, dst_x, dst_y, [layer])
+F(luag_map_copy) {
+    lua_Integer x     = luaL_checkinteger(L, 1);
+    lua_Integer y     = luaL_checkinteger(L, 2);
+    lua_Integer w     = luaL_checkinteger(L, 3);
+    lua_Integer h     = luaL_checkinteger(L, 4);
+    lua_Integer dst_x = luaL_checkinteger(L, 5);
+    lua_Integer dst_y = luaL_checkinteger(L, 6);
+    lua_Integer layer = luaL_optinteger(L, 7, 0);
+
+    char *err_msg = check_region(x, y, w, h, layer);
+    if(!err_msg && check_region(dst_x, dst_y, w, h, layer))
+        err_msg = "bad argument: destination";
+
+    if(err_msg) {
+        throw_lua_error(L, err_msg);
+        return 0;
+    }
+
+    if(map_copy(layer, x, y, w, h, dst_x, dst_y))
+        throw_lua_error(L, "could not write the map");
+    return 0;
+}
+
+// pathfinding
+F(path_cost) {
+    lua_Integer tile = luaL_checkinteger(L, 1);
+    if(tile < 0 || tile >= 256) {
+        throw_lua_error(L, "bad argument: tile");
+        return 0;
+    }
+
+    if(!lua_isnoneornil(L, 2)) {
+        lua_Integer cost = luaL_checkinteger(L, 2);
+        if(cost < 0 || cost >= 256) {
+            throw_lua_error(L, "bad argument: cost");
+            return 0;
+        }
+        pathfind_set_cost(tile, cost);
+    }
+
+    lua_pushinteger(L, pathfind_get_cost(tile));
+    return 1;
+}
+
+F(path_options) {
+    luaL_checktype(L, 1, LUA_TTABLE);
+
+    lua_getfield(L, 1, "layer");
+    if(!lua_isnil(L, -1)) {
+        lua_Integer layer = luaL_checkinteger(L, -1);
+        if(layer < 0 || layer >= map.layer_count) {
+            throw_lua_error(L, "bad argument: layer");
+            return 0;
+        }
+        pathfind_set_layer(layer);
+    }
+
+    lua_getfield(L, 1, "diagonal");
+    if(!lua_isnil(L, -1))
+        pathfind_set_diagonal(lua_toboolean(L, -1));
+
+    return 0;
+}
+
+// Returns the path as a list of coordinates { x1, y1, x2, y2, ... },
+// or nil if there is no path.
+F(path_find) {
+    lua_Integer x0 = luaL_checkinteger(L, 1);
+    lua_Integer y0 = luaL_checkinteger(L, 2);
+    lua_Integer x1 = luaL_checkinteger(L, 3);
+    lua_Integer y1 = luaL_checkinteger(L, 4);
+    lua_Integer max_nodes = luaL_optinteger(
+        L, 5, PATHFIND_DEFAULT_MAX_NODES
+    );
+
+    char *err_msg = NULL;
+    if(x0 < 0 || x0 >= map.width)
+        err_msg = "bad argument: x0";
+    else if(y0 < 0 || y0 >= map.height)
+        err_msg = "bad argument: y0";
+    else if(x1 < 0 || x1 >= map.width)
+        err_msg = "bad argument: x1";
+    else if(y1 < 0 || y1 >= map.height)
+        err_msg = "bad argument: y1";
+    else if(max_nodes <= 0 || max_nodes > UINT32_MAX)
+        err_msg = "bad argument: max_nodes";
+
+    if(err_msg) {
+        throw_lua_error(L, err_msg);
+        return 0;
+    }
+
+    const u32 *path;
+    i32 steps = pathfind_astar(x0, y0, x1, y1, max_nodes, &path);
+    if(steps < 0) {
+        lua_pushnil(L);
+        return 1;
+    }
+
+    lua_createtable(L, steps * 2, 0);
+    for(i32 i = 0; i < steps; i++) {
+        lua_pushinteger(L, path[i] % map.width);
+        lua_rawseti(L, -2, i * 2 + 1);
+
+        lua_pushinteger(L, path[i] / map.width);
+        lua_rawseti(L, -2, i * 2 + 2);
+    }
+    return 1;
+}
+
+// flow_create(target_x, target_y, [x, y, w, h])
+F(flow_create) {
+    lua_Integer tx = luaL_checkinteger(L, 1);
+    lua_Integer ty = luaL_checkinteger(L, 2);
+
+    lua_Integer x = luaL_optinteger(L, 3, 0);
+    lua_Integer y = luaL_optinteger(L, 4, 0);
+    lua_Integer w = luaL_optinteger(L, 5, map.width  - x);
+    lua_Integer h = luaL_optinteger(L, 6, map.height - y);
+
+    char *err_msg = check_region(x, y, w, h, 0);
+    if(!err_msg && (tx < x || tx >= x + w))
+        err_msg = "bad argument: target_x";
+    else if(!err_msg && (ty < y || ty >= y + h))
+        err_msg = "bad argument: target_y";
+
+    if(err_msg) {
+        throw_lua_error(L, err_msg);
+        return 0;
+    }
+
+    i32 id = pathfind_flow_create(tx, ty, x, y, w, h);
+    if(id < 0) {
+        throw_lua_error(L, "could not create the flow field");
+        return 0;
+    }
+
+    lua_pushinteger(L, id);
+    return 1;
+}
+
+F(flow_destroy) {
+    lua_Integer id = luaL_checkinteger(L, 1);
+
+    if(id >= 0 && id < PATHFIND_MAX_FIELDS)
+        pathfind_flow_destroy(id);
+    return 0;
+}
+
+// Returns the direction (dx, dy) to follow from (x, y), 0, 0 at the
+// target, or nil if the target cannot be reached.
+F(flow_dir) {
+    lua_Integer id = luaL_checkinteger(L, 1);
+    lua_Integer x  = luaL_checkinteger(L, 2);
+    lua_Integer y  = luaL_checkinteger(L, 3);
+
+    if(id < 0 || id >= PATHFIND_MAX_FIELDS) {
+        throw_lua_error(L, "bad argument: id");
+        return 0;
+    }
+
+    u8 dir = PATHFIND_DIR_UNREACHABLE;
+    if(x >= 0 && x <= UINT32_MAX && y >= 0 && y <= UINT32_MAX)
+        dir = pathfind_flow_dir(id, x, y);
+
+    if(dir == PATHFIND_DIR_UNREACHABLE) {
+        lua_pushnil(L);
+        return 1;
+    }
+
+    if(dir == PATHFIND_DIR_TARGET) {
+        lua_pushinteger(L, 0);
+        lua_pushinteger(L, 0);
     } else {
-        const u32 tile_size = SPRITE_SIZE * scale;
-
-        i32 xt0 = xoff / tile_size;
-        if(xoff < 0) xt0--;
-
-        i32 yt0 = yoff / tile_size;
-        if(yoff < 0) yt0--;
-
-        i32 xt1 = xt0 + (DISPLAY_WIDTH / tile_size) + 1;
-        i32 yt1 = yt0 + (DISPLAY_HEIGHT / tile_size) + 1;
-
-        // check boundaries
-        if(xt0 < 0) xt0 = 0;
-        if(yt0 < 0) yt0 = 0;
-
-        if(xt1 > map.width) xt1 = map.width;
-        if(yt1 > map.height) yt1 = map.height;
-
-        for(u32 yt = yt0; yt < yt1; yt++) {
-            for(u32 xt = xt0; xt < xt1; xt++) {
-                u32 id = map_get_tile(xt, yt);
-                display_draw_from_atlas(
-                    NULL,
-                    id, xt * tile_size - xoff, yt * tile_size - yoff,
-                    scale, 1, 1,
-                    0, false, false,
-                    0xff, 0xffffff
-                );
-            }
+        lua_pushinteger(L, pathfind_dir_x[dir]);
+        lua_pushinteger(L, pathfind_dir_y[dir]);
+    }
+    return 2;
+}
+
+// Returns the directions of the whole field as a string, by rows:
+// 0 to 7 = east, then clockwise, 8 = target, 255 = unreachable
+F(flow_field) {
+    lua_Integer id = luaL_checkinteger(L, 1);
+
+    u32 x, y, w, h;
+    if(id < 0 || id >= PATHFIND_MAX_FIELDS ||
+       pathfind_flow_area(id, &x, &y, &w, &h)) {
+        throw_lua_error(L, "bad argument: id");
+        return 0;
+    }
+
+    luaL_Buffer b;
+    char *dirs = luaL_buffinitsize(L, &b, w * h);
+    pathfind_flow_dirs(id, (u8 *) dirs);
+    luaL_pushresultsize(&b, w * h);
+    return 1;
+}
+
+// field of view
+F(fov_opaque) {
+    lua_Integer tile = luaL_checkinteger(L, 1);
+    if(tile < 0 || tile >= 256) {
+        throw_lua_error(L, "bad argument: tile");
+        return 0;
+    }
+
+    if(!lua_isnoneornil(L, 2))
+        fov_set_opaque(tile, lua_toboolean(L, 2));
+
+    lua_pushboolean(L, fov_is_opaque(tile));
+    return 1;
+}
+
+F(fov_options) {
+    luaL_checktype(L, 1, LUA_TTABLE);
+
+    lua_getfield(L, 1, "layer");
+    if(!lua_isnil(L, -1)) {
+        lua_Integer layer = luaL_checkinteger(L, -1);
+        if(layer < 0 || layer >= map.layer_count) {
+            throw_lua_error(L, "bad argument: layer");
+            return 0;
         }
+        fov_set_layer(layer);
+    }
+    return 0;
+}
+
+// Returns the first opaque tile crossed by the line from (x0, y0) to
+// (x1, y1), or nil if the line is clear. Coordinates are in tiles and
+// can have a fractional part: the center of a tile is at (x, y).
+F(raycast) {
+    lua_Number x0 = luaL_checknumber(L, 1) + 0.5;
+    lua_Number y0 = luaL_checknumber(L, 2) + 0.5;
+    lua_Number x1 = luaL_checknumber(L, 3) + 0.5;
+    lua_Number y1 = luaL_checknumber(L, 4) + 0.5;
+
+    u32 hit_x, hit_y;
+    int result = fov_raycast(x0, y0, x1, y1, &hit_x, &hit_y);
+    if(result < 0) {
+        throw_lua_error(L, "bad argument: points must be inside the map");
+        return 0;
+    }
+
+    if(result == 0) {
+        lua_pushnil(L);
+        return 1;
+    }
+
+    lua_pushinteger(L, hit_x);
+    lua_pushinteger(L, hit_y);
+    return 2;
+}
+
+// fov_compute(x, y, radius, [keep]): if 'keep' is true, the tiles
+// that are visible stay visible
+F(luag_fov_compute) {
+    lua_Integer x = luaL_checkinteger(L, 1);
+    lua_Integer y = luaL_checkinteger(L, 2);
+    lua_Integer radius = luaL_checkinteger(L, 3);
+    bool keep = lua_toboolean(L, 4);
+
+    char *err_msg = NULL;
+    if(x < 0 || x >= map.width)
+        err_msg = "bad argument: x";
+    else if(y < 0 || y >= map.height)
+        err_msg = "bad argument: y";
+    else if(radius < 0 || radius > FOV_MAX_RADIUS)
+        err_msg = "bad argument: radius";
+
+    if(err_msg) {
+        throw_lua_error(L, err_msg);
+        return 0;
+    }
+
+    if(fov_compute(x, y, radius, !keep))
+        throw_lua_error(L, "could not compute the field of view");
+    return 0;
+}
+
+// fov_clear([forget]): visible tiles become explored or, if 'forget'
+// is true, all tiles become unseen
+F(luag_fov_clear) {
+    fov_clear(lua_toboolean(L, 1));
+    return 0;
+}
+
+// Returns 0 if the tile was never seen, 1 if explored, 2 if visible
+F(fov_state) {
+    lua_Integer x = luaL_checkinteger(L, 1);
+    lua_Integer y = luaL_checkinteger(L, 2);
+
+    u8 state = FOV_UNSEEN;
+    if(x >= 0 && x < map.width && y >= 0 && y < map.height)
+        state = fov_get(x, y);
+
+    lua_pushinteger(L, state);
+    return 1;
+}
+
+// broadphase collision
+static char *check_entity(lua_State *L, int first_arg, u32 *id,
+                          i32 *x, i32 *y, u32 *w, u32 *h) {
+    lua_Integer id_arg = luaL_checkinteger(L, first_arg);
+    lua_Integer x_arg  = luaL_checkinteger(L, first_arg + 1);
+    lua_Integer y_arg  = luaL_checkinteger(L, first_arg + 2);
+    lua_Integer w_arg  = luaL_checkinteger(L, first_arg + 3);
+    lua_Integer h_arg  = luaL_checkinteger(L, first_arg + 4);
+
+    if(id_arg < 0 || id_arg >= BROADPHASE_MAX_ENTITIES)
+        return "bad argument: id";
+    if(x_arg < INT32_MIN || x_arg > INT32_MAX)
+        return "bad argument: x";
+    if(y_arg < INT32_MIN || y_arg > INT32_MAX)
+        return "bad argument: y";
+    if(w_arg <= 0 || w_arg > INT32_MAX)
+        return "bad argument: w";
+    if(h_arg <= 0 || h_arg > INT32_MAX)
+        return "bad argument: h";
+
+    *id = id_arg;
+    *x = x_arg;
+    *y = y_arg;
+    *w = w_arg;
+    *h = h_arg;
+    return NULL;
+}
+
+static int push_ids(lua_State *L, const u32 *ids, u32 count) {
+    lua_createtable(L, count, 0);
+    for(u32 i = 0; i < count; i++) {
+        lua_pushinteger(L, ids[i]);
+        lua_rawseti(L, -2, i + 1);
     }
+    return 1;
+}
+
+F(space_cell) {
+    lua_Integer size = luaL_checkinteger(L, 1);
+
+    if(size <= 0 || size > UINT32_MAX || broadphase_set_cell_size(size))
+        throw_lua_error(L, "bad argument: size");
+    return 0;
+}
+
+F(space_insert) {
+    u32 id, w, h;
+    i32 x, y;
+
+    char *err_msg = check_entity(L, 1, &id, &x, &y, &w, &h);
+    if(!err_msg && broadphase_insert(id, x, y, w, h))
+        err_msg = "could not insert the entity";
+
+    if(err_msg)
+        throw_lua_error(L, err_msg);
+    return 0;
+}
+
+F(space_move) {
+    u32 id, w, h;
+    i32 x, y;
+
+    char *err_msg = check_entity(L, 1, &id, &x, &y, &w, &h);
+    if(!err_msg && broadphase_move(id, x, y, w, h))
+        err_msg = "could not move the entity";
+
+    if(err_msg)
+        throw_lua_error(L, err_msg);
+    return 0;
+}
+
+F(space_remove) {
+    lua_Integer id = luaL_checkinteger(L, 1);
+
+    if(id >= 0 && id < BROADPHASE_MAX_ENTITIES)
+        broadphase_remove(id);
     return 0;
 }
 
+// Returns the list of entities overlapping the rectangle
+F(space_query) {
+    lua_Integer x = luaL_checkinteger(L, 1);
+    lua_Integer y = luaL_checkinteger(L, 2);
+    lua_Integer w = luaL_checkinteger(L, 3);
+    lua_Integer h = luaL_checkinteger(L, 4);
+
+    char *err_msg = NULL;
+    if(x < INT32_MIN || x > INT32_MAX)
+        err_msg = "bad argument: x";
+    else if(y < INT32_MIN || y > INT32_MAX)
+        err_msg = "bad argument: y";
+    else if(w < 0 || w > INT32_MAX)
+        err_msg = "bad argument: w";
+    else if(h < 0 || h > INT32_MAX)
+        err_msg = "bad argument: h";
+
+    if(err_msg) {
+        throw_lua_error(L, err_msg);
+        return 0;
+    }
+
+    const u32 *ids;
+    u32 count = broadphase_query(x, y, w, h, &ids);
+    return push_ids(L, ids, count);
+}
+
+// Returns the overlapping entities as a list { a1, b1, a2, b2, ... }
+F(space_pairs) {
+    const u32 *pairs;
+    u32 count = broadphase_pairs(&pairs);
+    return push_ids(L, pairs, count * 2);
+}
+
 // time
 F(luag_time) {
     lua_pushinteger(L, time(NULL));
@@ -569,6 +1566,13 @@ F(luag_date) {
 }
 
 int luag_lib_load(lua_State *L) {
+    // forget the animations, options, flow fields, visibility and
+    // entities of previous cartridges
+    map_reset_animations();
+    pathfind_reset();
+    fov_reset();
+    broadphase_reset();
+
     // VARIABLES
     lua_pushinteger(L, DISPLAY_WIDTH);
     lua_setglobal(L, "scr_w");
@@ -588,11 +1592,15 @@ int luag_lib_load(lua_State *L) {
     lua_pushinteger(L, map.height);
     lua_setglobal(L, "map_h");
 
+    lua_pushinteger(L, map.layer_count);
+    lua_setglobal(L, "map_layers");
+
     // FUNCTIONS
     // generic
     lua_register(L, "loadscript", loadscript);
     lua_register(L, "exit", luag_exit);
     lua_register(L, "log", luag_log);
+    lua_register(L, "low_power", low_power);
 
     // keys
     lua_register(L, "key", key);
@@ -609,22 +1617,64 @@ int luag_lib_load(lua_State *L) {
     lua_register(L, "scroll", scroll);
 
     // sound
+    lua_register(L, "sfx_id", sfx_id);
     lua_register(L, "sfx", sfx);
     lua_register(L, "sfx_play", sfx);
     lua_register(L, "sfx_loop", sfx_loop);
     lua_register(L, "sfx_stop", sfx_stop);
 
+    // synth
+    lua_register(L, "synth_note", luag_synth_note);
+    lua_register(L, "synth_pattern", luag_synth_pattern);
+    lua_register(L, "synth_stop", luag_synth_stop);
+    lua_register(L, "synth_wave", luag_synth_wave);
+
     // screen
     lua_register(L, "settransparent", settransparent);
     lua_register(L, "clear", clear);
     lua_register(L, "pix", pix);
     lua_register(L, "write", write);
     lua_register(L, "spr", spr);
+    lua_register(L, "spr_overlap", spr_overlap);
 
     // map
     lua_register(L, "get_tile", get_tile);
     lua_register(L, "set_tile", set_tile);
     lua_register(L, "maprender", maprender);
+    lua_register(L, "map_layer", map_layer);
+    lua_register(L, "map_animation", map_animation);
+    lua_register(L, "map_read_region", luag_map_read_region);
+    lua_register(L, "map_write_region", luag_map_write_region);
+    lua_register(L, "map_fill", luag_map_fill);
+    lua_register(L, "map_copy", luag_map_copy);
+    lua_register(L, "map_flood_fill", luag_map_flood_fill);
+    lua_register(L, "tile_buffer", tile_buffer);
+    register_tile_buffer(L);
+
+    // pathfinding
+    lua_register(L, "path_cost", path_cost);
+    lua_register(L, "path_options", path_options);
+    lua_register(L, "path_find", path_find);
+    lua_register(L, "flow_create", flow_create);
+    lua_register(L, "flow_destroy", flow_destroy);
+    lua_register(L, "flow_dir", flow_dir);
+    lua_register(L, "flow_field", flow_field);
+
+    // field of view
+    lua_register(L, "fov_opaque", fov_opaque);
+    lua_register(L, "fov_options", fov_options);
+    lua_register(L, "raycast", raycast);
+    lua_register(L, "fov_compute", luag_fov_compute);
+    lua_register(L, "fov_clear", luag_fov_clear);
+    lua_register(L, "fov_state", fov_state);
+
+    // broadphase collision
+    lua_register(L, "space_cell", space_cell);
+    lua_register(L, "space_insert", space_insert);
+    lua_register(L, "space_move", space_move);
+    lua_register(L, "space_remove", space_remove);
+    lua_register(L, "space_query", space_query);
+    lua_register(L, "space_pairs", space_pairs);
 
     // time
     lua_register(L, "time", luag_time);
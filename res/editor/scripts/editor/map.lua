@@ -5,7 +5,34 @@ editors.map = {
         self.map = map_element(
             self,           -- editor
             5,          15, -- x, y
-            scr_w - 10, 80  -- w, h
+            scr_w - 10, 70  -- w, h
+        )
+
+        self.layer = 0
+        self.fill_mode = false
+
+        -- layer textbox
+        self.layer_textbox = textbox(
+            47, 88,
+            1, 'dec',
+            '0',
+            function(self, new_layer) -- on_enter
+                local editor = editors.map
+
+                new_layer = tonumber(new_layer) or 0
+                if new_layer >= map_max_layers then
+                    new_layer = map_max_layers - 1
+                end
+
+                -- selecting the next layer creates it
+                if new_layer >= map_layers then
+                    editor_set_layer_count(new_layer + 1)
+                    editor.is_edited = true
+                end
+
+                editor.layer = new_layer
+                self.text = tostring(new_layer)
+            end
         )
 
         self.atlas = atlas(
@@ -18,6 +45,82 @@ editors.map = {
             self.map,
             self.atlas,
 
+            -- layer selector background
+            box(
+                16, 87,
+                self.atlas.w, font_h + 3,
+                colors.primary.bg
+            ),
+
+            -- layer label
+            element(
+                17, 89,
+                29, font_h,
+                function(self) --render
+                    write('layer', colors.primary.fg, self.x, self.y)
+                end
+            ),
+            self.layer_textbox,
+
+            -- visibility toggle
+            element(
+                58, 89,
+                35, font_h,
+                function(self) -- render
+                    local text = 'hidden'
+                    if editor_layer_visible(editors.map.layer) then
+                        text = 'shown'
+                    end
+                    write(text, colors.primary.fg, self.x, self.y)
+                end,
+                function(self) -- click
+                    local editor = editors.map
+                    local visible = editor_layer_visible(editor.layer)
+
+                    editor_layer_visible(editor.layer, not visible)
+                    editor.is_edited = true
+                end
+            ),
+
+            -- tool toggle: set single tiles or fill areas
+            element(
+                96, 89,
+                21, font_h,
+                function(self) -- render
+                    local text = 'pen'
+                    if editors.map.fill_mode then
+                        text = 'fill'
+                    end
+                    write(text, colors.primary.fg, self.x, self.y)
+                end,
+                function(self) -- click
+                    local editor = editors.map
+                    editor.fill_mode = not editor.fill_mode
+                end
+            ),
+
+            -- remove the last layer
+            element(
+                118, 89,
+                17, font_h,
+                function(self) -- render
+                    write('del', colors.primary.fg, self.x, self.y)
+                end,
+                function(self) -- click
+                    local editor = editors.map
+                    if map_layers <= 1 then
+                        return
+                    end
+
+                    editor_set_layer_count(map_layers - 1)
+                    if editor.layer >= map_layers then
+                        editor.layer = map_layers - 1
+                        editor.layer_textbox.text = tostring(editor.layer)
+                    end
+                    editor.is_edited = true
+                end
+            ),
+
             -- size selector background
             box(
                 16, 99,
@@ -90,6 +193,29 @@ editors.map = {
                     editor.is_edited = true
                 end
             ),
+
+            -- undo
+            button(
+                self.atlas.x + self.atlas.w + 2, -- x
+                87,                              -- y
+                2,                               -- icon
+                function(self)                   -- click_fn
+                    if editor_map_undo() then
+                        editors.map.is_edited = true
+                    end
+                end
+            ),
+            -- redo
+            button(
+                self.atlas.x + self.atlas.w + 2, -- x
+                99,                              -- y
+                3,                               -- icon
+                function(self)                   -- click_fn
+                    if editor_map_redo() then
+                        editors.map.is_edited = true
+                    end
+                end
+            ),
         }
     end,
 
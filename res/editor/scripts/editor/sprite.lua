@@ -121,15 +121,25 @@ editors.sprite = {
             ),
             -- undo
             button(
-                xc - 63, -- x
-                45,      -- y
-                2        -- icon
+                xc - 63,       -- x
+                45,            -- y
+                2,             -- icon
+                function(self) -- click_fn
+                    if editor_atlas_undo() then
+                        editors.sprite.is_edited = true
+                    end
+                end
             ),
             -- redo
             button(
-                xc - 63, -- x
-                54,      -- y
-                3        -- icon
+                xc - 63,       -- x
+                54,            -- y
+                3,             -- icon
+                function(self) -- click_fn
+                    if editor_atlas_redo() then
+                        editors.sprite.is_edited = true
+                    end
+                end
             ),
             -- select
             button(
@@ -46,7 +46,16 @@ function map_element(editor, x, y, w, h)
 
         if xt >= 0 and xt < map_w and
            yt >= 0 and yt < map_h then
-            if set_tile(xt, yt, editor.atlas.selected) then
+            local set_fn = editor_set_tile
+            if editor.fill_mode then
+                set_fn = editor_map_fill
+            end
+
+            if set_fn(
+                xt, yt,
+                editor.atlas.selected,
+                editor.layer
+            ) then
                 editor.is_edited = true
             end
         end
@@ -150,6 +150,11 @@ function tick()
     do -- mouse actions
         local x, y = mouse_pos()
 
+        -- the edits of a stroke are undone together
+        if mouse_pressed(0) then
+            editor_journal_begin()
+        end
+
         if mouse(0) then
             gui_action('mouse_down', false, x, y)
         end
@@ -158,6 +163,10 @@ function tick()
             gui_action('click', true, x, y)
         end
 
+        if mouse_released(0) then
+            editor_journal_end()
+        end
+
         if scroll() ~= 0 then
             gui_action('scroll', false, x, y, scroll())
         end
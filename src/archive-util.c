@@ -18,7 +18,12 @@
 #include <stdio.h>
 #include <string.h>
 #include <limits.h>
+#include <errno.h>
+#include <pthread.h>
 
+#include <sys/stat.h>
+
+#include <SDL.h>
 #include <archive.h>
 #include <archive_entry.h>
 
@@ -151,119 +156,758 @@ int archiveutil_extract(const char *archive_filename,
     return err;
 }
 
-int archiveutil_pack(const char *archive_filename,
-                     const char *src_folder) {
-    int err = -1;
+// PACK
+//
+// Cartridges are packed so that the output only depends on the content
+// of the files: entries are sorted by path and their metadata (owner,
+// times, permissions) is normalized.
+//
+// Each entry is compressed into a separate gzip member, so that entries
+// can be compressed in parallel. Concatenated gzip members are still a
+// valid gzip stream.
+//
+// A manifest is saved next to the archive, with the hash, size and
+// position of each file: when packing again, the members of unchanged
+// files are copied from the old archive instead of being recompressed.
+
+#define MANIFEST_VERSION (1)
+
+#define READ_BUFFER_SIZE (64 * 1024)
+
+struct Buffer {
+    u8 *data;
+    size_t size;
+    size_t capacity;
+};
+
+struct PackEntry {
+    struct archive_entry *entry;
+
+    // metadata of the source file, before normalization
+    u64 size;
+    i64 mtime_sec;
+    i64 mtime_nsec;
+    u64 hash;
+
+    // compressed data
+    struct Buffer member;
+    u64 input_size;
+    bool reused;
+
+    int err;
+};
+
+struct ManifestEntry {
+    char *path;
+
+    u64 size;
+    i64 mtime_sec;
+    i64 mtime_nsec;
+    u64 hash;
+
+    u64 input_size;
+    u64 offset;
+    u64 length;
+};
+
+struct Manifest {
+    struct ManifestEntry *entries;
+    u32 count;
+};
+
+// FNV-1a
+static inline u64 hash_update(u64 hash, const u8 *data, size_t len) {
+    for(size_t i = 0; i < len; i++) {
+        hash ^= data[i];
+        hash *= 0x100000001b3;
+    }
+    return hash;
+}
 
-    // in
-    struct archive *in = archive_read_disk_new();
-    archive_read_disk_set_standard_lookup(in);
+#define HASH_INIT (0xcbf29ce484222325)
 
-    // out
-    struct archive *out = archive_write_new();
-    archive_write_set_format_ustar(out);
-    archive_write_add_filter_gzip(out);
+static int hash_file(const char *filename, u64 *hash) {
+    FILE *file = fopen(filename, "rb");
+    if(!file)
+        return -1;
 
-    // open folder (in)
-    if(archive_read_disk_open(in, src_folder)) {
+    u64 result = HASH_INIT;
+
+    u8 *buffer = malloc(READ_BUFFER_SIZE);
+    while(true) {
+        size_t len = fread(buffer, 1, READ_BUFFER_SIZE, file);
+        if(len == 0)
+            break;
+        result = hash_update(result, buffer, len);
+    }
+    free(buffer);
+
+    fclose(file);
+    *hash = result;
+    return 0;
+}
+
+struct PackJob {
+    struct PackEntry *entries;
+    u32 count;
+
+    u32 next;
+    pthread_mutex_t lock;
+};
+
+static la_ssize_t buffer_write(struct archive *a, void *client_data,
+                               const void *data, size_t len) {
+    struct Buffer *buffer = client_data;
+
+    if(buffer->size + len > buffer->capacity) {
+        size_t capacity = buffer->capacity ? buffer->capacity : 4096;
+        while(capacity < buffer->size + len)
+            capacity *= 2;
+
+        u8 *new_data = realloc(buffer->data, capacity);
+        if(!new_data) {
+            archive_set_error(a, ENOMEM, "could not allocate buffer");
+            return -1;
+        }
+        buffer->data = new_data;
+        buffer->capacity = capacity;
+    }
+
+    memcpy(buffer->data + buffer->size, data, len);
+    buffer->size += len;
+    return len;
+}
+
+// Writes the tar header and data of an entry into 'out', without the
+// end-of-archive marker. The hash of the data is stored in 'hash'.
+static int write_tar_segment(struct archive_entry *entry, struct Buffer *out,
+                             u64 *hash) {
+    int err = 0;
+    FILE *file = NULL;
+
+    struct archive *a = archive_write_new();
+    archive_write_set_format_ustar(a);
+
+    // do not group writes into blocks: the size of the buffer after
+    // each entry has to be known
+    archive_write_set_bytes_per_block(a, 0);
+
+    if(archive_write_open(a, out, NULL, buffer_write, NULL)) {
+        err = -1;
+        goto exit;
+    }
+
+    if(archive_write_header(a, entry) != ARCHIVE_OK) {
+        err = -2;
+        goto exit;
+    }
+
+    if(archive_entry_filetype(entry) == AE_IFREG) {
+        file = fopen(archive_entry_sourcepath(entry), "rb");
+        if(!file) {
+            fprintf(
+                stderr,
+                "Archive Util: could not open file '%s'\n",
+                archive_entry_sourcepath(entry)
+            );
+            err = -3;
+            goto exit;
+        }
+
+        *hash = HASH_INIT;
+
+        char *buffer = malloc(READ_BUFFER_SIZE);
+        while(true) {
+            size_t len = fread(buffer, 1, READ_BUFFER_SIZE, file);
+            if(len == 0)
+                break;
+
+            *hash = hash_update(*hash, (u8 *) buffer, len);
+            if(archive_write_data(a, buffer, len) < 0) {
+                err = -4;
+                break;
+            }
+        }
+        free(buffer);
+
+        if(err)
+            goto exit;
+    }
+
+    if(archive_write_finish_entry(a) != ARCHIVE_OK) {
+        err = -5;
+        goto exit;
+    }
+
+    exit:
+    if(err && err != -3) {
         fprintf(
             stderr,
-            "Archive Util: could not open folder '%s\n'"
-            " - archive_read_disk_open: %s\n",
-            src_folder, archive_error_string(in)
+            "Archive Util: could not write entry '%s'\n"
+            " - %s\n",
+            archive_entry_pathname(entry), archive_error_string(a)
         );
     }
 
-    // open archive file (out)
-    if(archive_write_open_filename(out, archive_filename)) {
+    if(file)
+        fclose(file);
+
+    // closing the archive writes the end-of-archive marker: drop it
+    size_t size = out->size;
+    archive_write_close(a);
+    archive_write_free(a);
+    out->size = size;
+
+    return err;
+}
+
+// Compresses 'data' into a single gzip member.
+static int compress_member(const u8 *data, size_t len, struct Buffer *out) {
+    int err = 0;
+
+    struct archive *a = archive_write_new();
+    archive_write_set_format_raw(a);
+    archive_write_add_filter_gzip(a);
+
+    // the timestamp would make the output depend on the time of packing
+    archive_write_set_filter_option(a, "gzip", "timestamp", NULL);
+    archive_write_set_bytes_in_last_block(a, 1);
+
+    struct archive_entry *entry = archive_entry_new();
+    archive_entry_set_pathname(entry, "data");
+    archive_entry_set_filetype(entry, AE_IFREG);
+    archive_entry_set_size(entry, len);
+
+    if(archive_write_open(a, out, NULL, buffer_write, NULL) ||
+       archive_write_header(a, entry) != ARCHIVE_OK ||
+       archive_write_data(a, data, len) != (la_ssize_t) len ||
+       archive_write_close(a) != ARCHIVE_OK) {
         fprintf(
             stderr,
-            "Archive Util: coult not create file '%s'\n"
-            " - archive_write_open_filename: %s\n",
-            archive_filename, archive_error_string(out)
+            "Archive Util: could not compress data\n"
+            " - %s\n", archive_error_string(a)
         );
+        err = -1;
+    }
+
+    archive_entry_free(entry);
+    archive_write_free(a);
+    return err;
+}
+
+static void pack_entry(struct PackEntry *entry) {
+    struct Buffer segment = { 0 };
+
+    entry->err = write_tar_segment(entry->entry, &segment, &entry->hash);
+    if(!entry->err) {
+        entry->input_size = segment.size;
+        entry->err = compress_member(
+            segment.data, segment.size, &entry->member
+        );
+    }
+
+    free(segment.data);
+}
+
+static void *pack_worker(void *arg) {
+    struct PackJob *job = arg;
+
+    while(true) {
+        pthread_mutex_lock(&job->lock);
+        u32 i = job->next++;
+        pthread_mutex_unlock(&job->lock);
+
+        if(i >= job->count)
+            break;
+
+        if(!job->entries[i].reused)
+            pack_entry(&job->entries[i]);
+    }
+    return NULL;
+}
+
+static int compare_entries(const void *a, const void *b) {
+    const struct PackEntry *entry_a = a;
+    const struct PackEntry *entry_b = b;
+
+    return strcmp(
+        archive_entry_pathname(entry_a->entry),
+        archive_entry_pathname(entry_b->entry)
+    );
+}
+
+// Reads the entries of 'src_folder' and sorts them by path.
+// Returns the number of entries, or -1 on failure.
+static i32 read_entries(const char *src_folder, struct PackEntry **result) {
+    bool failed = false;
+    u32 count = 0;
+    u32 capacity = 64;
+    struct PackEntry *entries = malloc(capacity * sizeof(struct PackEntry));
+
+    struct archive *in = archive_read_disk_new();
+    archive_read_disk_set_standard_lookup(in);
+
+    if(archive_read_disk_open(in, src_folder)) {
+        fprintf(
+            stderr,
+            "Archive Util: could not open folder '%s'\n"
+            " - archive_read_disk_open: %s\n",
+            src_folder, archive_error_string(in)
+        );
+        failed = true;
         goto exit;
     }
 
-    // copy entries
     u32 root_name_len = -1;
     while(true) {
         struct archive_entry *entry = archive_entry_new();
 
-        // read header
         int r = archive_read_next_header2(in, entry);
-
         if(r == ARCHIVE_EOF) {
+            archive_entry_free(entry);
             break;
         } else if(r != ARCHIVE_OK) {
             fprintf(
                 stderr,
-                "Archive Util: error\n" // TODO what error?
+                "Archive Util: could not read folder '%s'\n"
                 " - archive_read_next_header2: %s\n",
-                archive_error_string(in)
+                src_folder, archive_error_string(in)
             );
+            archive_entry_free(entry);
+            failed = true;
             goto exit;
         }
 
         archive_read_disk_descend(in);
 
-        // remove root directory from output path
+        // skip the root directory
         if(root_name_len == -1) {
             root_name_len = strlen(archive_entry_sourcepath(entry));
-
-            archive_entry_set_pathname(entry, "");
-        } else {
-            archive_entry_set_pathname(
-                entry, archive_entry_sourcepath(entry) + root_name_len + 1
-            );
+            archive_entry_free(entry);
+            continue;
         }
 
-        // delete user and group
+        // remove root directory from output path
+        archive_entry_set_pathname(
+            entry, archive_entry_sourcepath(entry) + root_name_len + 1
+        );
+
+        struct PackEntry pack = {
+            .entry = entry,
+
+            .size       = archive_entry_size(entry),
+            .mtime_sec  = archive_entry_mtime(entry),
+            .mtime_nsec = archive_entry_mtime_nsec(entry)
+        };
+
+        // normalize metadata
         archive_entry_set_uid(entry, 0);
         archive_entry_set_uname(entry, "");
         archive_entry_set_gid(entry, 0);
         archive_entry_set_gname(entry, "");
 
-        // write header
-        r = archive_write_header(out, entry);
+        archive_entry_set_mtime(entry, 0, 0);
+        archive_entry_unset_atime(entry);
+        archive_entry_unset_ctime(entry);
+        archive_entry_unset_birthtime(entry);
 
-        if(r != ARCHIVE_OK) {
+        if(archive_entry_filetype(entry) == AE_IFDIR)
+            archive_entry_set_perm(entry, 0755);
+        else
+            archive_entry_set_perm(entry, 0644);
+
+        if(count == capacity) {
+            capacity *= 2;
+            entries = realloc(entries, capacity * sizeof(struct PackEntry));
+        }
+        entries[count++] = pack;
+    }
+
+    qsort(entries, count, sizeof(struct PackEntry), compare_entries);
+
+    exit:
+    archive_read_close(in);
+    archive_read_free(in);
+
+    if(failed) {
+        for(u32 i = 0; i < count; i++)
+            archive_entry_free(entries[i].entry);
+        free(entries);
+
+        *result = NULL;
+        return -1;
+    }
+
+    *result = entries;
+    return count;
+}
+
+static void manifest_destroy(struct Manifest *manifest) {
+    for(u32 i = 0; i < manifest->count; i++)
+        free(manifest->entries[i].path);
+    free(manifest->entries);
+
+    manifest->entries = NULL;
+    manifest->count = 0;
+}
+
+// Loads the manifest of 'archive_filename'. If the manifest does not
+// exist or does not match the archive, the manifest is left empty.
+static void manifest_load(const char *archive_filename,
+                          struct Manifest *manifest) {
+    *manifest = (struct Manifest) { 0 };
+
+    char filename[PATH_MAX];
+    snprintf(filename, PATH_MAX, "%s.manifest", archive_filename);
+
+    FILE *file = fopen(filename, "r");
+    if(!file)
+        return;
+
+    char line[PATH_MAX + 256];
+
+    // header: version and size of the archive
+    u32 version;
+    unsigned long long archive_size;
+    if(!fgets(line, sizeof(line), file) ||
+       sscanf(line, "luag-manifest %u %llu", &version, &archive_size) != 2 ||
+       version != MANIFEST_VERSION)
+        goto exit;
+
+    // if the archive was modified, the offsets are not valid
+    struct stat st;
+    if(stat(archive_filename, &st) || st.st_size != archive_size)
+        goto exit;
+
+    u32 capacity = 64;
+    manifest->entries = malloc(capacity * sizeof(struct ManifestEntry));
+
+    while(fgets(line, sizeof(line), file)) {
+        struct ManifestEntry entry;
+        unsigned long long size, hash, input_size, offset, length;
+        long long mtime_sec, mtime_nsec;
+        int path_start;
+
+        if(sscanf(
+            line, "%llu %lld %lld %llx %llu %llu %llu %n",
+            &size, &mtime_sec, &mtime_nsec, &hash,
+            &input_size, &offset, &length, &path_start
+        ) != 7) {
             fprintf(
                 stderr,
-                "Archive Util: error\n" // TODO what error?
-                " - archive_write_header: %s\n",
-                archive_error_string(out)
+                "Archive Util: invalid manifest '%s'\n", filename
             );
+            manifest_destroy(manifest);
             goto exit;
         }
 
-        // copy data
-        FILE *file = fopen(archive_entry_sourcepath(entry), "rb");
+        char *path = line + path_start;
+        path[strcspn(path, "\n")] = '\0';
 
-        while(true) {
-            char buffer[4096];
-            u32 len = fread(
-                buffer,
-                sizeof(char), sizeof(buffer) / sizeof(char),
-                file
+        entry = (struct ManifestEntry) {
+            .path = strdup(path),
+
+            .size       = size,
+            .mtime_sec  = mtime_sec,
+            .mtime_nsec = mtime_nsec,
+            .hash       = hash,
+
+            .input_size = input_size,
+            .offset     = offset,
+            .length     = length
+        };
+
+        if(manifest->count == capacity) {
+            capacity *= 2;
+            manifest->entries = realloc(
+                manifest->entries, capacity * sizeof(struct ManifestEntry)
             );
-            if(len <= 0)
-                break;
+        }
+        manifest->entries[manifest->count++] = entry;
+    }
+
+    exit:
+    fclose(file);
+}
+
+// entries are sorted by path: use binary search
+static struct ManifestEntry *manifest_find(struct Manifest *manifest,
+                                           const char *path) {
+    i32 low = 0;
+    i32 high = (i32) manifest->count - 1;
+
+    while(low <= high) {
+        i32 mid = (low + high) / 2;
+
+        int cmp = strcmp(manifest->entries[mid].path, path);
+        if(cmp == 0)
+            return &manifest->entries[mid];
+        else if(cmp < 0)
+            low = mid + 1;
+        else
+            high = mid - 1;
+    }
+    return NULL;
+}
+
+// Copies the members of unchanged files from the old archive.
+// Returns the number of reused entries.
+static u32 reuse_members(const char *archive_filename,
+                         struct PackEntry *entries, u32 count) {
+    struct Manifest manifest;
+    manifest_load(archive_filename, &manifest);
+    if(manifest.count == 0)
+        return 0;
+
+    u32 reused = 0;
+
+    FILE *old_archive = fopen(archive_filename, "rb");
+    if(!old_archive)
+        goto exit;
+
+    for(u32 i = 0; i < count; i++) {
+        struct PackEntry *entry = &entries[i];
+        if(archive_entry_filetype(entry->entry) != AE_IFREG)
+            continue;
+
+        struct ManifestEntry *old = manifest_find(
+            &manifest, archive_entry_pathname(entry->entry)
+        );
+        if(!old || old->size != entry->size)
+            continue;
+
+        // if the modification time is different, check the content
+        if(old->mtime_sec  != entry->mtime_sec ||
+           old->mtime_nsec != entry->mtime_nsec) {
+            u64 hash;
+            if(hash_file(archive_entry_sourcepath(entry->entry), &hash) ||
+               hash != old->hash)
+                continue;
+        }
 
-            archive_write_data(out, buffer, len);
+        // read the member from the old archive
+        struct Buffer *member = &entry->member;
+        member->data = malloc(old->length);
+        member->size = old->length;
+        member->capacity = old->length;
+
+        if(fseeko(old_archive, old->offset, SEEK_SET) ||
+           fread(member->data, 1, old->length, old_archive) != old->length) {
+            free(member->data);
+            *member = (struct Buffer) { 0 };
+            continue;
         }
-        fclose(file);
 
-        archive_entry_free(entry);
+        entry->hash = old->hash;
+        entry->input_size = old->input_size;
+        entry->reused = true;
+        reused++;
+    }
+    fclose(old_archive);
+
+    exit:
+    manifest_destroy(&manifest);
+    return reused;
+}
+
+static int manifest_save(const char *filename, u64 archive_size,
+                         struct PackEntry *entries, u32 count) {
+    FILE *file = fopen(filename, "w");
+    if(!file)
+        return -1;
+
+    fprintf(
+        file, "luag-manifest %u %llu\n",
+        MANIFEST_VERSION, (unsigned long long) archive_size
+    );
+
+    u64 offset = 0;
+    for(u32 i = 0; i < count; i++) {
+        struct PackEntry *entry = &entries[i];
+
+        // only regular files can be reused
+        if(archive_entry_filetype(entry->entry) == AE_IFREG) {
+            fprintf(
+                file, "%llu %lld %lld %016llx %llu %llu %llu %s\n",
+                (unsigned long long) entry->size,
+                (long long) entry->mtime_sec,
+                (long long) entry->mtime_nsec,
+                (unsigned long long) entry->hash,
+                (unsigned long long) entry->input_size,
+                (unsigned long long) offset,
+                (unsigned long long) entry->member.size,
+                archive_entry_pathname(entry->entry)
+            );
+        }
+        offset += entry->member.size;
+    }
+
+    if(fclose(file))
+        return -1;
+    return 0;
+}
+
+// Replaces 'dest' with 'src'.
+static int replace_file(const char *src, const char *dest) {
+    #ifdef _WIN32
+        // on Windows, rename fails if the destination exists
+        remove(dest);
+    #endif
+    return rename(src, dest);
+}
+
+int archiveutil_pack(const char *archive_filename,
+                     const char *src_folder, u32 threads,
+                     struct archiveutil_PackStats *stats) {
+    int err = -1;
+
+    const u64 start_time = SDL_GetPerformanceCounter();
+
+    struct PackEntry *entries;
+    i32 count = read_entries(src_folder, &entries);
+    if(count < 0)
+        return -1;
+
+    struct Buffer trailer = { 0 };
+    FILE *file = NULL;
+
+    // the archive is written to a temporary file, since unchanged
+    // members are read from the old archive
+    char tmp_filename[PATH_MAX];
+    snprintf(tmp_filename, PATH_MAX, "%s.tmp", archive_filename);
+
+    char manifest_filename[PATH_MAX];
+    snprintf(manifest_filename, PATH_MAX, "%s.manifest", archive_filename);
+
+    u32 reused = reuse_members(archive_filename, entries, count);
+
+    // compress the other entries
+    if(threads == 0)
+        threads = SDL_GetCPUCount();
+    if(threads > count - reused)
+        threads = count - reused;
+
+    if(threads <= 1) {
+        for(u32 i = 0; i < count; i++)
+            if(!entries[i].reused)
+                pack_entry(&entries[i]);
+    } else {
+        struct PackJob job = {
+            .entries = entries,
+            .count   = count,
+            .next    = 0
+        };
+        pthread_mutex_init(&job.lock, NULL);
+
+        pthread_t *workers = malloc(threads * sizeof(pthread_t));
+        u32 started = 0;
+        for(; started < threads; started++)
+            if(pthread_create(&workers[started], NULL, pack_worker, &job))
+                break;
+
+        // if no thread could be started, do the work here
+        if(started == 0)
+            pack_worker(&job);
+
+        for(u32 i = 0; i < started; i++)
+            pthread_join(workers[i], NULL);
+
+        free(workers);
+        pthread_mutex_destroy(&job.lock);
+    }
+
+    for(u32 i = 0; i < count; i++)
+        if(entries[i].err)
+            goto exit;
+
+    // end-of-archive marker: two empty records
+    u8 marker[1024] = { 0 };
+    if(compress_member(marker, sizeof(marker), &trailer))
+        goto exit;
+
+    // write members in order
+    file = fopen(tmp_filename, "wb");
+    if(!file) {
+        fprintf(
+            stderr,
+            "Archive Util: could not create file '%s'\n",
+            tmp_filename
+        );
+        goto exit;
+    }
+
+    u64 input_size  = sizeof(marker);
+    u64 output_size = trailer.size;
+    for(u32 i = 0; i < count; i++) {
+        struct Buffer *member = &entries[i].member;
+        if(fwrite(member->data, 1, member->size, file) != member->size)
+            goto write_error;
+
+        input_size  += entries[i].input_size;
+        output_size += member->size;
+    }
+    if(fwrite(trailer.data, 1, trailer.size, file) != trailer.size)
+        goto write_error;
+
+    if(fclose(file)) {
+        file = NULL;
+        goto write_error;
+    }
+    file = NULL;
+
+    // remove the old manifest first: if replacing the archive succeeds
+    // but saving the new manifest fails, no stale manifest is left
+    remove(manifest_filename);
+
+    if(replace_file(tmp_filename, archive_filename)) {
+        fprintf(
+            stderr,
+            "Archive Util: could not replace file '%s'\n",
+            archive_filename
+        );
+        goto exit;
+    }
+
+    if(manifest_save(manifest_filename, output_size, entries, count)) {
+        fprintf(
+            stderr,
+            "Archive Util: could not save manifest '%s'\n",
+            manifest_filename
+        );
+        remove(manifest_filename);
+    }
+
+    if(stats) {
+        stats->files = count;
+        stats->reused = reused;
+        stats->threads = threads;
+        stats->input_size = input_size;
+        stats->output_size = output_size;
+        stats->time_ms = (SDL_GetPerformanceCounter() - start_time) *
+                         1000 / SDL_GetPerformanceFrequency();
     }
     err = 0;
+    goto exit;
+
+    write_error:
+    fprintf(
+        stderr,
+        "Archive Util: could not write file '%s'\n",
+        tmp_filename
+    );
 
     exit:
-    archive_read_close(in);
-    archive_read_free(in);
+    if(file)
+        fclose(file);
+    if(err)
+        remove(tmp_filename);
+    free(trailer.data);
 
-    archive_write_close(out);
-    archive_write_free(out);
+    for(u32 i = 0; i < count; i++) {
+        archive_entry_free(entries[i].entry);
+        free(entries[i].member.data);
+    }
+    free(entries);
 
     return err;
 }
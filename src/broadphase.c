@@ -0,0 +1,416 @@
+/* Copyright 2024 Vulcalien
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#include "broadphase.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Uniform grid stored in a hash table: the world has no bounds, and
+// only the cells containing entities use memory. Each entity is added
+// to the bucket of every cell it overlaps. Different cells can share a
+// bucket, so the rectangles are always checked.
+
+#define BUCKET_COUNT (4096)
+
+struct Bucket {
+    u32 *ids;
+    u32 count;
+    u32 size;
+};
+
+// range of cells overlapped by an entity (x1 and y1 included)
+struct CellRange {
+    i32 x0, y0;
+    i32 x1, y1;
+};
+
+struct Entity {
+    i32 x, y;
+    u32 w, h;
+
+    struct CellRange cells;
+
+    // position in the list of used ids
+    u32 index;
+};
+
+static struct Bucket buckets[BUCKET_COUNT];
+
+static u32 cell_size = BROADPHASE_DEFAULT_CELL_SIZE;
+
+static struct Entity *entities = NULL;
+
+static u32 *used_ids = NULL;
+static u32 used_count = 0;
+
+// queries mark the entities they find, to skip the duplicates
+static u32 *marks = NULL;
+static u32 mark = 0;
+
+static u32 *results = NULL;
+static u32 results_count = 0;
+static u32 results_size  = 0;
+
+static bool prepare(void) {
+    if(entities)
+        return true;
+
+    entities = malloc(BROADPHASE_MAX_ENTITIES * sizeof(struct Entity));
+    used_ids = malloc(BROADPHASE_MAX_ENTITIES * sizeof(u32));
+    marks    = calloc(BROADPHASE_MAX_ENTITIES, sizeof(u32));
+
+    if(!entities || !used_ids || !marks) {
+        fputs("Broadphase: could not allocate entities\n", stderr);
+
+        free(entities);
+        free(used_ids);
+        free(marks);
+
+        entities = NULL;
+        used_ids = NULL;
+        marks = NULL;
+        return false;
+    }
+
+    for(u32 i = 0; i < BROADPHASE_MAX_ENTITIES; i++)
+        entities[i].index = UINT32_MAX;
+    return true;
+}
+
+static inline bool is_used(u32 id) {
+    return entities && entities[id].index != UINT32_MAX;
+}
+
+static u32 next_mark(void) {
+    mark++;
+    if(mark == 0) {
+        memset(marks, 0, BROADPHASE_MAX_ENTITIES * sizeof(u32));
+        mark = 1;
+    }
+    return mark;
+}
+
+static bool reserve_results(u32 count) {
+    if(results_count + (u64) count <= results_size)
+        return true;
+
+    u64 new_size = results_size ? results_size : 256;
+    while(new_size < results_count + (u64) count)
+        new_size *= 2;
+    if(new_size > UINT32_MAX)
+        return false;
+
+    u32 *new_results = realloc(results, new_size * sizeof(u32));
+    if(!new_results)
+        return false;
+
+    results = new_results;
+    results_size = new_size;
+    return true;
+}
+
+// CELLS
+
+static inline i32 to_cell(i64 pixel) {
+    // round toward negative infinity
+    if(pixel >= 0)
+        return pixel / cell_size;
+    return -((-pixel - 1) / cell_size) - 1;
+}
+
+static struct CellRange get_cells(i32 x, i32 y, u32 w, u32 h) {
+    return (struct CellRange) {
+        .x0 = to_cell(x),
+        .y0 = to_cell(y),
+        .x1 = to_cell((i64) x + w - 1),
+        .y1 = to_cell((i64) y + h - 1)
+    };
+}
+
+static inline u32 cell_count(const struct CellRange *cells) {
+    u64 count = (u64) (cells->x1 - (i64) cells->x0 + 1) *
+                      (cells->y1 - (i64) cells->y0 + 1);
+    return count < UINT32_MAX ? count : UINT32_MAX;
+}
+
+static inline struct Bucket *get_bucket(i32 cx, i32 cy) {
+    u32 hash = (u32) cx * 73856093u ^ (u32) cy * 19349663u;
+    return &buckets[hash & (BUCKET_COUNT - 1)];
+}
+
+static bool bucket_add(struct Bucket *bucket, u32 id) {
+    if(bucket->count == bucket->size) {
+        u32 new_size = bucket->size ? bucket->size * 2 : 8;
+        u32 *new_ids = realloc(bucket->ids, new_size * sizeof(u32));
+        if(!new_ids)
+            return false;
+
+        bucket->ids = new_ids;
+        bucket->size = new_size;
+    }
+    bucket->ids[bucket->count++] = id;
+    return true;
+}
+
+static void bucket_remove(struct Bucket *bucket, u32 id) {
+    for(u32 i = 0; i < bucket->count; i++) {
+        if(bucket->ids[i] == id) {
+            bucket->ids[i] = bucket->ids[--bucket->count];
+            return;
+        }
+    }
+}
+
+// An entity is added to the same bucket once for each of its cells
+// that falls into it, so adding and removing always match.
+static bool add_to_cells(u32 id, const struct CellRange *cells) {
+    for(i64 cy = cells->y0; cy <= cells->y1; cy++) {
+        for(i64 cx = cells->x0; cx <= cells->x1; cx++) {
+            if(bucket_add(get_bucket(cx, cy), id))
+                continue;
+
+            // undo the cells added so far
+            for(i64 ry = cells->y0; ry <= cy; ry++) {
+                for(i64 rx = cells->x0; rx <= cells->x1; rx++) {
+                    if(ry == cy && rx == cx)
+                        break;
+                    bucket_remove(get_bucket(rx, ry), id);
+                }
+            }
+            fputs("Broadphase: could not allocate bucket\n", stderr);
+            return false;
+        }
+    }
+    return true;
+}
+
+static void remove_from_cells(u32 id, const struct CellRange *cells) {
+    for(i64 cy = cells->y0; cy <= cells->y1; cy++)
+        for(i64 cx = cells->x0; cx <= cells->x1; cx++)
+            bucket_remove(get_bucket(cx, cy), id);
+}
+
+static bool is_rect_valid(i32 x, i32 y, u32 w, u32 h) {
+    if(w == 0 || h == 0 || w > INT32_MAX || h > INT32_MAX)
+        return false;
+
+    // limit the number of cells of an entity
+    struct CellRange cells = get_cells(x, y, w, h);
+    return cell_count(&cells) <= BUCKET_COUNT;
+}
+
+// ENTITIES
+
+void broadphase_reset(void) {
+    for(u32 i = 0; i < BUCKET_COUNT; i++) {
+        free(buckets[i].ids);
+        buckets[i] = (struct Bucket) { 0 };
+    }
+
+    free(entities);
+    free(used_ids);
+    free(marks);
+
+    entities = NULL;
+    used_ids = NULL;
+    marks = NULL;
+
+    used_count = 0;
+    mark = 0;
+
+    cell_size = BROADPHASE_DEFAULT_CELL_SIZE;
+}
+
+int broadphase_set_cell_size(u32 size) {
+    if(size == 0 || size % SPRITE_SIZE != 0 ||
+       size > BROADPHASE_MAX_CELL_SIZE)
+        return -1;
+
+    if(size == cell_size)
+        return 0;
+
+    for(u32 i = 0; i < BUCKET_COUNT; i++)
+        buckets[i].count = 0;
+    cell_size = size;
+
+    // entities too large for the new cells are removed
+    for(u32 i = 0; i < used_count; i++) {
+        const u32 id = used_ids[i];
+        struct Entity *e = &entities[id];
+
+        e->cells = get_cells(e->x, e->y, e->w, e->h);
+        if(!is_rect_valid(e->x, e->y, e->w, e->h) ||
+           !add_to_cells(id, &e->cells)) {
+            e->cells = (struct CellRange) { 0, 0, -1, -1 };
+            broadphase_remove(id);
+            i--;
+        }
+    }
+    return 0;
+}
+
+int broadphase_insert(u32 id, i32 x, i32 y, u32 w, u32 h) {
+    if(id >= BROADPHASE_MAX_ENTITIES || !is_rect_valid(x, y, w, h))
+        return -1;
+
+    if(!prepare())
+        return -2;
+
+    if(is_used(id))
+        return -3;
+
+    struct Entity *e = &entities[id];
+    *e = (struct Entity) {
+        .x = x, .y = y,
+        .w = w, .h = h,
+
+        .cells = get_cells(x, y, w, h),
+        .index = used_count
+    };
+
+    if(!add_to_cells(id, &e->cells)) {
+        e->index = UINT32_MAX;
+        return -2;
+    }
+
+    used_ids[used_count++] = id;
+    return 0;
+}
+
+int broadphase_move(u32 id, i32 x, i32 y, u32 w, u32 h) {
+    if(id >= BROADPHASE_MAX_ENTITIES || !is_used(id) ||
+       !is_rect_valid(x, y, w, h))
+        return -1;
+
+    struct Entity *e = &entities[id];
+    e->x = x;
+    e->y = y;
+    e->w = w;
+    e->h = h;
+
+    struct CellRange cells = get_cells(x, y, w, h);
+    if(!memcmp(&cells, &e->cells, sizeof(cells)))
+        return 0;
+
+    remove_from_cells(id, &e->cells);
+    if(!add_to_cells(id, &cells)) {
+        // keep the old cells, so that the entity can still be found
+        add_to_cells(id, &e->cells);
+        return -2;
+    }
+    e->cells = cells;
+    return 0;
+}
+
+void broadphase_remove(u32 id) {
+    if(id >= BROADPHASE_MAX_ENTITIES || !is_used(id))
+        return;
+
+    struct Entity *e = &entities[id];
+    remove_from_cells(id, &e->cells);
+
+    // move the last id in place of this one
+    const u32 last = used_ids[--used_count];
+    used_ids[e->index] = last;
+    entities[last].index = e->index;
+
+    e->index = UINT32_MAX;
+}
+
+// QUERIES
+
+static inline bool overlaps(const struct Entity *e,
+                            i64 x, i64 y, i64 w, i64 h) {
+    return e->x < x + w && x < e->x + (i64) e->w &&
+           e->y < y + h && y < e->y + (i64) e->h;
+}
+
+static void check_bucket(const struct Bucket *bucket, u32 min_id,
+                         i64 x, i64 y, i64 w, i64 h) {
+    for(u32 i = 0; i < bucket->count; i++) {
+        const u32 id = bucket->ids[i];
+        if(id < min_id || marks[id] == mark)
+            continue;
+        marks[id] = mark;
+
+        if(overlaps(&entities[id], x, y, w, h) && reserve_results(1))
+            results[results_count++] = id;
+    }
+}
+
+// Adds the entities with id >= min_id that overlap the rectangle
+static void find_overlapping(u32 min_id, i32 x, i32 y, u32 w, u32 h) {
+    next_mark();
+
+    struct CellRange cells = get_cells(x, y, w, h);
+    if(cell_count(&cells) > BUCKET_COUNT) {
+        // large areas: checking all buckets is faster
+        for(u32 i = 0; i < BUCKET_COUNT; i++)
+            check_bucket(&buckets[i], min_id, x, y, w, h);
+        return;
+    }
+
+    for(i64 cy = cells.y0; cy <= cells.y1; cy++)
+        for(i64 cx = cells.x0; cx <= cells.x1; cx++)
+            check_bucket(get_bucket(cx, cy), min_id, x, y, w, h);
+}
+
+u32 broadphase_query(i32 x, i32 y, u32 w, u32 h, const u32 **ids) {
+    results_count = 0;
+    *ids = results;
+
+    if(!entities || w == 0 || h == 0)
+        return 0;
+
+    find_overlapping(0, x, y, w, h);
+
+    *ids = results;
+    return results_count;
+}
+
+u32 broadphase_pairs(const u32 **pairs) {
+    results_count = 0;
+    *pairs = results;
+
+    if(!entities)
+        return 0;
+
+    for(u32 i = 0; i < used_count; i++) {
+        const u32 id = used_ids[i];
+        const struct Entity *e = &entities[id];
+
+        // the other entities found are added after 'id'
+        const u32 first = results_count;
+        find_overlapping(id + 1, e->x, e->y, e->w, e->h);
+
+        // turn the list of ids into pairs
+        const u32 found = results_count - first;
+        if(!reserve_results(found)) {
+            results_count = first;
+            break;
+        }
+        results_count += found;
+
+        for(u32 j = found; j > 0; j--) {
+            results[first + (j - 1) * 2 + 1] = results[first + j - 1];
+            results[first + (j - 1) * 2]     = id;
+        }
+    }
+
+    *pairs = results;
+    return results_count / 2;
+}
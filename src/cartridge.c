@@ -22,6 +22,7 @@
 #include "archive-util.h"
 
 #include <stdio.h>
+#include <string.h>
 #include <limits.h>
 
 #include <sys/stat.h>
@@ -120,6 +121,8 @@ static int load_cartridge_info(void) {
     char filename[PATH_MAX];
     snprintf(filename, PATH_MAX, "%s/cartridge-info", game_folder);
 
+    cartridge_info.audio = (struct sound_Config) { 0 };
+
     FILE *file = fopen(filename, "r");
 
     if(!file) {
@@ -147,6 +150,31 @@ static int load_cartridge_info(void) {
         err = -1;
     }
 
+    // optional settings, one per line
+    char line[256];
+    while(!err && fgets(line, sizeof(line) / sizeof(char), file)) {
+        char key[64];
+        char value[64];
+
+        if(sscanf(line, " %63[^=# \t\n] = %63s", key, value) != 2)
+            continue;
+
+        #define AUDIO_PREFIX "audio-"
+        if(!strncmp(key, AUDIO_PREFIX, strlen(AUDIO_PREFIX)) &&
+           !sound_parse_option(
+               &cartridge_info.audio, key + strlen(AUDIO_PREFIX), value
+           )) {
+            continue;
+        }
+        #undef AUDIO_PREFIX
+
+        fprintf(
+            stderr,
+            "Cartridge: ignoring invalid setting '%s = %s'\n",
+            key, value
+        );
+    }
+
     fclose(file);
     return err;
 }
@@ -169,5 +197,10 @@ static int load_sounds(void) {
     char folder[PATH_MAX];
     snprintf(folder, PATH_MAX, "%s/sfx", game_folder);
 
+    // reopen the audio device first, if needed, as the sounds are
+    // converted to its format when loaded
+    if(sound_apply_config(&cartridge_info.audio))
+        return -1;
+
     return sound_load(folder);
 }
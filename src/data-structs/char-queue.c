@@ -15,6 +15,8 @@
  */
 #include "data-structs/char-queue.h"
 
+#include <string.h>
+
 // Implementation of a Circular Queue of characters using an array
 
 struct CharQueue {
@@ -80,3 +82,73 @@ char charqueue_dequeue(struct CharQueue *queue) {
 
     return c;
 }
+
+u32 charqueue_enqueue_bulk(struct CharQueue *queue,
+                           const char *chars, u32 len) {
+    u32 free_space = queue->size - queue->count;
+    if(len > free_space)
+        len = free_space;
+
+    // copy in at most two parts: until the end of the array, then
+    // from the beginning
+    u32 first_part = queue->size - queue->head;
+    if(first_part > len)
+        first_part = len;
+
+    memcpy(queue->array + queue->head, chars, first_part);
+    memcpy(queue->array, chars + first_part, len - first_part);
+
+    queue->head = (queue->head + len) % queue->size;
+    queue->count += len;
+
+    return len;
+}
+
+u32 charqueue_dequeue_bulk(struct CharQueue *queue,
+                           char *chars, u32 len) {
+    if(len > queue->count)
+        len = queue->count;
+
+    u32 first_part = queue->size - queue->tail;
+    if(first_part > len)
+        first_part = len;
+
+    memcpy(chars, queue->array + queue->tail, first_part);
+    memcpy(chars + first_part, queue->array, len - first_part);
+
+    queue->tail = (queue->tail + len) % queue->size;
+    queue->count -= len;
+
+    return len;
+}
+
+u32 charqueue_count(struct CharQueue *queue) {
+    return queue->count;
+}
+
+u32 charqueue_size(struct CharQueue *queue) {
+    return queue->size;
+}
+
+int charqueue_resize(struct CharQueue *queue, u32 size) {
+    if(size < queue->count || size == 0)
+        return -1;
+
+    char *array = malloc(size * sizeof(char));
+    if(!array)
+        return -2;
+
+    // move the content to the beginning of the new array
+    u32 count = queue->count;
+    charqueue_dequeue_bulk(queue, array, count);
+
+    free(queue->array);
+    queue->array = array;
+    queue->size  = size;
+
+    queue->count = count;
+    queue->tail  = 0;
+    queue->head  = count % size;
+
+    return 0;
+}
@@ -17,100 +17,234 @@
 
 #include <string.h>
 
+// Implementation of a Hashtable using open addressing and linear
+// probing. The hash of each key is stored to avoid computing it again
+// when growing and to skip most string comparisons.
+
+#define MIN_SIZE (8)
+
+// the table grows when count > size * 3 / 4
+#define MAX_LOAD_NUMERATOR   (3)
+#define MAX_LOAD_DENOMINATOR (4)
+
 struct hashtable_Entry {
-    char *key;
+    char *key; // NULL if the slot is empty
     void *value;
-
-    struct hashtable_Entry *next;
+    u32 hash;
 };
 
 struct Hashtable {
     struct hashtable_Entry *slots;
+
+    // always a power of 2
     u32 size;
+    u32 count;
 };
 
-static u32 hash_string(const char *string, u32 table_size) {
-    u32 hash = 0;
+// FNV-1a
+static u32 hash_string(const char *string) {
+    u32 hash = 2166136261u;
 
     for(u32 i = 0; string[i] != '\0'; i++) {
-        hash = hash * 31 + string[i];
+        hash ^= (u8) string[i];
+        hash *= 16777619u;
     }
-    return hash % table_size;
+    return hash;
 }
 
-static struct hashtable_Entry *get_entry(struct Hashtable *table,
-                                         const char *key) {
-    u32 hash = hash_string(key, table->size);
-    return &table->slots[hash];
+// Returns the index of the slot containing 'key' or, if the key is
+// not present, the index of the empty slot where it should be added.
+static u32 find_slot(struct Hashtable *table, const char *key, u32 hash) {
+    const u32 mask = table->size - 1;
+
+    u32 i = hash & mask;
+    while(true) {
+        struct hashtable_Entry *entry = &table->slots[i];
+
+        if(!entry->key)
+            return i;
+        if(entry->hash == hash && !strcmp(key, entry->key))
+            return i;
+
+        i = (i + 1) & mask;
+    }
 }
 
 struct Hashtable *hashtable_create(u32 size) {
     struct Hashtable *table = malloc(sizeof(struct Hashtable));
 
+    // round size up to a power of 2
+    u32 actual_size = MIN_SIZE;
+    while(actual_size < size)
+        actual_size *= 2;
+
     *table = (struct Hashtable) {
-        .slots = calloc(size, sizeof(struct hashtable_Entry)),
-        .size = size
+        .slots = calloc(actual_size, sizeof(struct hashtable_Entry)),
+        .size  = actual_size,
+        .count = 0
     };
     return table;
 }
 
-static void destroy_entry(struct hashtable_Entry *entry,
-                          void (*destroy_value_fn)(void *)) {
-    if(entry->key)
-        free(entry->key);
-    if(entry->value && destroy_value_fn)
-        destroy_value_fn(entry->value);
-
-    if(entry->next) {
-        destroy_entry(entry->next, destroy_value_fn);
-        free(entry->next);
-    }
-}
-
 void hashtable_destroy(struct Hashtable *table,
                        void (*destroy_value_fn)(void *)) {
     if(!table)
         return;
 
-    for(u32 i = 0; i < table->size; i++)
-        destroy_entry(&table->slots[i], destroy_value_fn);
+    for(u32 i = 0; i < table->size; i++) {
+        struct hashtable_Entry *entry = &table->slots[i];
+        if(!entry->key)
+            continue;
+
+        free(entry->key);
+        if(entry->value && destroy_value_fn)
+            destroy_value_fn(entry->value);
+    }
     free(table->slots);
     free(table);
 }
 
-void hashtable_set(struct Hashtable *table,
-                   const char *key, void *value) {
-    struct hashtable_Entry *entry = get_entry(table, key);
+static void grow(struct Hashtable *table) {
+    struct hashtable_Entry *old_slots = table->slots;
+    u32 old_size = table->size;
+
+    table->size *= 2;
+    table->slots = calloc(table->size, sizeof(struct hashtable_Entry));
+
+    // move the entries: keys are not copied
+    const u32 mask = table->size - 1;
+    for(u32 i = 0; i < old_size; i++) {
+        struct hashtable_Entry *entry = &old_slots[i];
+        if(!entry->key)
+            continue;
+
+        u32 j = entry->hash & mask;
+        while(table->slots[j].key)
+            j = (j + 1) & mask;
+
+        table->slots[j] = *entry;
+    }
+    free(old_slots);
+}
 
-    while(entry->next)
-        entry = entry->next;
+void *hashtable_set(struct Hashtable *table,
+                    const char *key, void *value) {
+    u32 hash = hash_string(key);
+    u32 i = find_slot(table, key, hash);
+    struct hashtable_Entry *entry = &table->slots[i];
 
     if(entry->key) {
-        entry->next = calloc(1, sizeof(struct hashtable_Entry));
-        entry = entry->next;
+        void *old_value = entry->value;
+        entry->value = value;
+        return old_value;
     }
 
-    entry->key = malloc((strlen(key) + 1) * sizeof(char));
-    strcpy(entry->key, key);
+    if((table->count + 1) * MAX_LOAD_DENOMINATOR >
+       table->size * MAX_LOAD_NUMERATOR) {
+        grow(table);
+
+        i = find_slot(table, key, hash);
+        entry = &table->slots[i];
+    }
+
+    char *key_copy = malloc((strlen(key) + 1) * sizeof(char));
+    strcpy(key_copy, key);
+
+    *entry = (struct hashtable_Entry) {
+        .key   = key_copy,
+        .value = value,
+        .hash  = hash
+    };
+    table->count++;
+
+    return NULL;
+}
+
+int hashtable_update(struct Hashtable *table,
+                     const char *key, void *value) {
+    u32 i = find_slot(table, key, hash_string(key));
+    struct hashtable_Entry *entry = &table->slots[i];
+
+    if(!entry->key)
+        return -1;
 
     entry->value = value;
+    return 0;
 }
 
 int hashtable_get(struct Hashtable *table,
                   const char *key, void **value) {
-    struct hashtable_Entry *entry = get_entry(table, key);
+    u32 i = find_slot(table, key, hash_string(key));
+    struct hashtable_Entry *entry = &table->slots[i];
+
+    if(!entry->key) {
+        *value = NULL;
+        return -1;
+    }
+
+    *value = entry->value;
+    return 0;
+}
+
+int hashtable_remove(struct Hashtable *table, const char *key,
+                     void (*destroy_value_fn)(void *)) {
+    const u32 mask = table->size - 1;
 
+    u32 i = find_slot(table, key, hash_string(key));
+    struct hashtable_Entry *entry = &table->slots[i];
+
+    if(!entry->key)
+        return -1;
+
+    free(entry->key);
+    if(entry->value && destroy_value_fn)
+        destroy_value_fn(entry->value);
+
+    // Shift back the following entries of the same cluster, so that
+    // no tombstone is needed: an entry can be moved into the hole only
+    // if its ideal slot is not between the hole and the entry itself.
+    u32 hole = i;
+    u32 j = i;
     while(true) {
-        if(entry->key && !strcmp(key, entry->key)) {
-            *value = entry->value;
-            return 0;
+        j = (j + 1) & mask;
+
+        struct hashtable_Entry *next = &table->slots[j];
+        if(!next->key)
+            break;
+
+        u32 ideal = next->hash & mask;
+        bool can_move = (hole <= j)
+                        ? (ideal <= hole || ideal > j)
+                        : (ideal <= hole && ideal > j);
+        if(can_move) {
+            table->slots[hole] = *next;
+            hole = j;
         }
+    }
+    table->slots[hole] = (struct hashtable_Entry) { 0 };
+    table->count--;
 
-        if(!entry->next) {
-            *value = NULL;
-            return -1;
-        }
+    return 0;
+}
+
+u32 hashtable_count(struct Hashtable *table) {
+    return table->count;
+}
 
-        entry = entry->next;
+bool hashtable_next(struct Hashtable *table, u32 *iterator,
+                    const char **key, void **value) {
+    for(u32 i = *iterator; i < table->size; i++) {
+        struct hashtable_Entry *entry = &table->slots[i];
+        if(!entry->key)
+            continue;
+
+        *key   = entry->key;
+        *value = entry->value;
+
+        *iterator = i + 1;
+        return true;
     }
+
+    *iterator = table->size;
+    return false;
 }
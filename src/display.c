@@ -15,6 +15,8 @@
  */
 #include "display.h"
 
+#include "sprite-mask.h"
+
 #include <stdio.h>
 #include <string.h>
 #include <limits.h>
@@ -30,6 +32,8 @@ static SDL_Texture *font_texture;
 static SDL_Surface *atlas_surface = NULL;
 static SDL_Texture *atlas_texture = NULL;
 
+u32 display_target_generation = 0;
+
 static int set_window_icon(void) {
     char filename[PATH_MAX];
     snprintf(filename, PATH_MAX, "%s/icon.png", res_folder);
@@ -205,6 +209,10 @@ int display_update_atlas(SDL_Surface *surface, SDL_Texture **texture) {
     if(!texture)
         texture = &atlas_texture;
 
+    // masks are only kept for the atlas of the cartridge
+    if(surface == atlas_surface)
+        mask_update(surface);
+
     // delete old texture
     if(*texture) {
         SDL_DestroyTexture(*texture);
@@ -251,6 +259,51 @@ void display_toggle_fullscreen(void) {
     fullscreen = !fullscreen;
 }
 
+SDL_Texture *display_create_target(void) {
+    SDL_Texture *target = SDL_CreateTexture(
+        renderer, SDL_PIXELFORMAT_RGBA8888, SDL_TEXTUREACCESS_TARGET,
+        DISPLAY_WIDTH, DISPLAY_HEIGHT
+    );
+    if(!target) {
+        fprintf(
+            stderr,
+            "SDL: could not create render target\n"
+            " - SDL_CreateTexture: %s\n", SDL_GetError()
+        );
+        return NULL;
+    }
+    SDL_SetTextureBlendMode(target, SDL_BLENDMODE_BLEND);
+
+    return target;
+}
+
+SDL_Texture *display_create_streaming_texture(SDL_Surface *surface) {
+    SDL_Texture *texture = SDL_CreateTexture(
+        renderer, surface->format->format, SDL_TEXTUREACCESS_STREAMING,
+        surface->w, surface->h
+    );
+    if(!texture) {
+        fprintf(
+            stderr,
+            "SDL: could not create streaming texture\n"
+            " - SDL_CreateTexture: %s\n", SDL_GetError()
+        );
+        return NULL;
+    }
+    SDL_SetTextureBlendMode(texture, SDL_BLENDMODE_BLEND);
+
+    SDL_UpdateTexture(texture, NULL, surface->pixels, surface->pitch);
+    return texture;
+}
+
+void display_set_target(SDL_Texture *target) {
+    SDL_SetRenderTarget(renderer, target);
+}
+
+void display_draw_target(SDL_Texture *target) {
+    SDL_RenderCopy(renderer, target, NULL, NULL);
+}
+
 void display_clear(u32 color) {
     display_fill(0, 0, DISPLAY_WIDTH, DISPLAY_HEIGHT, color, 0xff);
 }
@@ -0,0 +1,129 @@
+/* Copyright 2024 Vulcalien
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#include "flood-fill.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+struct Seed {
+    u32 x, y;
+};
+
+struct Stack {
+    struct Seed *seeds;
+    u32 count;
+    u32 size;
+};
+
+static bool push(struct Stack *stack, u32 x, u32 y) {
+    if(stack->count == stack->size) {
+        u32 new_size = stack->size ? stack->size * 2 : 64;
+        struct Seed *new_seeds = realloc(
+            stack->seeds, new_size * sizeof(struct Seed)
+        );
+        if(!new_seeds) {
+            fputs("Flood Fill: could not allocate stack\n", stderr);
+            return false;
+        }
+
+        stack->seeds = new_seeds;
+        stack->size = new_size;
+    }
+    stack->seeds[stack->count++] = (struct Seed) { x, y };
+    return true;
+}
+
+// Pushes one seed for each run of matching cells of row 'y', from x0
+// to x1. Cells of the same run are reached when the seed is filled.
+static bool push_runs(struct Stack *stack, u32 x0, u32 x1, u32 y,
+                      FloodMatchFn matches, void *data) {
+    bool in_run = false;
+    for(u32 x = x0; x <= x1; x++) {
+        if(!matches(data, x, y)) {
+            in_run = false;
+        } else if(!in_run) {
+            in_run = true;
+            if(!push(stack, x, y))
+                return false;
+        }
+    }
+    return true;
+}
+
+i64 flood_fill(u32 x, u32 y, const struct flood_Rect *bounds,
+               FloodMatchFn matches, FloodSpanFn fill_span,
+               void *data, struct flood_Rect *changed) {
+    struct flood_Rect area = { UINT32_MAX, UINT32_MAX, 0, 0 };
+    i64 filled = 0;
+
+    struct Stack stack = { 0 };
+
+    if(x < bounds->x0 || x > bounds->x1 ||
+       y < bounds->y0 || y > bounds->y1)
+        goto exit;
+
+    if(!push(&stack, x, y)) {
+        filled = -1;
+        goto exit;
+    }
+
+    while(stack.count > 0) {
+        struct Seed seed = stack.seeds[--stack.count];
+
+        // the seed may have been filled by another span
+        if(!matches(data, seed.x, seed.y))
+            continue;
+
+        // extend the span to the left and to the right
+        u32 x0 = seed.x;
+        while(x0 > bounds->x0 && matches(data, x0 - 1, seed.y))
+            x0--;
+
+        u32 x1 = seed.x;
+        while(x1 < bounds->x1 && matches(data, x1 + 1, seed.y))
+            x1++;
+
+        if(!fill_span(data, x0, x1, seed.y)) {
+            filled = -1;
+            goto exit;
+        }
+        filled += x1 - x0 + 1;
+
+        if(x0 < area.x0) area.x0 = x0;
+        if(x1 > area.x1) area.x1 = x1;
+        if(seed.y < area.y0) area.y0 = seed.y;
+        if(seed.y > area.y1) area.y1 = seed.y;
+
+        // the rows above and below can continue the area
+        if(seed.y > bounds->y0 &&
+           !push_runs(&stack, x0, x1, seed.y - 1, matches, data)) {
+            filled = -1;
+            goto exit;
+        }
+        if(seed.y < bounds->y1 &&
+           !push_runs(&stack, x0, x1, seed.y + 1, matches, data)) {
+            filled = -1;
+            goto exit;
+        }
+    }
+
+    exit:
+    free(stack.seeds);
+
+    if(changed)
+        *changed = area;
+    return filled;
+}
@@ -0,0 +1,319 @@
+/* Copyright 2024 Vulcalien
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#include "fov.h"
+
+#include "map.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static bool opaque[256];
+static u32 opaque_layer = 0;
+
+// The visibility is stored in chunks, like the tiles of the map, so
+// that only the areas that were seen use memory.
+static u8 **chunks = NULL;
+static u32 chunks_w = 0;
+static u32 chunks_h = 0;
+
+// rectangle containing the visible tiles (x1 and y1 excluded)
+static u32 visible_x0 = UINT32_MAX, visible_y0 = UINT32_MAX;
+static u32 visible_x1 = 0,          visible_y1 = 0;
+
+static inline bool is_opaque(u32 x, u32 y) {
+    if(opaque_layer >= map.layer_count)
+        return false;
+    return opaque[map_layer_get_tile(opaque_layer, x, y)];
+}
+
+// OPTIONS
+
+void fov_reset(void) {
+    memset(opaque, 0, sizeof(opaque));
+    opaque_layer = 0;
+
+    fov_clear(true);
+}
+
+void fov_set_opaque(u8 tile, bool flag) {
+    opaque[tile] = flag;
+}
+
+bool fov_is_opaque(u8 tile) {
+    return opaque[tile];
+}
+
+void fov_set_layer(u32 layer) {
+    opaque_layer = layer;
+}
+
+// RAYCAST
+
+// Digital differential analyzer: the ray visits, in order, every tile
+// it crosses, stepping to the next vertical or horizontal grid line.
+int fov_raycast(double x0, double y0, double x1, double y1,
+                u32 *hit_x, u32 *hit_y) {
+    if(!(x0 >= 0 && x0 < map.width  && y0 >= 0 && y0 < map.height &&
+         x1 >= 0 && x1 < map.width  && y1 >= 0 && y1 < map.height))
+        return -1;
+
+    // the coordinates are not negative: truncating is the same as
+    // rounding down
+    i64 xt = (i64) x0;
+    i64 yt = (i64) y0;
+
+    const i64 xt_end = (i64) x1;
+    const i64 yt_end = (i64) y1;
+
+    const double dx = x1 - x0;
+    const double dy = y1 - y0;
+
+    const i32 step_x = (dx < 0) ? -1 : 1;
+    const i32 step_y = (dy < 0) ? -1 : 1;
+
+    // 't' goes from 0 to 1 along the ray: 't_max' is the value at the
+    // next grid line, 't_delta' the distance between two grid lines
+    double t_max_x, t_delta_x;
+    if(dx != 0) {
+        t_delta_x = step_x / dx;
+        t_max_x = (dx > 0 ? (xt + 1 - x0) : (x0 - xt)) * t_delta_x;
+    } else {
+        t_delta_x = 0;
+        t_max_x = 2;
+    }
+
+    double t_max_y, t_delta_y;
+    if(dy != 0) {
+        t_delta_y = step_y / dy;
+        t_max_y = (dy > 0 ? (yt + 1 - y0) : (y0 - yt)) * t_delta_y;
+    } else {
+        t_delta_y = 0;
+        t_max_y = 2;
+    }
+
+    // the number of steps is known: rounding errors can only change
+    // their order, so the ray always ends in the last tile
+    u64 steps_x = (xt_end > xt) ? xt_end - xt : xt - xt_end;
+    u64 steps_y = (yt_end > yt) ? yt_end - yt : yt - yt_end;
+
+    while(steps_x + steps_y > 0) {
+        if(steps_y == 0 || (steps_x != 0 && t_max_x < t_max_y)) {
+            xt += step_x;
+            t_max_x += t_delta_x;
+            steps_x--;
+        } else {
+            yt += step_y;
+            t_max_y += t_delta_y;
+            steps_y--;
+        }
+
+        if(is_opaque(xt, yt)) {
+            *hit_x = xt;
+            *hit_y = yt;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// VISIBILITY
+
+// index of the tile (x, y) inside its chunk
+static inline u32 chunk_index(u32 x, u32 y) {
+    return (y & MAP_CHUNK_MASK) << MAP_CHUNK_SHIFT | (x & MAP_CHUNK_MASK);
+}
+
+static u8 *get_chunk(u32 x, u32 y, bool create) {
+    const u32 i = (y >> MAP_CHUNK_SHIFT) * chunks_w + (x >> MAP_CHUNK_SHIFT);
+    if(chunks[i] || !create)
+        return chunks[i];
+
+    chunks[i] = calloc(MAP_CHUNK_TILES, sizeof(u8));
+    if(!chunks[i])
+        fputs("FOV: could not allocate visibility chunk\n", stderr);
+    return chunks[i];
+}
+
+static inline void set_visible(u32 x, u32 y) {
+    u8 *chunk = get_chunk(x, y, true);
+    if(!chunk)
+        return;
+
+    chunk[chunk_index(x, y)] = FOV_VISIBLE;
+
+    if(x <  visible_x0) visible_x0 = x;
+    if(y <  visible_y0) visible_y0 = y;
+    if(x >= visible_x1) visible_x1 = x + 1;
+    if(y >= visible_y1) visible_y1 = y + 1;
+}
+
+// multipliers that transform the coordinates of the first octant into
+// the ones of each octant
+static const i8 octants[8][4] = {
+    {  1,  0,  0,  1 }, {  0,  1,  1,  0 },
+    {  0, -1,  1,  0 }, { -1,  0,  0,  1 },
+    { -1,  0,  0, -1 }, {  0, -1, -1,  0 },
+    {  0,  1, -1,  0 }, {  1,  0,  0, -1 }
+};
+
+struct Viewer {
+    u32 x, y;
+    u32 radius;
+    const i8 *octant;
+};
+
+// Scans the rows of an octant from 'row', between the slopes 'start'
+// and 'end'. When a row contains opaque tiles, the part of the next
+// rows that is still lit is scanned recursively.
+static void cast_light(const struct Viewer *v, u32 row,
+                       double start, double end) {
+    if(start < end)
+        return;
+
+    const i64 radius2 = (i64) v->radius * v->radius;
+    const i8 *m = v->octant;
+
+    for(i64 j = row; j <= v->radius; j++) {
+        bool blocked = false;
+        double new_start = 0;
+
+        const i64 dy = -j;
+        for(i64 dx = -j; dx <= 0; dx++) {
+            // slopes of the tile's left and right corners
+            const double l_slope = (dx - 0.5) / (dy + 0.5);
+            const double r_slope = (dx + 0.5) / (dy - 0.5);
+
+            if(start < r_slope)
+                continue;
+            if(end > l_slope)
+                break;
+
+            const i64 x = v->x + dx * m[0] + dy * m[1];
+            const i64 y = v->y + dx * m[2] + dy * m[3];
+
+            // tiles outside the map are opaque
+            bool is_wall = true;
+            if(x >= 0 && x < map.width && y >= 0 && y < map.height) {
+                if(dx * dx + dy * dy <= radius2)
+                    set_visible(x, y);
+                is_wall = is_opaque(x, y);
+            }
+
+            if(blocked) {
+                if(is_wall) {
+                    new_start = r_slope;
+                } else {
+                    blocked = false;
+                    start = new_start;
+                }
+            } else if(is_wall && j < v->radius) {
+                blocked = true;
+                cast_light(v, j + 1, start, l_slope);
+                new_start = r_slope;
+            }
+        }
+
+        if(blocked)
+            break;
+    }
+}
+
+static bool prepare_chunks(void) {
+    if(chunks)
+        return true;
+
+    chunks_w = map.chunks_w;
+    chunks_h = map.chunks_h;
+
+    chunks = calloc((size_t) chunks_w * chunks_h, sizeof(u8 *));
+    if(!chunks) {
+        fputs("FOV: could not allocate visibility\n", stderr);
+        return false;
+    }
+    return true;
+}
+
+int fov_compute(u32 x, u32 y, u32 radius, bool clear) {
+    if(x >= map.width || y >= map.height || radius > FOV_MAX_RADIUS)
+        return -1;
+
+    if(clear)
+        fov_clear(false);
+
+    if(!prepare_chunks())
+        return -2;
+
+    set_visible(x, y);
+    for(u32 i = 0; i < 8; i++) {
+        struct Viewer viewer = {
+            .x = x, .y = y,
+            .radius = radius,
+            .octant = octants[i]
+        };
+        cast_light(&viewer, 1, 1.0, 0.0);
+    }
+    return 0;
+}
+
+void fov_clear(bool forget) {
+    if(chunks && forget) {
+        for(u32 i = 0; i < chunks_w * chunks_h; i++)
+            free(chunks[i]);
+        free(chunks);
+        chunks = NULL;
+    } else if(chunks) {
+        // only the rectangle of the visible tiles has to be checked
+        for(u32 y = visible_y0; y < visible_y1; y++) {
+            for(u32 x = visible_x0; x < visible_x1; x++) {
+                u8 *chunk = get_chunk(x, y, false);
+                if(!chunk) {
+                    x |= MAP_CHUNK_MASK;
+                    continue;
+                }
+
+                u8 *tile = &chunk[chunk_index(x, y)];
+                if(*tile == FOV_VISIBLE)
+                    *tile = FOV_EXPLORED;
+            }
+        }
+    }
+
+    visible_x0 = UINT32_MAX;
+    visible_y0 = UINT32_MAX;
+    visible_x1 = 0;
+    visible_y1 = 0;
+}
+
+u8 fov_get(u32 x, u32 y) {
+    if(!chunks)
+        return FOV_UNSEEN;
+
+    const u8 *chunk = get_chunk(x, y, false);
+    if(!chunk)
+        return FOV_UNSEEN;
+    return chunk[chunk_index(x, y)];
+}
+
+const u8 *fov_chunk(u32 chunk_x, u32 chunk_y) {
+    if(!chunks)
+        return NULL;
+    return chunks[chunk_y * chunks_w + chunk_x];
+}
+
+void fov_map_changed(void) {
+    fov_clear(true);
+}
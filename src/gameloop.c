@@ -97,7 +97,21 @@ void gameloop(void) {
             #endif
         }
 
-        SDL_Delay(4);
+        // If nothing is changing, block until an event arrives or the
+        // timeout expires, instead of polling.
+        u32 wait_time = ticked ? idle_time() : 0;
+
+        SDL_PumpEvents();
+        if(wait_time > 0 && !SDL_HasEvents(SDL_FIRSTEVENT, SDL_LASTEVENT)) {
+            SDL_WaitEventTimeout(NULL, wait_time);
+
+            // the time spent waiting is not processed as missed ticks:
+            // tick once as soon as the wait ends
+            last_time = SDL_GetPerformanceCounter();
+            unprocessed_time = time_per_tick;
+        } else {
+            SDL_Delay(4);
+        }
     }
 }
 
@@ -95,6 +95,12 @@ void input_tick(void) {
             break;
         }
 
+        // render targets have to be drawn again
+        if(e.type == SDL_RENDER_TARGETS_RESET ||
+           e.type == SDL_RENDER_DEVICE_RESET) {
+            display_target_generation++;
+        }
+
         // controller connect/disconnect
         if(e.type == SDL_CONTROLLERDEVICEADDED) {
             if(!controller) {
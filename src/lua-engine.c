@@ -19,6 +19,7 @@
 #include "input.h"
 #include "sound.h"
 #include "cartridge.h"
+#include "map.h"
 
 #include <stdio.h>
 #include <string.h>
@@ -47,6 +48,9 @@ static char *exit_msg = NULL;
 
 static lua_State *L = NULL;
 
+// low-power mode: maximum wait in milliseconds (0 = disabled)
+static u32 low_power_wait = 0;
+
 static void *core_lib_handle = NULL;
 static void *editor_lib_handle = NULL;
 
@@ -209,6 +213,7 @@ void engine_load(bool is_editor) {
         return;
     }
     engine_running = true;
+    low_power_wait = 0;
 
     L = luaL_newstate();
 
@@ -297,6 +302,7 @@ void engine_stop(void) {
         return;
     }
     engine_running = false;
+    low_power_wait = 0;
 
     if(L) {
         lua_close(L);
@@ -331,7 +337,20 @@ void engine_ask_exit(i8 code, const char *msg) {
     }
 }
 
+void engine_set_low_power(u32 max_wait) {
+    if(max_wait > TPS * 10)
+        max_wait = TPS * 10;
+
+    low_power_wait = max_wait * 1000 / TPS;
+}
+
+u32 engine_idle_time(void) {
+    return low_power_wait;
+}
+
 void engine_tick(void) {
+    map_animate();
+
     lua_getglobal(L, "tick");
     if(!lua_isfunction(L, -1)) {
         fputs("Engine: a function 'tick()' must be defined\n", stderr);
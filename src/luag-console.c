@@ -29,6 +29,7 @@
 
 #include <stdio.h>
 #include <string.h>
+#include <strings.h>
 #include <limits.h>
 #include <time.h>
 
@@ -36,15 +37,26 @@
 #include <sys/stat.h>
 #include <unistd.h>
 
-static int init(int argc, char *argv[]);
+static int parse_options(int argc, char *argv[]);
+static int run_batch(void);
+
+static int init(void);
 static void destroy(void);
 
 static int find_res_folder(void);
 static int find_config_folder(void);
 
+static char *clone(const char *str);
+static char *concat(const char *a, const char *b);
+
 bool should_quit = false;
 
 bool dev_mode = false;
+bool batch_mode = false;
+
+// commands given on the command line
+static struct ArrayList *cli_commands = NULL;
+static bool cli_needs_display = false;
 
 char *res_folder    = NULL;
 char *config_folder = NULL;
@@ -53,14 +65,32 @@ char *game_folder   = NULL;
 int main(int argc, char *argv[]) {
     int err = 0;
 
-    err = init(argc, argv);
-    if(err)
+    cli_commands = arraylist_create(8, 8);
+
+    err = parse_options(argc, argv);
+    if(err) {
+        // a positive value means that the program should just exit
+        err = (err > 0) ? 0 : 2;
+        goto exit;
+    }
+
+    // batch commands that do not need a display are executed
+    // without creating the window
+    if(batch_mode && !cli_needs_display) {
+        err = run_batch();
         goto exit;
+    }
 
-    gameloop();
+    err = init();
+    if(!err)
+        gameloop();
+    destroy();
 
     exit:
-    destroy();
+    arraylist_destroy(cli_commands, free);
+
+    if(!err && batch_mode && terminal_error_count > 0)
+        err = 1;
     return err;
 }
 
@@ -76,6 +106,13 @@ void tick(void) {
         gameloop_stop();
 }
 
+u32 idle_time(void) {
+    if(engine_running)
+        return engine_idle_time();
+    else
+        return terminal_idle_time();
+}
+
 void render(void) {
     if(engine_running)
         engine_render();
@@ -85,7 +122,125 @@ void render(void) {
     display_refresh();
 }
 
-static int init(int argc, char *argv[]) {
+static void print_usage(const char *program) {
+    printf(
+        "Usage: %s [options] [cartridge]\n"
+        "Options:\n"
+        "  -c, --command CMD  execute a shell command and exit;\n"
+        "                     can be repeated\n"
+        "  -d, --developer    start in developer mode\n"
+        "  -h, --help         print this message\n"
+        "  -v, --version      print version\n",
+        program
+    );
+}
+
+// Returns 0 on success, a positive value if the program should exit
+// without errors or a negative value if the options are invalid.
+static int parse_options(int argc, char *argv[]) {
+    for(u32 i = 1; i < argc; i++) {
+        const char *arg = argv[i];
+
+        u32 len = strlen(arg);
+        if(len == 0)
+            continue;
+
+        if(arg[0] == '-') {
+            // if the argument starts with a '-' then it's an option
+            if(!strcmp(arg, "-c") || !strcmp(arg, "--command")) {
+                if(i + 1 >= argc) {
+                    fprintf(stderr, "LuaG: missing argument of '%s'\n", arg);
+                    return -1;
+                }
+                i++;
+
+                arraylist_add(cli_commands, clone(argv[i]));
+                batch_mode = true;
+            } else if(!strcmp(arg, "-d") || !strcmp(arg, "--developer")) {
+                dev_mode = true;
+            } else if(!strcmp(arg, "-h") || !strcmp(arg, "--help")) {
+                print_usage(argv[0]);
+                return 1;
+            } else if(!strcmp(arg, "-v") || !strcmp(arg, "--version")) {
+                puts(LUAG_VERSION);
+                return 1;
+            } else {
+                fprintf(stderr, "LuaG: unrecognized option '%s'\n", arg);
+                print_usage(argv[0]);
+                return -1;
+            }
+        } else {
+            // the argument should be a cartridge path
+            arraylist_add(cli_commands, concat("run ", arg));
+        }
+    }
+
+    // check if any command needs the display
+    const u32 count = arraylist_count(cli_commands);
+    for(u32 i = 0; i < count; i++) {
+        const char *command = arraylist_get(cli_commands, i);
+        while(*command == ' ')
+            command++;
+
+        u32 len = strcspn(command, " ");
+        if((len == 3 && !strncasecmp(command, "run", 3))  ||
+           (len == 4 && !strncasecmp(command, "edit", 4)) ||
+           (len == 6 && !strncasecmp(command, "editor", 6))) {
+            cli_needs_display = true;
+        }
+    }
+    return 0;
+}
+
+static int run_batch(void) {
+    int err = 0;
+
+    if(find_res_folder() || find_config_folder()) {
+        err = -1;
+        goto exit;
+    }
+
+    if(terminal_init()) {
+        err = -4;
+        goto exit;
+    }
+    if(commands_init()) {
+        err = -5;
+        goto exit;
+    }
+
+    const u32 count = arraylist_count(cli_commands);
+    for(u32 i = 0; i < count && !should_quit; i++) {
+        // copy the command, since it gets modified when parsed
+        char *line = clone(arraylist_get(cli_commands, i));
+
+        // there cannot be more arguments than half the characters
+        char **argv = malloc((strlen(line) / 2 + 1) * sizeof(char *));
+        u32 argc = 0;
+
+        char *cmd = strtok(line, " ");
+        while((argv[argc] = strtok(NULL, " ")))
+            argc++;
+
+        if(cmd)
+            commands_execute(cmd, argc, argv);
+
+        free(argv);
+        free(line);
+    }
+
+    exit:
+    commands_destroy();
+    terminal_destroy();
+
+    if(res_folder)
+        free(res_folder);
+    if(config_folder)
+        free(config_folder);
+    return err;
+}
+
+static int init(void) {
     if(find_res_folder() || find_config_folder())
         return -1;
 
@@ -109,27 +264,14 @@ static int init(int argc, char *argv[]) {
 
     srand(time(NULL));
 
-    // parse arguments
-    for(u32 i = 1; i < argc; i++) {
-        const char *arg = argv[i];
-
-        u32 len = strlen(arg);
-        if(len == 0)
-            continue;
-
-        if(arg[0] == '-') {
-            // if the argument starts with a '-' then it's an option
-
-            // TODO add options...
-        } else {
-            // the argument should be a cartridge path
-            terminal_receive_input("run ");
-            terminal_receive_input(arg);
-            terminal_receive_input("\n");
-
-            terminal_receive_input("exit\n");
-        }
+    // commands given on the command line are sent to the terminal
+    const u32 count = arraylist_count(cli_commands);
+    for(u32 i = 0; i < count; i++) {
+        terminal_receive_input(arraylist_get(cli_commands, i));
+        terminal_receive_input("\n");
     }
+    if(count > 0)
+        terminal_receive_input("exit\n");
 
     return 0;
 }
@@ -140,9 +282,11 @@ static void destroy(void) {
 
     sound_destroy();
     input_destroy();
-    display_destroy();
 
+    // the terminal owns a texture: destroy it before the renderer
     terminal_destroy();
+    display_destroy();
+
     commands_destroy();
     cartridge_destroy();
     map_destroy();
@@ -178,7 +322,9 @@ static char *find_folder(const char *description,
 
         struct stat st;
         if(!stat(path, &st) && S_ISDIR(st.st_mode)) {
-            printf("Found %s folder: '%s'\n", description, path);
+            // keep the output of batch commands clean
+            if(!batch_mode)
+                printf("Found %s folder: '%s'\n", description, path);
             return clone(path);
         }
     }
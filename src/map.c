@@ -15,76 +15,1372 @@
  */
 #include "map.h"
 
+#include "display.h"
+#include "pathfind.h"
+#include "fov.h"
+#include "flood-fill.h"
+
 #include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <pthread.h>
+
+#ifdef __unix__
+    #include <fcntl.h>
+    #include <unistd.h>
+    #include <sys/mman.h>
+    #include <sys/stat.h>
+#endif
+
+// Map file formats
+//
+// flat (old): width and height as big-endian u32, then all the tiles
+//
+// chunked: all numbers are big-endian
+//   0  "LGMP"
+//   4  u8  version
+//   5  u8  chunk shift (must be MAP_CHUNK_SHIFT)
+//   6  u8  fill tile (of layer 0)
+//   7  u8  layer count (version 3, reserved before)
+//   8  u32 width
+//   12 u32 height
+//   16 u32 chunk count
+//   20 (version 3 only) for each layer:
+//        u8  fill tile
+//        u8  flags (bit 0: visible)
+//        u16 reserved
+//        i32 parallax x, i32 parallax y
+//        i32 offset x,   i32 offset y
+//   ?? chunk index: for each chunk, u32 chunk id
+//      (layer * chunks_w * chunks_h + cy * chunks_w + cx), u32 offset of
+//      the chunk's data in the file and (version 2 and later) u32 length
+//      of the data
+// Chunks that are not in the index are filled with the layer's fill
+// tile. Before version 3, maps have only one layer.
+//
+// In version 1, all chunks are stored raw (MAP_CHUNK_TILES bytes). In
+// version 2, a chunk is stored raw if its length is MAP_CHUNK_TILES,
+// otherwise it is compressed with RLE: a control byte 'c' is followed
+// either by c + 1 literal tiles (c < 128) or by one tile repeated
+// c - 125 times (c >= 128).
+
+#define FLAT_HEADER_SIZE (8)
+
+#define CHUNKED_MAGIC       "LGMP"
+#define CHUNKED_VERSION     (3)
+#define CHUNKED_HEADER_SIZE (20)
+#define LAYER_INFO_SIZE     (20)
+
+#define LAYER_FLAG_VISIBLE (1 << 0)
+
+#define RLE_MAX_LITERAL (128)
+#define RLE_MIN_RUN     (3)
+#define RLE_MAX_RUN     (130)
 
-static int fread_u32_big_endian(u32 *result, FILE *file);
+struct Map map = { 0 };
 
-struct Map map = {
-    .width  = 0,
-    .height = 0,
-    .tiles = NULL
+// Content of the loaded map file: chunks can point inside it, in which
+// case they must not be freed.
+static u8 *file_data = NULL;
+static size_t file_size = 0;
+
+// save thread
+static pthread_t save_thread;
+static bool save_running = false;
+static int  save_result = 0;
+
+struct SaveJob {
+    char *filename;
+
+    u32 width;
+    u32 height;
+
+    // layer properties (chunks are not copied here)
+    u32 layer_count;
+    struct map_Layer layers[MAP_MAX_LAYERS];
+
+    // chunks that are saved
+    u32 count;
+    u32 *ids;
+    u8 *tiles;
 };
 
-int map_init(void) {
+static inline u32 index_entry_size(u8 version) {
+    return version == 1 ? 8 : 12;
+}
+
+static inline u32 read_u32(const u8 *b) {
+    return (u32) b[0] << 24 | b[1] << 16 | b[2] << 8 | b[3];
+}
+
+static inline void write_u32(u8 *b, u32 num) {
+    b[0] = num >> 24;
+    b[1] = num >> 16;
+    b[2] = num >> 8;
+    b[3] = num;
+}
+
+static inline bool is_owned(const u8 *chunk) {
+    return !(file_data && chunk >= file_data &&
+             chunk < file_data + file_size);
+}
+
+static void release_file(void) {
+    if(!file_data)
+        return;
+
+    #ifdef __unix__
+        munmap(file_data, file_size);
+    #else
+        free(file_data);
+    #endif
+
+    file_data = NULL;
+    file_size = 0;
+}
+
+static void free_layer(struct Map *m, u32 layer) {
+    struct map_Layer *l = &m->layers[layer];
+    if(!l->chunks)
+        return;
+
+    const u32 count = m->chunks_w * m->chunks_h;
+    for(u32 i = 0; i < count; i++)
+        if(l->chunks[i] && is_owned(l->chunks[i]))
+            free(l->chunks[i]);
+    free(l->chunks);
+
+    l->chunks = NULL;
+}
+
+static void free_chunks(struct Map *m) {
+    for(u32 i = 0; i < m->layer_count; i++)
+        free_layer(m, i);
+    *m = (struct Map) { 0 };
+}
+
+// Creates an empty layer, filled with 0
+static int create_layer(struct Map *m, u32 layer) {
+    // allocate at least one pointer, so that 'chunks' is never NULL
+    u8 **chunks = calloc(m->chunks_w * m->chunks_h + 1, sizeof(u8 *));
+    if(!chunks)
+        return -1;
+
+    m->layers[layer] = (struct map_Layer) {
+        .chunks = chunks,
+        .fill   = 0,
+
+        .visible = true,
+
+        .parallax_x = 100,
+        .parallax_y = 100
+    };
+    return 0;
+}
+
+static bool is_size_valid(u32 width, u32 height) {
+    return width <= MAP_MAX_SIZE && height <= MAP_MAX_SIZE;
+}
+
+// Creates a map with empty layers
+static int create_empty(struct Map *m, u32 width, u32 height,
+                        u32 layer_count) {
+    if(!is_size_valid(width, height) ||
+       layer_count == 0 || layer_count > MAP_MAX_LAYERS)
+        return -1;
+
+    *m = (struct Map) {
+        .width  = width,
+        .height = height,
+
+        .chunks_w = (width  + MAP_CHUNK_MASK) >> MAP_CHUNK_SHIFT,
+        .chunks_h = (height + MAP_CHUNK_MASK) >> MAP_CHUNK_SHIFT
+    };
+
+    for(u32 i = 0; i < layer_count; i++) {
+        if(create_layer(m, i)) {
+            free_chunks(m);
+            return -2;
+        }
+        m->layer_count++;
+    }
     return 0;
 }
 
+static bool is_uniform(const u8 *tiles, u32 len, u8 value) {
+    for(u32 i = 0; i < len; i++)
+        if(tiles[i] != value)
+            return false;
+    return true;
+}
+
+int map_init(void) {
+    map_reset_animations();
+    return create_empty(&map, 0, 0, 1);
+}
+
 void map_destroy(void) {
-    if(map.tiles)
-        free(map.tiles);
+    map_save_wait();
+
+    free_chunks(&map);
+    release_file();
+}
+
+u8 *map_alloc_chunk(u32 layer, u32 x, u32 y) {
+    struct map_Layer *l = &map.layers[layer];
+
+    u8 *chunk = malloc(MAP_CHUNK_TILES * sizeof(u8));
+    if(!chunk)
+        return NULL;
+    memset(chunk, l->fill, MAP_CHUNK_TILES * sizeof(u8));
+
+    l->chunks[
+        (y >> MAP_CHUNK_SHIFT) * map.chunks_w + (x >> MAP_CHUNK_SHIFT)
+    ] = chunk;
+    return chunk;
+}
+
+void map_tiles_changed(u32 layer, u32 x, u32 y, u32 w, u32 h) {
+    pathfind_tiles_changed(layer, x, y, w, h);
+}
+
+// LOAD
+
+static int read_file(char *filename, u8 **data, size_t *size) {
+    #ifdef __unix__
+        int fd = open(filename, O_RDONLY);
+        if(fd < 0)
+            return -1;
+
+        struct stat st;
+        if(fstat(fd, &st) || st.st_size == 0) {
+            close(fd);
+            return -2;
+        }
+
+        // private mapping: changes to the tiles are never written to
+        // the file, pages are copied when modified
+        void *mapping = mmap(
+            NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0
+        );
+        close(fd);
+
+        if(mapping == MAP_FAILED)
+            return -2;
+
+        *data = mapping;
+        *size = st.st_size;
+        return 0;
+    #else
+        FILE *file = fopen(filename, "rb");
+        if(!file)
+            return -1;
+
+        fseek(file, 0, SEEK_END);
+        long len = ftell(file);
+        fseek(file, 0, SEEK_SET);
+
+        u8 *buffer = NULL;
+        if(len > 0)
+            buffer = malloc(len);
+
+        if(!buffer || fread(buffer, 1, len, file) < (size_t) len) {
+            free(buffer);
+            fclose(file);
+            return -2;
+        }
+        fclose(file);
+
+        *data = buffer;
+        *size = len;
+        return 0;
+    #endif
+}
+
+static int parse_flat(struct Map *m, const u8 *data, size_t size) {
+    if(size < FLAT_HEADER_SIZE)
+        return -1;
+
+    u32 width  = read_u32(data);
+    u32 height = read_u32(data + 4);
+
+    if(!is_size_valid(width, height) ||
+       (u64) width * height > size - FLAT_HEADER_SIZE)
+        return -1;
+
+    if(create_empty(m, width, height, 1))
+        return -2;
+
+    struct map_Layer *layer = &m->layers[0];
+    const u8 *tiles = data + FLAT_HEADER_SIZE;
+
+    // copy the chunks that are not empty
+    for(u32 cy = 0; cy < m->chunks_h; cy++) {
+        for(u32 cx = 0; cx < m->chunks_w; cx++) {
+            const u32 x0 = cx << MAP_CHUNK_SHIFT;
+            const u32 y0 = cy << MAP_CHUNK_SHIFT;
+
+            const u32 w = (width  - x0 < MAP_CHUNK_SIZE) ? width  - x0
+                                                         : MAP_CHUNK_SIZE;
+            const u32 h = (height - y0 < MAP_CHUNK_SIZE) ? height - y0
+                                                         : MAP_CHUNK_SIZE;
+
+            bool empty = true;
+            for(u32 y = 0; y < h && empty; y++) {
+                const u8 *row = tiles + (size_t) (y0 + y) * width + x0;
+                empty = is_uniform(row, w, layer->fill);
+            }
+            if(empty)
+                continue;
+
+            u8 *chunk = malloc(MAP_CHUNK_TILES * sizeof(u8));
+            if(!chunk)
+                return -2;
+            memset(chunk, layer->fill, MAP_CHUNK_TILES * sizeof(u8));
+
+            for(u32 y = 0; y < h; y++) {
+                memcpy(
+                    chunk + (y << MAP_CHUNK_SHIFT),
+                    tiles + (size_t) (y0 + y) * width + x0,
+                    w * sizeof(u8)
+                );
+            }
+            layer->chunks[cy * m->chunks_w + cx] = chunk;
+        }
+    }
+    return 0;
+}
+
+// Writes the literal tiles from 'start' to 'end' into 'out'.
+// Returns false if 'out' would not be smaller than MAP_CHUNK_TILES.
+static bool rle_write_literals(const u8 *tiles, u32 start, u32 end,
+                               u8 *out, u32 *len) {
+    while(start < end) {
+        u32 count = end - start;
+        if(count > RLE_MAX_LITERAL)
+            count = RLE_MAX_LITERAL;
+
+        if(*len + 1 + count >= MAP_CHUNK_TILES)
+            return false;
+
+        out[(*len)++] = count - 1;
+        memcpy(out + *len, tiles + start, count);
+        *len += count;
+
+        start += count;
+    }
+    return true;
+}
+
+// Returns the number of bytes written to 'out', or 0 if the encoded
+// chunk would not be smaller than MAP_CHUNK_TILES.
+static u32 rle_encode(const u8 *tiles, u8 *out) {
+    u32 len = 0;
+    u32 literal_start = 0;
+
+    u32 i = 0;
+    while(i < MAP_CHUNK_TILES) {
+        u32 run = 1;
+        while(i + run < MAP_CHUNK_TILES && run < RLE_MAX_RUN &&
+              tiles[i + run] == tiles[i])
+            run++;
+
+        if(run < RLE_MIN_RUN) {
+            i += run;
+            continue;
+        }
+
+        if(!rle_write_literals(tiles, literal_start, i, out, &len) ||
+           len + 2 >= MAP_CHUNK_TILES)
+            return 0;
+
+        out[len++] = run + 125;
+        out[len++] = tiles[i];
+
+        i += run;
+        literal_start = i;
+    }
+
+    if(!rle_write_literals(tiles, literal_start, i, out, &len))
+        return 0;
+    return len;
+}
+
+// Returns nonzero if the data is invalid.
+static int rle_decode(const u8 *data, u32 len, u8 *tiles) {
+    u32 in = 0, out = 0;
+    while(in < len) {
+        const u8 c = data[in++];
+
+        if(c < 128) {
+            u32 count = c + 1;
+            if(in + count > len || out + count > MAP_CHUNK_TILES)
+                return -1;
+
+            memcpy(tiles + out, data + in, count);
+            in  += count;
+            out += count;
+        } else {
+            u32 count = c - 125;
+            if(in >= len || out + count > MAP_CHUNK_TILES)
+                return -1;
+
+            memset(tiles + out, data[in], count);
+            in++;
+            out += count;
+        }
+    }
+    return (out == MAP_CHUNK_TILES) ? 0 : -1;
+}
+
+static inline i32 read_i32(const u8 *b) {
+    return (i32) read_u32(b);
+}
+
+// Raw chunks point directly into 'data', which must stay valid.
+static int parse_chunked(struct Map *m, u8 *data, size_t size) {
+    if(size < CHUNKED_HEADER_SIZE)
+        return -1;
+
+    const u8 version = data[4];
+    const u8 shift   = data[5];
+    const u8 fill    = data[6];
+
+    if(version < 1 || version > CHUNKED_VERSION || shift != MAP_CHUNK_SHIFT)
+        return -1;
+
+    const u32 layer_count = (version >= 3) ? data[7] : 1;
+
+    u32 width  = read_u32(data + 8);
+    u32 height = read_u32(data + 12);
+    u32 count  = read_u32(data + 16);
+
+    if(create_empty(m, width, height, layer_count))
+        return -1;
+
+    size_t index_start = CHUNKED_HEADER_SIZE;
+    if(version >= 3) {
+        index_start += layer_count * LAYER_INFO_SIZE;
+        if(index_start > size)
+            return -1;
+
+        for(u32 i = 0; i < layer_count; i++) {
+            const u8 *info = data + CHUNKED_HEADER_SIZE + i * LAYER_INFO_SIZE;
+            struct map_Layer *layer = &m->layers[i];
+
+            layer->fill    = info[0];
+            layer->visible = (info[1] & LAYER_FLAG_VISIBLE);
+
+            layer->parallax_x = read_i32(info + 4);
+            layer->parallax_y = read_i32(info + 8);
+            layer->offset_x   = read_i32(info + 12);
+            layer->offset_y   = read_i32(info + 16);
+        }
+    } else {
+        m->layers[0].fill = fill;
+    }
+
+    const u32 entry_size = index_entry_size(version);
+
+    const u32 chunks_per_layer = m->chunks_w * m->chunks_h;
+    const u64 total = (u64) chunks_per_layer * layer_count;
+    if(count > total ||
+       (u64) count * entry_size > size - index_start)
+        return -1;
+
+    const u8 *index = data + index_start;
+    for(u32 i = 0; i < count; i++) {
+        const u8 *entry = index + i * entry_size;
+
+        u32 id     = read_u32(entry);
+        u32 offset = read_u32(entry + 4);
+        u32 length = (version == 1) ? MAP_CHUNK_TILES : read_u32(entry + 8);
+
+        if(id >= total ||
+           length == 0 || length > MAP_CHUNK_TILES ||
+           (u64) offset + length > size)
+            return -1;
+
+        u8 **chunk = &m->layers[id / chunks_per_layer].chunks[
+            id % chunks_per_layer
+        ];
+        if(*chunk)
+            return -1;
+
+        if(length == MAP_CHUNK_TILES) {
+            *chunk = data + offset;
+            continue;
+        }
+
+        *chunk = malloc(MAP_CHUNK_TILES * sizeof(u8));
+        if(!*chunk)
+            return -2;
+
+        if(rle_decode(data + offset, length, *chunk))
+            return -1;
+    }
+    return 0;
 }
 
 int map_load(char *filename) {
     int err = 0;
 
-    if(map.tiles) {
-        free(map.tiles);
-        map.tiles = NULL;
-    }
+    // wait for any save, in case it is writing this file
+    map_save_wait();
 
-    FILE *file = fopen(filename, "rb");
+    free_chunks(&map);
+    release_file();
 
-    if(!file) {
+    u8 *data;
+    size_t size;
+    if(read_file(filename, &data, &size)) {
         fprintf(
             stderr,
             "Map: could not load map file '%s'\n",
             filename
         );
-        err = -1;
+        create_empty(&map, 0, 0, 1);
+        return -1;
+    }
+
+    // set these before parsing, so that free_chunks knows which chunks
+    // point inside the file
+    file_data = data;
+    file_size = size;
+
+    if(size >= 4 && !memcmp(data, CHUNKED_MAGIC, 4))
+        err = parse_chunked(&map, data, size);
+    else
+        err = parse_flat(&map, data, size);
+
+    if(err) {
+        fputs("Map: map file is invalid\n", stderr);
+        err = -2;
+
+        free_chunks(&map);
+        create_empty(&map, 0, 0, 1);
+    }
+
+    // release the file if no chunk points inside it
+    bool used = false;
+    const u32 total = map.chunks_w * map.chunks_h;
+    for(u32 l = 0; l < map.layer_count && !used; l++) {
+        u8 **chunks = map.layers[l].chunks;
+        for(u32 i = 0; i < total && !used; i++)
+            used = (chunks[i] && !is_owned(chunks[i]));
+    }
+
+    if(!used)
+        release_file();
+
+    pathfind_map_changed();
+    fov_map_changed();
+    return err;
+}
+
+int map_create(u32 width, u32 height, u8 fill) {
+    struct Map new_map;
+    if(create_empty(&new_map, width, height, 1))
+        return -1;
+    new_map.layers[0].fill = fill;
+
+    free_chunks(&map);
+    release_file();
+
+    map = new_map;
+    pathfind_map_changed();
+    fov_map_changed();
+    return 0;
+}
+
+// Returns the part of the chunk (cx, cy) inside 'm'
+static inline void chunk_area(const struct Map *m, u32 cx, u32 cy,
+                              u32 *w, u32 *h) {
+    const u32 x0 = cx << MAP_CHUNK_SHIFT;
+    const u32 y0 = cy << MAP_CHUNK_SHIFT;
+
+    if(x0 >= m->width || y0 >= m->height) {
+        *w = *h = 0;
+        return;
+    }
+
+    *w = (m->width  - x0 < MAP_CHUNK_SIZE) ? m->width  - x0 : MAP_CHUNK_SIZE;
+    *h = (m->height - y0 < MAP_CHUNK_SIZE) ? m->height - y0 : MAP_CHUNK_SIZE;
+}
+
+// Creates the layer in 'new_map' and copies the chunks that are only
+// partially inside the old map. New tiles are set to 'fill'.
+static int resize_layer(struct Map *new_map, u32 layer, u8 fill) {
+    const struct map_Layer *old_layer = &map.layers[layer];
+    struct map_Layer *new_layer = &new_map->layers[layer];
+
+    *new_layer = *old_layer;
+    new_layer->chunks = calloc(
+        new_map->chunks_w * new_map->chunks_h + 1, sizeof(u8 *)
+    );
+    if(!new_layer->chunks)
+        return -1;
+
+    // keep the old fill value, so that absent chunks stay absent
+    const u8 old_fill = (map.width && map.height) ? old_layer->fill : fill;
+    new_layer->fill = old_fill;
+
+    for(u32 cy = 0; cy < new_map->chunks_h; cy++) {
+        for(u32 cx = 0; cx < new_map->chunks_w; cx++) {
+            u32 w, h;
+            chunk_area(&map, cx, cy, &w, &h);
+
+            // full chunks are moved later
+            if(w == MAP_CHUNK_SIZE && h == MAP_CHUNK_SIZE)
+                continue;
+
+            const u8 *old_chunk = NULL;
+            if(w > 0)
+                old_chunk = old_layer->chunks[cy * map.chunks_w + cx];
+
+            if(!old_chunk && fill == old_fill)
+                continue;
+
+            u8 *chunk = malloc(MAP_CHUNK_TILES * sizeof(u8));
+            if(!chunk)
+                return -2;
+            memset(chunk, fill, MAP_CHUNK_TILES * sizeof(u8));
+
+            for(u32 y = 0; y < h; y++) {
+                u8 *row = chunk + (y << MAP_CHUNK_SHIFT);
+                if(old_chunk)
+                    memcpy(row, old_chunk + (y << MAP_CHUNK_SHIFT), w);
+                else
+                    memset(row, old_fill, w);
+            }
+            new_layer->chunks[cy * new_map->chunks_w + cx] = chunk;
+        }
+    }
+    return 0;
+}
+
+// Moves the chunks entirely inside both maps
+static void move_full_chunks(struct Map *new_map, u32 layer) {
+    u8 **old_chunks = map.layers[layer].chunks;
+    u8 **new_chunks = new_map->layers[layer].chunks;
+
+    for(u32 cy = 0; cy < new_map->chunks_h; cy++) {
+        for(u32 cx = 0; cx < new_map->chunks_w; cx++) {
+            u32 w, h;
+            chunk_area(&map, cx, cy, &w, &h);
+            if(w != MAP_CHUNK_SIZE || h != MAP_CHUNK_SIZE)
+                continue;
+
+            new_chunks[cy * new_map->chunks_w + cx] =
+                old_chunks[cy * map.chunks_w + cx];
+            old_chunks[cy * map.chunks_w + cx] = NULL;
+        }
+    }
+}
+
+int map_resize(u32 width, u32 height, u8 fill) {
+    if(!is_size_valid(width, height))
+        return -1;
+
+    struct Map new_map = {
+        .width  = width,
+        .height = height,
+
+        .chunks_w = (width  + MAP_CHUNK_MASK) >> MAP_CHUNK_SHIFT,
+        .chunks_h = (height + MAP_CHUNK_MASK) >> MAP_CHUNK_SHIFT
+    };
+
+    for(u32 l = 0; l < map.layer_count; l++) {
+        new_map.layer_count++;
+
+        const u8 layer_fill = (l == 0) ? fill : map.layers[l].fill;
+        if(resize_layer(&new_map, l, layer_fill)) {
+            // 'new_map' only contains copies: the map is unchanged
+            free_chunks(&new_map);
+            return -2;
+        }
+    }
+
+    for(u32 l = 0; l < map.layer_count; l++)
+        move_full_chunks(&new_map, l);
+
+    // moved chunks may still point inside the loaded file: keep it
+    free_chunks(&map);
+    map = new_map;
+
+    pathfind_map_changed();
+    fov_map_changed();
+    return 0;
+}
+
+int map_set_layer_count(u32 count) {
+    if(count == 0 || count > MAP_MAX_LAYERS)
+        return -1;
+
+    while(map.layer_count > count) {
+        map.layer_count--;
+        free_layer(&map, map.layer_count);
+    }
+
+    while(map.layer_count < count) {
+        if(create_layer(&map, map.layer_count))
+            return -2;
+        map.layer_count++;
+    }
+
+    pathfind_map_changed();
+    return 0;
+}
+
+// SAVE
+
+static int write_map_file(struct SaveJob *job) {
+    int err = 0;
+
+    char tmp_filename[PATH_MAX];
+    snprintf(tmp_filename, PATH_MAX, "%s.tmp", job->filename);
+
+    FILE *file = fopen(tmp_filename, "wb");
+    if(!file) {
+        fprintf(
+            stderr,
+            "Map: could not create map file '%s'\n",
+            tmp_filename
+        );
+        return -1;
+    }
+
+    u8 header[CHUNKED_HEADER_SIZE] = { 0 };
+    memcpy(header, CHUNKED_MAGIC, 4);
+    header[4] = CHUNKED_VERSION;
+    header[5] = MAP_CHUNK_SHIFT;
+    header[6] = job->layers[0].fill;
+    header[7] = job->layer_count;
+    write_u32(header + 8,  job->width);
+    write_u32(header + 12, job->height);
+    write_u32(header + 16, job->count);
+
+    u8 layer_info[MAP_MAX_LAYERS * LAYER_INFO_SIZE] = { 0 };
+    const u32 layer_info_size = job->layer_count * LAYER_INFO_SIZE;
+    for(u32 i = 0; i < job->layer_count; i++) {
+        const struct map_Layer *layer = &job->layers[i];
+        u8 *info = layer_info + i * LAYER_INFO_SIZE;
+
+        info[0] = layer->fill;
+        info[1] = layer->visible ? LAYER_FLAG_VISIBLE : 0;
+
+        write_u32(info + 4,  layer->parallax_x);
+        write_u32(info + 8,  layer->parallax_y);
+        write_u32(info + 12, layer->offset_x);
+        write_u32(info + 16, layer->offset_y);
+    }
+
+    const u32 entry_size = index_entry_size(CHUNKED_VERSION);
+    const size_t index_size = (size_t) job->count * entry_size;
+
+    u8 *index  = calloc(index_size + 1, 1);
+    u8 *packed = malloc(MAP_CHUNK_TILES);
+    if(!index || !packed) {
+        err = -2;
         goto exit;
     }
 
-    if(fread_u32_big_endian(&map.width, file) ||
-       fread_u32_big_endian(&map.height, file)) {
-        goto invalid_file;
+    // the index is written first, then filled once the chunks are
+    // compressed
+    if(fwrite(header, 1, CHUNKED_HEADER_SIZE, file) < CHUNKED_HEADER_SIZE ||
+       fwrite(layer_info, 1, layer_info_size, file) < layer_info_size ||
+       fwrite(index, 1, index_size, file) < index_size) {
+        err = -2;
+        goto exit;
     }
 
-    u32 map_size = map.width * map.height;
+    u32 offset = CHUNKED_HEADER_SIZE + layer_info_size + index_size;
+    for(u32 i = 0; i < job->count; i++) {
+        const u8 *tiles = job->tiles + (size_t) i * MAP_CHUNK_TILES;
+
+        const u8 *chunk_data = packed;
+        u32 length = rle_encode(tiles, packed);
+        if(length == 0) {
+            chunk_data = tiles;
+            length = MAP_CHUNK_TILES;
+        }
 
-    map.tiles = malloc(map_size * sizeof(u8));
-    if(fread(map.tiles, sizeof(u8), map_size, file) < map_size)
-        goto invalid_file;
+        // offsets are stored as u32
+        if((u64) offset + length > UINT32_MAX ||
+           fwrite(chunk_data, 1, length, file) < length) {
+            err = -2;
+            goto exit;
+        }
 
-    // skip the "invalid file" error
-    goto exit;
+        u8 *entry = index + i * entry_size;
+        write_u32(entry,     job->ids[i]);
+        write_u32(entry + 4, offset);
+        write_u32(entry + 8, length);
 
-    invalid_file:
-    fputs("Map: map file is invalid\n", stderr);
+        offset += length;
+    }
+
+    if(fseek(file, CHUNKED_HEADER_SIZE + layer_info_size, SEEK_SET) ||
+       fwrite(index, 1, index_size, file) < index_size ||
+       fflush(file))
+        err = -2;
 
     exit:
-    if(file)
-        fclose(file);
+    if(err)
+        fputs("Map: could not write map file\n", stderr);
+
+    free(index);
+    free(packed);
+
+    #ifdef __unix__
+        // make sure the data is on disk before replacing the old file
+        if(!err && fsync(fileno(file)))
+            err = -2;
+    #endif
+
+    if(fclose(file))
+        err = -2;
+
+    if(!err) {
+        #ifdef _WIN32
+            // on Windows, rename fails if the destination exists
+            remove(job->filename);
+        #endif
+
+        if(rename(tmp_filename, job->filename)) {
+            fprintf(
+                stderr,
+                "Map: could not replace map file '%s'\n",
+                job->filename
+            );
+            err = -3;
+        }
+    }
+
+    if(err)
+        remove(tmp_filename);
+    return err;
+}
+
+static void destroy_job(struct SaveJob *job) {
+    free(job->filename);
+    free(job->ids);
+    free(job->tiles);
+    free(job);
+}
+
+static void *save_worker(void *arg) {
+    struct SaveJob *job = arg;
+
+    save_result = write_map_file(job);
+    destroy_job(job);
+    return NULL;
+}
+
+static inline bool is_chunk_saved(const struct map_Layer *layer, u32 i) {
+    return layer->chunks[i] &&
+           !is_uniform(layer->chunks[i], MAP_CHUNK_TILES, layer->fill);
+}
+
+int map_save(const char *filename) {
+    map_save_wait();
+
+    // copy the chunks, so that the map can be modified while saving
+    const u32 total = map.chunks_w * map.chunks_h;
+
+    u32 count = 0;
+    for(u32 l = 0; l < map.layer_count; l++)
+        for(u32 i = 0; i < total; i++)
+            if(is_chunk_saved(&map.layers[l], i))
+                count++;
+
+    struct SaveJob *job = malloc(sizeof(struct SaveJob));
+    if(!job) {
+        fputs("Map: could not allocate map copy\n", stderr);
+        return -1;
+    }
+
+    *job = (struct SaveJob) {
+        .filename = strdup(filename),
+
+        .width  = map.width,
+        .height = map.height,
+
+        .layer_count = map.layer_count,
+
+        .count = count,
+        .ids   = malloc(count * sizeof(u32) + 1),
+        .tiles = malloc((size_t) count * MAP_CHUNK_TILES + 1)
+    };
+
+    if(!job->filename || !job->ids || !job->tiles) {
+        fputs("Map: could not allocate map copy\n", stderr);
+        destroy_job(job);
+        return -1;
+    }
+
+    u32 n = 0;
+    for(u32 l = 0; l < map.layer_count; l++) {
+        const struct map_Layer *layer = &map.layers[l];
+
+        job->layers[l] = *layer;
+        job->layers[l].chunks = NULL;
+
+        for(u32 i = 0; i < total; i++) {
+            if(!is_chunk_saved(layer, i))
+                continue;
+
+            job->ids[n] = l * total + i;
+            memcpy(
+                job->tiles + (size_t) n * MAP_CHUNK_TILES,
+                layer->chunks[i], MAP_CHUNK_TILES * sizeof(u8)
+            );
+            n++;
+        }
+    }
+
+    save_result = 0;
+    if(pthread_create(&save_thread, NULL, save_worker, job)) {
+        // could not start the thread: save now
+        save_worker(job);
+        return save_result;
+    }
+    save_running = true;
+    return 0;
+}
+
+int map_save_wait(void) {
+    if(save_running) {
+        pthread_join(save_thread, NULL);
+        save_running = false;
+    }
+    return save_result;
+}
+
+// REGIONS
+
+static bool is_region_valid(u32 layer, u32 x, u32 y, u32 w, u32 h) {
+    return layer < map.layer_count &&
+           x <= map.width  && w <= map.width  - x &&
+           y <= map.height && h <= map.height - y;
+}
+
+// part of a region inside one chunk
+struct RegionPart {
+    u32 layer;
+
+    // position and size of the part, in tiles
+    u32 x, y;
+    u32 w, h;
+
+    // index of the tile (x, y) in the region's tiles
+    size_t index;
+
+    u8 **chunk;
+    u32 chunk_offset;
+};
+
+struct RegionArgs {
+    u32 region_w;
+    const u8 *src;
+    u8 *dst;
+    u8 tile;
+};
+
+typedef int (*RegionPartFn)(const struct RegionPart *part,
+                            const struct RegionArgs *args);
+
+static int for_each_part(u32 layer, u32 x, u32 y, u32 w, u32 h,
+                         RegionPartFn fn, const struct RegionArgs *args) {
+    struct RegionPart part = { .layer = layer };
+
+    for(part.y = y; part.y < y + h; part.y += part.h) {
+        part.h = MAP_CHUNK_SIZE - (part.y & MAP_CHUNK_MASK);
+        if(part.h > y + h - part.y)
+            part.h = y + h - part.y;
+
+        for(part.x = x; part.x < x + w; part.x += part.w) {
+            part.w = MAP_CHUNK_SIZE - (part.x & MAP_CHUNK_MASK);
+            if(part.w > x + w - part.x)
+                part.w = x + w - part.x;
+
+            part.index = (size_t) (part.y - y) * w + (part.x - x);
+            part.chunk = &map.layers[layer].chunks[
+                (part.y >> MAP_CHUNK_SHIFT) * map.chunks_w +
+                (part.x >> MAP_CHUNK_SHIFT)
+            ];
+            part.chunk_offset = (part.y & MAP_CHUNK_MASK) << MAP_CHUNK_SHIFT |
+                                (part.x & MAP_CHUNK_MASK);
+
+            int err = fn(&part, args);
+            if(err)
+                return err;
+        }
+    }
+    return 0;
+}
+
+static int read_part(const struct RegionPart *part,
+                     const struct RegionArgs *args) {
+    const u8 *chunk = *part->chunk;
+    const u8 fill = map.layers[part->layer].fill;
+
+    for(u32 r = 0; r < part->h; r++) {
+        u8 *dst = args->dst + part->index + (size_t) r * args->region_w;
+
+        if(chunk) {
+            const u8 *src = chunk + part->chunk_offset +
+                            (r << MAP_CHUNK_SHIFT);
+            memcpy(dst, src, part->w);
+        } else {
+            memset(dst, fill, part->w);
+        }
+    }
+    return 0;
+}
+
+static int write_part(const struct RegionPart *part,
+                      const struct RegionArgs *args) {
+    const u8 fill = map.layers[part->layer].fill;
+
+    if(!*part->chunk) {
+        // do not allocate chunks that would only contain 'fill'
+        bool empty = true;
+        for(u32 r = 0; r < part->h && empty; r++) {
+            const u8 *src = args->src + part->index +
+                            (size_t) r * args->region_w;
+            empty = is_uniform(src, part->w, fill);
+        }
+        if(empty)
+            return 0;
+
+        if(!map_alloc_chunk(part->layer, part->x, part->y))
+            return -2;
+    }
+
+    for(u32 r = 0; r < part->h; r++) {
+        memcpy(
+            *part->chunk + part->chunk_offset + (r << MAP_CHUNK_SHIFT),
+            args->src + part->index + (size_t) r * args->region_w,
+            part->w
+        );
+    }
+    return 0;
+}
+
+static int fill_part(const struct RegionPart *part,
+                     const struct RegionArgs *args) {
+    const u8 fill = map.layers[part->layer].fill;
+
+    if(part->w == MAP_CHUNK_SIZE && part->h == MAP_CHUNK_SIZE &&
+       args->tile == fill) {
+        // the whole chunk becomes empty
+        if(*part->chunk && is_owned(*part->chunk))
+            free(*part->chunk);
+        *part->chunk = NULL;
+        return 0;
+    }
 
+    if(!*part->chunk) {
+        if(args->tile == fill)
+            return 0;
+
+        if(!map_alloc_chunk(part->layer, part->x, part->y))
+            return -2;
+    }
+
+    for(u32 r = 0; r < part->h; r++) {
+        memset(
+            *part->chunk + part->chunk_offset + (r << MAP_CHUNK_SHIFT),
+            args->tile, part->w
+        );
+    }
+    return 0;
+}
+
+int map_read_region(u32 layer, u32 x, u32 y, u32 w, u32 h, u8 *tiles) {
+    if(!is_region_valid(layer, x, y, w, h))
+        return -1;
+
+    struct RegionArgs args = { .region_w = w, .dst = tiles };
+    return for_each_part(layer, x, y, w, h, read_part, &args);
+}
+
+int map_write_region(u32 layer, u32 x, u32 y, u32 w, u32 h,
+                     const u8 *tiles) {
+    if(!is_region_valid(layer, x, y, w, h))
+        return -1;
+
+    struct RegionArgs args = { .region_w = w, .src = tiles };
+    int err = for_each_part(layer, x, y, w, h, write_part, &args);
+
+    map_tiles_changed(layer, x, y, w, h);
     return err;
 }
 
-static int fread_u32_big_endian(u32 *result, FILE *file) {
-    u8 b[4];
+int map_fill(u32 layer, u32 x, u32 y, u32 w, u32 h, u8 tile) {
+    if(!is_region_valid(layer, x, y, w, h))
+        return -1;
+
+    struct RegionArgs args = { .tile = tile };
+    int err = for_each_part(layer, x, y, w, h, fill_part, &args);
+
+    map_tiles_changed(layer, x, y, w, h);
+    return err;
+}
+
+int map_copy(u32 layer, u32 src_x, u32 src_y, u32 w, u32 h,
+             u32 dst_x, u32 dst_y) {
+    if(!is_region_valid(layer, src_x, src_y, w, h) ||
+       !is_region_valid(layer, dst_x, dst_y, w, h))
+        return -1;
+
+    // copying through a buffer handles overlapping rectangles
+    u8 *tiles = malloc((size_t) w * h + 1);
+    if(!tiles)
+        return -2;
+
+    int err = map_read_region(layer, src_x, src_y, w, h, tiles);
+    if(!err)
+        err = map_write_region(layer, dst_x, dst_y, w, h, tiles);
+
+    free(tiles);
+    return err;
+}
+
+struct FloodArgs {
+    u32 layer;
+    u8 target;
+    u8 tile;
+
+    MapFillSpanFn on_span;
+    void *span_data;
+};
+
+static bool flood_matches(void *data, u32 x, u32 y) {
+    const struct FloodArgs *flood = data;
+    return map_layer_get_tile(flood->layer, x, y) == flood->target;
+}
+
+static bool flood_fill_span(void *data, u32 x0, u32 x1, u32 y) {
+    const struct FloodArgs *flood = data;
+
+    struct RegionArgs args = { .tile = flood->tile };
+    if(for_each_part(flood->layer, x0, y, x1 - x0 + 1, 1, fill_part, &args))
+        return false;
+
+    if(flood->on_span)
+        flood->on_span(flood->span_data, x0, x1, y);
+    return true;
+}
+
+i64 map_flood_fill(u32 layer, u32 x, u32 y, u8 tile,
+                   MapFillSpanFn on_span, void *span_data) {
+    if(!is_region_valid(layer, x, y, 1, 1))
+        return -1;
+
+    struct FloodArgs flood = {
+        .layer = layer,
+        .target = map_layer_get_tile(layer, x, y),
+        .tile = tile,
+
+        .on_span = on_span,
+        .span_data = span_data
+    };
+    if(flood.target == tile)
+        return 0;
+
+    const struct flood_Rect bounds = { 0, 0, map.width - 1, map.height - 1 };
+    struct flood_Rect changed;
+
+    i64 filled = flood_fill(
+        x, y, &bounds, flood_matches, flood_fill_span, &flood, &changed
+    );
+
+    // notify the other modules once, for the whole area
+    if(changed.x0 <= changed.x1) {
+        map_tiles_changed(
+            layer, changed.x0, changed.y0,
+            changed.x1 - changed.x0 + 1, changed.y1 - changed.y0 + 1
+        );
+    }
+
+    return filled;
+}
+
+// ANIMATION
 
-    if(fread(b, sizeof(u8), 4, file) < 4)
+struct Animation {
+    u8 frames[MAP_ANIM_MAX_FRAMES];
+    u32 frame_count;
+    u32 period;
+};
+
+static struct Animation animations[256];
+
+// ids of the animated tiles
+static u8 animated[256];
+static u32 animated_count = 0;
+
+static u32 anim_ticks = 0;
+
+// tile drawn in place of each id
+static u8 anim_frame[256];
+
+static void update_frame(u8 tile) {
+    const struct Animation *anim = &animations[tile];
+    anim_frame[tile] = anim->frames[
+        (anim_ticks / anim->period) % anim->frame_count
+    ];
+}
+
+int map_set_animation(u8 tile, const u8 *frames, u32 frame_count,
+                      u32 period) {
+    if(frame_count > MAP_ANIM_MAX_FRAMES || period == 0)
         return -1;
 
-    *result = b[0] << 24 | b[1] << 16 | b[2] << 8 | b[3];
+    struct Animation *anim = &animations[tile];
+
+    // remove the tile from the list, then add it again if needed
+    for(u32 i = 0; i < animated_count; i++) {
+        if(animated[i] == tile) {
+            animated[i] = animated[animated_count - 1];
+            animated_count--;
+            break;
+        }
+    }
+
+    anim->frame_count = frame_count;
+    anim->period = period;
+
+    if(frame_count == 0) {
+        anim_frame[tile] = tile;
+        return 0;
+    }
+
+    memcpy(anim->frames, frames, frame_count * sizeof(u8));
+    animated[animated_count++] = tile;
 
+    update_frame(tile);
     return 0;
 }
+
+void map_reset_animations(void) {
+    for(u32 i = 0; i < 256; i++) {
+        animations[i].frame_count = 0;
+        anim_frame[i] = i;
+    }
+    animated_count = 0;
+    anim_ticks = 0;
+}
+
+void map_animate(void) {
+    anim_ticks++;
+    for(u32 i = 0; i < animated_count; i++)
+        update_frame(animated[i]);
+}
+
+// RENDER
+
+// color modulation of explored tiles
+#define FOG_DIM_COLOR (0x606060)
+
+static void render_layer(SDL_Texture *atlas, u32 layer, u32 scale,
+                         i32 xoff, i32 yoff, enum map_Fog fog) {
+    const struct map_Layer *l = &map.layers[layer];
+    const i32 tile_size = SPRITE_SIZE * scale;
+
+    // in layers other than 0, tile 0 is empty
+    const bool skip_zero = (layer != 0);
+
+    i32 xt0 = xoff / tile_size;
+    if(xoff < 0) xt0--;
+
+    i32 yt0 = yoff / tile_size;
+    if(yoff < 0) yt0--;
+
+    i32 xt1 = xt0 + (DISPLAY_WIDTH / tile_size) + 1;
+    i32 yt1 = yt0 + (DISPLAY_HEIGHT / tile_size) + 1;
+
+    // check boundaries
+    if(xt0 < 0) xt0 = 0;
+    if(yt0 < 0) yt0 = 0;
+
+    if(xt1 > (i32) map.width)  xt1 = map.width;
+    if(yt1 > (i32) map.height) yt1 = map.height;
+
+    for(i32 yt = yt0; yt < yt1; yt++) {
+        u8 **chunk_row = &l->chunks[
+            (yt >> MAP_CHUNK_SHIFT) * map.chunks_w
+        ];
+        const u32 row_offset = (yt & MAP_CHUNK_MASK) << MAP_CHUNK_SHIFT;
+
+        i32 xt = xt0;
+        while(xt < xt1) {
+            // tiles of this row that are in the same chunk
+            i32 chunk_end = (xt | MAP_CHUNK_MASK) + 1;
+            if(chunk_end > xt1)
+                chunk_end = xt1;
+
+            const u8 *chunk = chunk_row[xt >> MAP_CHUNK_SHIFT];
+            if(!chunk && skip_zero && l->fill == 0) {
+                xt = chunk_end;
+                continue;
+            }
+
+            const u8 *visibility = NULL;
+            if(fog != MAP_FOG_NONE) {
+                visibility = fov_chunk(
+                    xt >> MAP_CHUNK_SHIFT, yt >> MAP_CHUNK_SHIFT
+                );
+
+                // no tile of this chunk was ever seen
+                if(!visibility) {
+                    xt = chunk_end;
+                    continue;
+                }
+            }
+
+            for(; xt < chunk_end; xt++) {
+                const u32 i = row_offset | (xt & MAP_CHUNK_MASK);
+
+                u8 id = chunk ? chunk[i] : l->fill;
+                if(id == 0 && skip_zero)
+                    continue;
+                id = anim_frame[id];
+
+                u32 color = 0xffffff;
+                if(visibility && visibility[i] != FOV_VISIBLE) {
+                    if(visibility[i] == FOV_UNSEEN || fog == MAP_FOG_HIDE)
+                        continue;
+                    color = FOG_DIM_COLOR;
+                }
+
+                display_draw_from_atlas(
+                    atlas,
+                    id, xt * tile_size - xoff, yt * tile_size - yoff,
+                    scale, 1, 1,
+                    0, false, false,
+                    0xff, color
+                );
+            }
+        }
+    }
+}
+
+void map_render(SDL_Texture *atlas, u32 layer_mask, u32 scale,
+                i32 xoff, i32 yoff, bool parallax, enum map_Fog fog) {
+    for(u32 i = 0; i < map.layer_count; i++) {
+        const struct map_Layer *layer = &map.layers[i];
+        if(!(layer_mask & (1 << i)) || !layer->visible)
+            continue;
+
+        i32 x = xoff;
+        i32 y = yoff;
+        if(parallax) {
+            x = (i64) xoff * layer->parallax_x / 100 - layer->offset_x;
+            y = (i64) yoff * layer->parallax_y / 100 - layer->offset_y;
+        }
+        render_layer(atlas, i, scale, x, y, fog);
+    }
+}
@@ -0,0 +1,691 @@
+/* Copyright 2024 Vulcalien
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#include "pathfind.h"
+
+#include "map.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#define INFINITE_DIST (UINT32_MAX)
+
+// weight of orthogonal and diagonal steps, multiplied by tile costs
+#define STEP_ORTHOGONAL (10)
+#define STEP_DIAGONAL   (14)
+
+// larger searches could overflow the distances
+#define MAX_SEARCH_NODES (1 << 20)
+
+const i8 pathfind_dir_x[8] = { 1, 1, 0, -1, -1, -1,  0,  1 };
+const i8 pathfind_dir_y[8] = { 0, 1, 1,  1,  0, -1, -1, -1 };
+
+static u8 costs[256];
+static u32 cost_layer = 0;
+static bool diagonal = false;
+
+struct Area {
+    u32 x, y;
+    u32 w, h;
+};
+
+struct Field {
+    bool used;
+    bool dirty;
+
+    u32 target_x;
+    u32 target_y;
+
+    struct Area area;
+
+    // distance of each tile of the area from the target
+    u32 *dist;
+};
+
+static struct Field fields[PATHFIND_MAX_FIELDS];
+
+// binary min-heap shared by all searches
+struct HeapEntry {
+    u64 key;
+    u32 index;
+};
+
+static struct HeapEntry *heap = NULL;
+static u32 heap_count = 0;
+static u32 heap_size  = 0;
+
+// A* nodes, found through an open addressing table
+struct Node {
+    u32 tile;
+    u32 slot;
+    u32 g;
+    u32 parent;
+    bool closed;
+};
+
+static struct Node *nodes = NULL;
+static u32 nodes_size = 0;
+static u32 node_count = 0;
+
+// node index + 1, 0 = empty slot. Only the slots of the last search's
+// nodes are emptied, so that preparing a search does not depend on the
+// size of the table.
+static u32 *slots = NULL;
+static u32 slots_size = 0;
+
+static u32 *path = NULL;
+static u32 path_size = 0;
+
+// HEAP
+
+static bool heap_push(u64 key, u32 index) {
+    if(heap_count == heap_size) {
+        u32 new_size = heap_size ? heap_size * 2 : 1024;
+        struct HeapEntry *new_heap = realloc(
+            heap, new_size * sizeof(struct HeapEntry)
+        );
+        if(!new_heap)
+            return false;
+
+        heap = new_heap;
+        heap_size = new_size;
+    }
+
+    u32 i = heap_count++;
+    while(i > 0) {
+        u32 parent = (i - 1) / 2;
+        if(heap[parent].key <= key)
+            break;
+
+        heap[i] = heap[parent];
+        i = parent;
+    }
+    heap[i] = (struct HeapEntry) { key, index };
+    return true;
+}
+
+static struct HeapEntry heap_pop(void) {
+    struct HeapEntry top = heap[0];
+    struct HeapEntry last = heap[--heap_count];
+
+    u32 i = 0;
+    while(true) {
+        u32 child = i * 2 + 1;
+        if(child >= heap_count)
+            break;
+
+        if(child + 1 < heap_count && heap[child + 1].key < heap[child].key)
+            child++;
+        if(last.key <= heap[child].key)
+            break;
+
+        heap[i] = heap[child];
+        i = child;
+    }
+    if(heap_count > 0)
+        heap[i] = last;
+    return top;
+}
+
+// MOVES
+
+static inline u8 tile_cost(u32 x, u32 y) {
+    return costs[map_layer_get_tile(cost_layer, x, y)];
+}
+
+static inline bool is_in_area(const struct Area *area, i64 x, i64 y) {
+    return x >= area->x && x < (i64) area->x + area->w &&
+           y >= area->y && y < (i64) area->y + area->h;
+}
+
+// Returns the cost of moving from (x, y) in direction 'dir', or 0 if
+// the move is not possible.
+static inline u32 move_cost(const struct Area *area, u32 x, u32 y,
+                            u32 dir) {
+    const i64 nx = (i64) x + pathfind_dir_x[dir];
+    const i64 ny = (i64) y + pathfind_dir_y[dir];
+
+    if(!is_in_area(area, nx, ny))
+        return 0;
+
+    const u8 cost = tile_cost(nx, ny);
+    if(cost == 0)
+        return 0;
+
+    if(dir & 1) {
+        // diagonal moves cannot cut corners
+        if(tile_cost(nx, y) == 0 || tile_cost(x, ny) == 0)
+            return 0;
+        return cost * STEP_DIAGONAL;
+    }
+    return cost * STEP_ORTHOGONAL;
+}
+
+static inline u32 dir_step(void) {
+    return diagonal ? 1 : 2;
+}
+
+static inline bool is_layer_valid(void) {
+    return cost_layer < map.layer_count;
+}
+
+// OPTIONS
+
+void pathfind_reset(void) {
+    memset(costs, 1, sizeof(costs));
+    cost_layer = 0;
+    diagonal = false;
+
+    for(u32 i = 0; i < PATHFIND_MAX_FIELDS; i++)
+        pathfind_flow_destroy(i);
+}
+
+void pathfind_set_cost(u8 tile, u8 cost) {
+    if(costs[tile] == cost)
+        return;
+
+    costs[tile] = cost;
+    pathfind_map_changed();
+}
+
+u8 pathfind_get_cost(u8 tile) {
+    return costs[tile];
+}
+
+void pathfind_set_layer(u32 layer) {
+    cost_layer = layer;
+    pathfind_map_changed();
+}
+
+void pathfind_set_diagonal(bool flag) {
+    diagonal = flag;
+    pathfind_map_changed();
+}
+
+// A*
+
+static inline u32 saturating_add(u32 a, u32 b) {
+    return (a > INFINITE_DIST - 1 - b) ? INFINITE_DIST - 1 : a + b;
+}
+
+static bool prepare_nodes(u32 max_nodes) {
+    for(u32 i = 0; i < node_count; i++)
+        slots[nodes[i].slot] = 0;
+    node_count = 0;
+
+    if(nodes_size < max_nodes) {
+        struct Node *new_nodes = realloc(
+            nodes, max_nodes * sizeof(struct Node)
+        );
+        if(!new_nodes)
+            return false;
+
+        nodes = new_nodes;
+        nodes_size = max_nodes;
+    }
+
+    // keep the table at most half full
+    u32 needed = 1;
+    while(needed < max_nodes * 2)
+        needed *= 2;
+
+    if(slots_size < needed) {
+        free(slots);
+        slots = calloc(needed, sizeof(u32));
+        if(!slots) {
+            slots_size = 0;
+            return false;
+        }
+        slots_size = needed;
+    }
+    return true;
+}
+
+// Returns the node of 'tile', adding it if necessary, or NULL if there
+// are already 'max_nodes' nodes.
+static struct Node *get_node(u32 tile, u32 max_nodes) {
+    const u32 mask = slots_size - 1;
+
+    u32 slot = (tile * 2654435761u) & mask;
+    while(slots[slot] != 0) {
+        struct Node *node = &nodes[slots[slot] - 1];
+        if(node->tile == tile)
+            return node;
+
+        slot = (slot + 1) & mask;
+    }
+
+    if(node_count == max_nodes)
+        return NULL;
+
+    struct Node *node = &nodes[node_count++];
+    *node = (struct Node) {
+        .tile = tile,
+        .slot = slot,
+        .g = INFINITE_DIST,
+        .closed = false
+    };
+    slots[slot] = node_count;
+    return node;
+}
+
+static u32 heuristic(u32 x0, u32 y0, u32 x1, u32 y1, u32 min_cost) {
+    u32 dx = (x0 > x1) ? x0 - x1 : x1 - x0;
+    u32 dy = (y0 > y1) ? y0 - y1 : y1 - y0;
+
+    u64 h;
+    if(diagonal) {
+        u32 d_min = (dx < dy) ? dx : dy;
+        u32 d_max = (dx < dy) ? dy : dx;
+        h = (u64) d_min * STEP_DIAGONAL +
+            (u64) (d_max - d_min) * STEP_ORTHOGONAL;
+    } else {
+        h = ((u64) dx + dy) * STEP_ORTHOGONAL;
+    }
+    h *= min_cost;
+
+    return (h >= INFINITE_DIST) ? INFINITE_DIST - 1 : h;
+}
+
+// Among nodes with the same 'f', the ones closer to the goal (with
+// higher 'g') are expanded first: this avoids exploring large areas
+// of equivalent paths.
+static inline u64 astar_key(u32 f, u32 g) {
+    return (u64) f << 32 | (INFINITE_DIST - g);
+}
+
+static i32 build_path(const struct Node *goal) {
+    u32 steps = 0;
+    for(const struct Node *n = goal; n != &nodes[0]; n = &nodes[n->parent])
+        steps++;
+
+    if(path_size < steps) {
+        u32 *new_path = realloc(path, steps * sizeof(u32));
+        if(!new_path)
+            return -2;
+
+        path = new_path;
+        path_size = steps;
+    }
+
+    u32 i = steps;
+    for(const struct Node *n = goal; n != &nodes[0]; n = &nodes[n->parent])
+        path[--i] = n->tile;
+    return steps;
+}
+
+i32 pathfind_astar(u32 x0, u32 y0, u32 x1, u32 y1,
+                   u32 max_nodes, const u32 **result) {
+    const struct Area area = { 0, 0, map.width, map.height };
+
+    if(!is_layer_valid() ||
+       !is_in_area(&area, x0, y0) || !is_in_area(&area, x1, y1) ||
+       tile_cost(x1, y1) == 0)
+        return -1;
+
+    if(max_nodes == 0 || max_nodes > MAX_SEARCH_NODES)
+        max_nodes = MAX_SEARCH_NODES;
+
+    // the heuristic must not overestimate: use the lowest cost
+    u32 min_cost = 255;
+    for(u32 i = 0; i < 256; i++)
+        if(costs[i] != 0 && costs[i] < min_cost)
+            min_cost = costs[i];
+
+    if(!prepare_nodes(max_nodes))
+        return -2;
+    heap_count = 0;
+
+    const u32 goal_tile = y1 * map.width + x1;
+
+    struct Node *start = get_node(y0 * map.width + x0, max_nodes);
+    start->g = 0;
+    if(!heap_push(astar_key(heuristic(x0, y0, x1, y1, min_cost), 0), 0))
+        return -2;
+
+    while(heap_count > 0) {
+        struct Node *node = &nodes[heap_pop().index];
+        if(node->closed)
+            continue;
+        node->closed = true;
+
+        if(node->tile == goal_tile) {
+            i32 steps = build_path(node);
+            *result = path;
+            return steps;
+        }
+
+        const u32 x = node->tile % map.width;
+        const u32 y = node->tile / map.width;
+
+        for(u32 dir = 0; dir < 8; dir += dir_step()) {
+            u32 cost = move_cost(&area, x, y, dir);
+            if(cost == 0)
+                continue;
+
+            const u32 nx = x + pathfind_dir_x[dir];
+            const u32 ny = y + pathfind_dir_y[dir];
+
+            // 'nodes' is not reallocated during a search
+            struct Node *next = get_node(ny * map.width + nx, max_nodes);
+            if(!next)
+                return -2;
+            if(next->closed)
+                continue;
+
+            const u32 g = saturating_add(node->g, cost);
+            if(g < next->g) {
+                next->g = g;
+                next->parent = node - nodes;
+
+                const u32 f = saturating_add(
+                    g, heuristic(nx, ny, x1, y1, min_cost)
+                );
+                if(!heap_push(astar_key(f, g), next - nodes))
+                    return -2;
+            }
+        }
+    }
+    return -1;
+}
+
+// FLOW FIELDS
+
+static bool is_area_valid(const struct Area *area) {
+    return area->x <= map.width  && area->w <= map.width  - area->x &&
+           area->y <= map.height && area->h <= map.height - area->y;
+}
+
+// Called when the heap cannot grow: the distances would be wrong, so
+// all tiles are unreachable until the field is recalculated.
+static void flow_fail(struct Field *field) {
+    const u32 size = field->area.w * field->area.h;
+    for(u32 i = 0; i < size; i++)
+        field->dist[i] = INFINITE_DIST;
+
+    field->dirty = true;
+    heap_count = 0;
+    fputs("Pathfind: could not allocate flow field heap\n", stderr);
+}
+
+// Runs Dijkstra's algorithm from the tiles in the heap
+static void flow_propagate(struct Field *field) {
+    const struct Area *area = &field->area;
+
+    while(heap_count > 0) {
+        const struct HeapEntry entry = heap_pop();
+        const u32 dist = entry.key;
+        const u32 i = entry.index;
+
+        if(dist != field->dist[i])
+            continue;
+
+        const u32 x = area->x + i % area->w;
+        const u32 y = area->y + i / area->w;
+
+        // look for the tiles that can move into this one
+        for(u32 dir = 0; dir < 8; dir += dir_step()) {
+            const i64 nx = (i64) x - pathfind_dir_x[dir];
+            const i64 ny = (i64) y - pathfind_dir_y[dir];
+
+            if(!is_in_area(area, nx, ny) || tile_cost(nx, ny) == 0)
+                continue;
+
+            u32 cost = move_cost(area, nx, ny, dir);
+            if(cost == 0)
+                continue;
+
+            const u32 n = (ny - area->y) * area->w + (nx - area->x);
+            const u32 new_dist = saturating_add(dist, cost);
+            if(new_dist < field->dist[n]) {
+                field->dist[n] = new_dist;
+                if(!heap_push(new_dist, n)) {
+                    flow_fail(field);
+                    return;
+                }
+            }
+        }
+    }
+}
+
+static void flow_compute(struct Field *field) {
+    const struct Area *area = &field->area;
+    const u32 size = area->w * area->h;
+
+    for(u32 i = 0; i < size; i++)
+        field->dist[i] = INFINITE_DIST;
+    field->dirty = false;
+
+    // the map might have been resized
+    if(!is_layer_valid() || !is_area_valid(area))
+        return;
+
+    if(tile_cost(field->target_x, field->target_y) == 0)
+        return;
+
+    const u32 target = (field->target_y - area->y) * area->w +
+                       (field->target_x - area->x);
+    field->dist[target] = 0;
+
+    heap_count = 0;
+    if(!heap_push(0, target)) {
+        flow_fail(field);
+        return;
+    }
+    flow_propagate(field);
+}
+
+// Returns the lowest distance that (x, y) can have, given the distances
+// of the tiles around it.
+static u32 flow_best(const struct Field *field, u32 x, u32 y, u8 *dir) {
+    const struct Area *area = &field->area;
+
+    *dir = PATHFIND_DIR_UNREACHABLE;
+    if(tile_cost(x, y) == 0)
+        return INFINITE_DIST;
+
+    if(x == field->target_x && y == field->target_y) {
+        *dir = PATHFIND_DIR_TARGET;
+        return 0;
+    }
+
+    u32 best = INFINITE_DIST;
+    for(u32 d = 0; d < 8; d += dir_step()) {
+        u32 cost = move_cost(area, x, y, d);
+        if(cost == 0)
+            continue;
+
+        const u32 n = (y + pathfind_dir_y[d] - area->y) * area->w +
+                      (x + pathfind_dir_x[d] - area->x);
+        if(field->dist[n] == INFINITE_DIST)
+            continue;
+
+        const u32 dist = saturating_add(field->dist[n], cost);
+        if(dist < best) {
+            best = dist;
+            *dir = d;
+        }
+    }
+    return best;
+}
+
+// Repairs the field after the tile (x, y) changed. Only the tiles
+// around it can become inconsistent: if some distance decreases, the
+// change is propagated, otherwise the field is recalculated.
+static void flow_repair(struct Field *field, u32 x, u32 y) {
+    const struct Area *area = &field->area;
+
+    u32 improved = 0;
+    for(i32 dy = -1; dy <= 1; dy++) {
+        for(i32 dx = -1; dx <= 1; dx++) {
+            const i64 tx = (i64) x + dx;
+            const i64 ty = (i64) y + dy;
+            if(!is_in_area(area, tx, ty))
+                continue;
+
+            const u32 i = (ty - area->y) * area->w + (tx - area->x);
+
+            u8 dir;
+            const u32 best = flow_best(field, tx, ty, &dir);
+            if(best > field->dist[i]) {
+                field->dirty = true;
+                return;
+            }
+            if(best < field->dist[i])
+                improved++;
+        }
+    }
+    if(improved == 0)
+        return;
+
+    heap_count = 0;
+    for(i32 dy = -1; dy <= 1; dy++) {
+        for(i32 dx = -1; dx <= 1; dx++) {
+            const i64 tx = (i64) x + dx;
+            const i64 ty = (i64) y + dy;
+            if(!is_in_area(area, tx, ty))
+                continue;
+
+            const u32 i = (ty - area->y) * area->w + (tx - area->x);
+
+            u8 dir;
+            const u32 best = flow_best(field, tx, ty, &dir);
+            if(best < field->dist[i]) {
+                field->dist[i] = best;
+                if(!heap_push(best, i)) {
+                    flow_fail(field);
+                    return;
+                }
+            }
+        }
+    }
+    flow_propagate(field);
+}
+
+i32 pathfind_flow_create(u32 target_x, u32 target_y,
+                         u32 x, u32 y, u32 w, u32 h) {
+    const struct Area area = { x, y, w, h };
+
+    if(w == 0 || h == 0 || (u64) w * h > PATHFIND_FIELD_MAX_TILES ||
+       !is_area_valid(&area) || !is_in_area(&area, target_x, target_y))
+        return -1;
+
+    for(u32 id = 0; id < PATHFIND_MAX_FIELDS; id++) {
+        struct Field *field = &fields[id];
+        if(field->used)
+            continue;
+
+        field->dist = malloc(w * h * sizeof(u32));
+        if(!field->dist)
+            return -2;
+
+        field->used  = true;
+        field->dirty = true;
+
+        field->target_x = target_x;
+        field->target_y = target_y;
+        field->area = area;
+        return id;
+    }
+    return -3;
+}
+
+void pathfind_flow_destroy(u32 id) {
+    if(id >= PATHFIND_MAX_FIELDS || !fields[id].used)
+        return;
+
+    free(fields[id].dist);
+    fields[id] = (struct Field) { 0 };
+}
+
+// Returns the field, recalculated if necessary, or NULL
+static struct Field *get_field(u32 id) {
+    if(id >= PATHFIND_MAX_FIELDS || !fields[id].used)
+        return NULL;
+
+    struct Field *field = &fields[id];
+    if(field->dirty)
+        flow_compute(field);
+    return field;
+}
+
+u8 pathfind_flow_dir(u32 id, u32 x, u32 y) {
+    struct Field *field = get_field(id);
+    if(!field || !is_in_area(&field->area, x, y) ||
+       !is_layer_valid() || !is_area_valid(&field->area))
+        return PATHFIND_DIR_UNREACHABLE;
+
+    u8 dir;
+    flow_best(field, x, y, &dir);
+    return dir;
+}
+
+int pathfind_flow_area(u32 id, u32 *x, u32 *y, u32 *w, u32 *h) {
+    if(id >= PATHFIND_MAX_FIELDS || !fields[id].used)
+        return -1;
+
+    const struct Area *area = &fields[id].area;
+    *x = area->x;
+    *y = area->y;
+    *w = area->w;
+    *h = area->h;
+    return 0;
+}
+
+int pathfind_flow_dirs(u32 id, u8 *dirs) {
+    struct Field *field = get_field(id);
+    if(!field)
+        return -1;
+
+    const struct Area *area = &field->area;
+    if(!is_layer_valid() || !is_area_valid(area)) {
+        memset(dirs, PATHFIND_DIR_UNREACHABLE, area->w * area->h);
+        return 0;
+    }
+
+    for(u32 y = 0; y < area->h; y++) {
+        for(u32 x = 0; x < area->w; x++) {
+            u8 *dir = &dirs[y * area->w + x];
+            flow_best(field, area->x + x, area->y + y, dir);
+        }
+    }
+    return 0;
+}
+
+void pathfind_tiles_changed(u32 layer, u32 x, u32 y, u32 w, u32 h) {
+    if(layer != cost_layer)
+        return;
+
+    for(u32 id = 0; id < PATHFIND_MAX_FIELDS; id++) {
+        struct Field *field = &fields[id];
+        if(!field->used || field->dirty)
+            continue;
+
+        const struct Area *area = &field->area;
+        if((u64) x >= (u64) area->x + area->w || x + (u64) w <= area->x ||
+           (u64) y >= (u64) area->y + area->h || y + (u64) h <= area->y)
+            continue;
+
+        if(w == 1 && h == 1)
+            flow_repair(field, x, y);
+        else
+            field->dirty = true;
+    }
+}
+
+void pathfind_map_changed(void) {
+    for(u32 id = 0; id < PATHFIND_MAX_FIELDS; id++)
+        fields[id].dirty = true;
+}
@@ -19,6 +19,7 @@
 #include "lua-engine.h"
 #include "cartridge.h"
 #include "archive-util.h"
+#include "sound.h"
 
 #include <stdio.h>
 #include <string.h>
@@ -159,7 +160,8 @@ CMD(cmd_pack) {
     if(argc == 0) {
         terminal_write(
             "Error: missing argument\n"
-            "pack [cartridge-name]",
+            "pack [cartridge-name]\n"
+            "     [threads]",
             true
         );
     } else {
@@ -186,18 +188,41 @@ CMD(cmd_pack) {
             fclose(file);
         }
 
+        // optional number of threads (0 = one per CPU)
+        u32 threads = 0;
+        if(argc > 1)
+            threads = strtoul(argv[1], NULL, 10);
+
         // pack cartridge
         char filename[PATH_MAX];
         snprintf(filename, PATH_MAX, "%s.luag", argv[0]);
 
-        if(archiveutil_pack(filename, USERDATA_FOLDER)) {
+        struct archiveutil_PackStats stats;
+        if(archiveutil_pack(filename, USERDATA_FOLDER, threads, &stats)) {
             terminal_write(
                 "Error:\n"
                 "could not create\n"
                 "cartridge file",
                 true
             );
+            return;
         }
+
+        char msg[256];
+        snprintf(
+            msg, sizeof(msg) / sizeof(char),
+            "files:   %u (%u reused)\n"
+            "size:    %llu -> %llu\n"
+            "ratio:   %llu%%\n"
+            "time:    %u ms (%u threads)",
+            stats.files, stats.reused,
+            (unsigned long long) stats.input_size,
+            (unsigned long long) stats.output_size,
+            (unsigned long long) (stats.input_size ?
+                stats.output_size * 100 / stats.input_size : 0),
+            stats.time_ms, stats.threads
+        );
+        terminal_write(msg, false);
     }
 }
 
@@ -298,6 +323,8 @@ CMD(cmd_help) {
         { "mode",   "change mode"       },
         { "files",  "open game folder"  },
         { "log",    "open log file"     },
+        { "audio",  "audio latency"     },
+        { "lines",  "scrollback rows"   },
         { NULL,     NULL                }
     };
 
@@ -373,6 +400,69 @@ CMD(cmd_files) {
 CMD(cmd_log) {
 }
 
+CMD(cmd_audio) {
+    // e.g. in batch mode, sound is not initialized
+    if(!sound_is_open()) {
+        terminal_write("Error:\naudio is not available", true);
+        return;
+    }
+
+    if(argc > 0) {
+        if(!strcmp(argv[0], "reset")) {
+            sound_measure_reset();
+            terminal_write("measurement reset", false);
+        } else {
+            terminal_write(
+                "Error:\n"
+                "unrecognized argument\n"
+                "audio [reset]",
+                true
+            );
+        }
+        return;
+    }
+
+    struct sound_Stats stats;
+    sound_measure_get(&stats);
+
+    char msg[512];
+    snprintf(
+        msg, sizeof(msg) / sizeof(char),
+        "frequency: %d Hz\n"
+        "channels:  %d\n"
+        "buffer:    %u frames\n"
+        "latency:   %u us\n"
+        "callbacks: %u\n"
+        "interval:  %u-%u us\n"
+        "average:   %u us\n"
+        "jitter:    %u us",
+        stats.frequency, stats.channels,
+        stats.buffer_size, stats.expected_interval,
+        stats.callbacks,
+        stats.min_interval, stats.max_interval,
+        stats.avg_interval, stats.jitter
+    );
+    terminal_write(msg, false);
+
+    // also log it, to compare different machines
+    printf("Audio measurement:\n%s\n", msg);
+}
+
+CMD(cmd_lines) {
+    if(argc == 0) {
+        terminal_write("lines [rows]", false);
+        return;
+    }
+
+    char *end;
+    long rows = strtol(argv[0], &end, 10);
+    if(*end != '\0' || rows <= 0 ||
+       terminal_set_scrollback(rows)) {
+        terminal_write("Error:\ninvalid number of rows", true);
+        return;
+    }
+}
+
 CMD(cmd_exit) {
     should_quit = true;
 }
@@ -417,6 +507,10 @@ void commands_execute(char *cmd, u32 argc, char **argv) {
         CALL(cmd_files);
     else if(TEST("log"))
         CALL(cmd_log);
+    else if(TEST("audio"))
+        CALL(cmd_audio);
+    else if(TEST("lines"))
+        CALL(cmd_lines);
     else if(TEST("exit"))
         CALL(cmd_exit);
     else
@@ -15,9 +15,13 @@
  */
 #include "sound.h"
 
+#include "synth.h"
+
 #include "data-structs/hashtable.h"
+#include "data-structs/array-list.h"
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <limits.h>
 
@@ -31,31 +35,286 @@
 struct Sound {
     Mix_Chunk *chunk;
     i32 channel;
+
+    // index in sounds_list
+    u32 id;
 };
 
+// name -> sound
 static struct Hashtable *sounds_table = NULL;
 
-int sound_init(void) {
-    if(Mix_OpenAudio(44100, MIX_DEFAULT_FORMAT, 2, 2048)) {
+// id -> sound
+static struct ArrayList *sounds_list = NULL;
+
+static struct sound_Config install_config = {
+    .frequency   = SOUND_DEFAULT_FREQUENCY,
+    .buffer_size = SOUND_DEFAULT_BUFFER_SIZE
+};
+static struct sound_Config current_config;
+static bool is_device_open = false;
+
+// obtained device spec
+static struct {
+    int frequency;
+    Uint16 format;
+    int channels;
+
+    u32 frame_size;
+} device;
+
+// mixer callback statistics, written by the audio thread
+static SDL_SpinLock measure_lock = 0;
+static struct {
+    u64 last_time;
+    u32 buffer_size;
+
+    u32 intervals;
+    u64 min_interval;
+    u64 max_interval;
+    u64 interval_sum;
+    u64 deviation_sum;
+} measure;
+
+static void destroy_sounds(void);
+
+static void mixer_callback(void *udata, Uint8 *stream, int len) {
+    u64 now = SDL_GetPerformanceCounter();
+
+    synth_render(stream, len);
+
+    SDL_AtomicLock(&measure_lock);
+
+    measure.buffer_size = len / device.frame_size;
+
+    if(measure.last_time != 0) {
+        u64 interval = now - measure.last_time;
+        u64 expected = (u64) measure.buffer_size *
+                       SDL_GetPerformanceFrequency() / device.frequency;
+
+        if(measure.intervals == 0 || interval < measure.min_interval)
+            measure.min_interval = interval;
+        if(interval > measure.max_interval)
+            measure.max_interval = interval;
+
+        measure.intervals++;
+        measure.interval_sum += interval;
+        measure.deviation_sum += (interval > expected)
+                                 ? interval - expected
+                                 : expected - interval;
+    }
+    measure.last_time = now;
+
+    SDL_AtomicUnlock(&measure_lock);
+}
+
+static int open_device(const struct sound_Config *config) {
+    if(is_device_open) {
+        Mix_SetPostMix(NULL, NULL);
+        Mix_CloseAudio();
+        is_device_open = false;
+
+        // the loaded chunks were converted to the old device format
+        destroy_sounds();
+    }
+
+    if(Mix_OpenAudio(
+        config->frequency, MIX_DEFAULT_FORMAT, 2, config->buffer_size
+    )) {
         fprintf(
             stderr,
-            "Sound: could not initialize\n"
+            "Sound: could not open audio device\n"
             " - Mix_OpenAudio: %s\n", Mix_GetError()
         );
         return -1;
     }
+    is_device_open = true;
+    current_config = *config;
+
+    Mix_QuerySpec(&device.frequency, &device.format, &device.channels);
+    device.frame_size = device.channels *
+                        (SDL_AUDIO_BITSIZE(device.format) / 8);
+
+    synth_set_format(device.frequency, device.format, device.channels);
+
+    printf(
+        "Opening audio device: %d Hz, %d frames buffer\n",
+        config->frequency, config->buffer_size
+    );
+
+    sound_measure_reset();
+    Mix_SetPostMix(mixer_callback, NULL);
+    return 0;
+}
+
+static void load_install_config(void) {
+    char filename[PATH_MAX];
+    snprintf(filename, PATH_MAX, "%s/sound", config_folder);
+
+    // the file is optional
+    FILE *file = fopen(filename, "r");
+    if(!file)
+        return;
+
+    char line[256];
+    while(fgets(line, sizeof(line) / sizeof(char), file)) {
+        char key[64];
+        char value[64];
+
+        // ignore empty lines and comments
+        if(sscanf(line, " %63[^=# \t\n] = %63s", key, value) != 2)
+            continue;
+
+        if(sound_parse_option(&install_config, key, value)) {
+            fprintf(
+                stderr,
+                "Sound: invalid option '%s = %s' in '%s'\n",
+                key, value, filename
+            );
+        }
+    }
+    fclose(file);
+}
+
+int sound_init(void) {
+    load_install_config();
+
+    if(open_device(&install_config)) {
+        fputs("Sound: could not initialize\n", stderr);
+        return -1;
+    }
+    return 0;
+}
+
+int sound_parse_option(struct sound_Config *config,
+                       const char *key, const char *value) {
+    if(!strcmp(key, "preset")) {
+        if(!strcmp(value, "default")) {
+            config->frequency   = SOUND_DEFAULT_FREQUENCY;
+            config->buffer_size = SOUND_DEFAULT_BUFFER_SIZE;
+        } else if(!strcmp(value, "low-latency")) {
+            config->frequency   = SOUND_LOW_LATENCY_FREQUENCY;
+            config->buffer_size = SOUND_LOW_LATENCY_BUFFER_SIZE;
+        } else {
+            return -1;
+        }
+    } else if(!strcmp(key, "frequency")) {
+        i32 frequency = atoi(value);
+        if(frequency < 8000 || frequency > 192000)
+            return -1;
+
+        config->frequency = frequency;
+    } else if(!strcmp(key, "buffer-size")) {
+        i32 buffer_size = atoi(value);
+        if(buffer_size < 32 || buffer_size > 16384)
+            return -1;
+
+        config->buffer_size = buffer_size;
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+int sound_apply_config(const struct sound_Config *config) {
+    struct sound_Config new_config = install_config;
+
+    if(config) {
+        if(config->frequency > 0)
+            new_config.frequency = config->frequency;
+        if(config->buffer_size > 0)
+            new_config.buffer_size = config->buffer_size;
+    }
+
+    if(is_device_open &&
+       new_config.frequency   == current_config.frequency &&
+       new_config.buffer_size == current_config.buffer_size)
+        return 0;
+
+    if(open_device(&new_config)) {
+        // try to fall back to the install configuration
+        if(open_device(&install_config))
+            return -1;
+    }
     return 0;
 }
 
+bool sound_is_open(void) {
+    return is_device_open;
+}
+
+void sound_measure_reset(void) {
+    SDL_AtomicLock(&measure_lock);
+    measure.last_time = 0;
+    measure.intervals = 0;
+    measure.min_interval = 0;
+    measure.max_interval = 0;
+    measure.interval_sum = 0;
+    measure.deviation_sum = 0;
+    SDL_AtomicUnlock(&measure_lock);
+}
+
+void sound_measure_get(struct sound_Stats *stats) {
+    const u64 time_in_second = SDL_GetPerformanceFrequency();
+    #define TO_MICROSECONDS(time) ((u32) ((time) * 1000000 / time_in_second))
+
+    SDL_AtomicLock(&measure_lock);
+
+    *stats = (struct sound_Stats) {
+        .frequency = device.frequency,
+        .channels  = device.channels,
+        .format    = device.format,
+
+        .buffer_size = measure.buffer_size,
+
+        .callbacks = measure.intervals,
+        .min_interval = TO_MICROSECONDS(measure.min_interval),
+        .max_interval = TO_MICROSECONDS(measure.max_interval)
+    };
+
+    if(measure.intervals != 0) {
+        stats->avg_interval = TO_MICROSECONDS(
+            measure.interval_sum / measure.intervals
+        );
+        stats->jitter = TO_MICROSECONDS(
+            measure.deviation_sum / measure.intervals
+        );
+    }
+
+    SDL_AtomicUnlock(&measure_lock);
+
+    if(device.frequency != 0) {
+        stats->expected_interval = (u64) stats->buffer_size * 1000000 /
+                                   device.frequency;
+    }
+
+    #undef TO_MICROSECONDS
+}
+
 static void destroy_sound(void *sound) {
     Mix_FreeChunk(((struct Sound *) sound)->chunk);
+    free(sound);
 }
 
-void sound_destroy(void) {
-    if(sounds_table)
+static void destroy_sounds(void) {
+    // the sounds are owned by the table
+    if(sounds_list) {
+        arraylist_destroy(sounds_list, NULL);
+        sounds_list = NULL;
+    }
+
+    if(sounds_table) {
         hashtable_destroy(sounds_table, destroy_sound);
+        sounds_table = NULL;
+    }
+}
 
-    Mix_CloseAudio();
+void sound_destroy(void) {
+    destroy_sounds();
+
+    if(is_device_open) {
+        Mix_SetPostMix(NULL, NULL);
+        Mix_CloseAudio();
+    }
 }
 
 static void load_sounds(DIR *dir, char *folder_path, u32 root_index) {
@@ -120,19 +379,22 @@ static void load_sounds(DIR *dir, char *folder_path, u32 root_index) {
             struct Sound *sound = malloc(sizeof(struct Sound));
             *sound = (struct Sound) {
                 .chunk = chunk,
-                .channel = -1
+                .channel = -1,
+
+                .id = arraylist_count(sounds_list)
             };
 
             hashtable_set(sounds_table, sound_name, sound);
+            arraylist_add(sounds_list, sound);
             free(sound_name);
         }
     }
 }
 
 int sound_load(char *sfx_folder) {
-    if(sounds_table)
-        hashtable_destroy(sounds_table, destroy_sound);
-    sounds_table = hashtable_create(512);
+    destroy_sounds();
+    sounds_table = hashtable_create(64);
+    sounds_list  = arraylist_create(64, 64);
 
     DIR *dir = opendir(sfx_folder);
     if(!dir) {
@@ -143,10 +405,18 @@ int sound_load(char *sfx_folder) {
     return 0;
 }
 
-int sound_play(const char *name, i32 loops) {
+i32 sound_get_id(const char *name) {
     struct Sound *sound;
 
-    if(hashtable_get(sounds_table, name, (void **) &sound))
+    if(!sounds_table || hashtable_get(sounds_table, name, (void **) &sound))
+        return -1;
+    return sound->id;
+}
+
+int sound_play_id(i32 id, i32 loops) {
+    struct Sound *sound;
+
+    if(!sounds_list || !(sound = arraylist_get(sounds_list, id)))
         return -1;
 
     // FIXME this will overwrite the old sound->channel so
@@ -162,18 +432,18 @@ int sound_play(const char *name, i32 loops) {
     if(sound->channel == -1) {
         fprintf(
             stderr,
-            "Sound: error playing '%s'\n"
+            "Sound: error playing sound %d\n"
             " - Mix_PlayChannel: %s\n",
-            name, Mix_GetError()
+            id, Mix_GetError()
         );
     }
     return 0;
 }
 
-int sound_stop(const char *name) {
+int sound_stop_id(i32 id) {
     struct Sound *sound;
 
-    if(hashtable_get(sounds_table, name, (void **) &sound))
+    if(!sounds_list || !(sound = arraylist_get(sounds_list, id)))
         return -1;
 
     if(sound->channel != -1)
@@ -181,6 +451,21 @@ int sound_stop(const char *name) {
     return 0;
 }
 
+int sound_play(const char *name, i32 loops) {
+    i32 id = sound_get_id(name);
+    if(id < 0)
+        return -1;
+    return sound_play_id(id, loops);
+}
+
+int sound_stop(const char *name) {
+    i32 id = sound_get_id(name);
+    if(id < 0)
+        return -1;
+    return sound_stop_id(id);
+}
+
 void sound_stop_all(void) {
     Mix_HaltChannel(-1);
+    synth_stop(-1);
 }
@@ -0,0 +1,150 @@
+/* Copyright 2024 Vulcalien
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#include "sprite-mask.h"
+
+#include "display.h"
+
+#include <string.h>
+
+// index of a transformation: bits 0-1 = rotation, 2 = h_flip, 3 = v_flip
+#define TRANSFORM_COUNT (16)
+
+static inline u32 transform_index(u8 rot, bool h_flip, bool v_flip) {
+    return (rot & 3) | h_flip << 2 | v_flip << 3;
+}
+
+// the masks of all cells, already transformed
+static u8 masks[256][TRANSFORM_COUNT][SPRITE_SIZE];
+
+static u32 read_pixel(const SDL_Surface *surface, u32 x, u32 y) {
+    const u8 *p = (const u8 *) surface->pixels +
+                  y * surface->pitch + x * surface->format->BytesPerPixel;
+
+    switch(surface->format->BytesPerPixel) {
+        case 1:
+            return *p;
+        case 2:
+            return *(const u16 *) p;
+        case 3:
+            if(SDL_BYTEORDER == SDL_BIG_ENDIAN)
+                return p[0] << 16 | p[1] << 8 | p[2];
+            else
+                return p[0] | p[1] << 8 | p[2] << 16;
+        default:
+            return *(const u32 *) p;
+    }
+}
+
+static inline bool get_bit(const u8 *mask, u32 x, u32 y) {
+    return mask[y] & (0x80 >> x);
+}
+
+static void transform(const u8 *src, u32 t, u8 *dst) {
+    const u32 rot = t & 3;
+    const bool h_flip = t & 4;
+    const bool v_flip = t & 8;
+
+    const u32 last = SPRITE_SIZE - 1;
+
+    memset(dst, 0, SPRITE_SIZE);
+    for(u32 y = 0; y < SPRITE_SIZE; y++) {
+        for(u32 x = 0; x < SPRITE_SIZE; x++) {
+            // undo the clockwise rotation
+            u32 sx = x, sy = y;
+            for(u32 r = 0; r < rot; r++) {
+                u32 tmp = sx;
+                sx = sy;
+                sy = last - tmp;
+            }
+
+            // undo the flip
+            if(h_flip) sx = last - sx;
+            if(v_flip) sy = last - sy;
+
+            if(get_bit(src, sx, sy))
+                dst[y] |= 0x80 >> x;
+        }
+    }
+}
+
+void mask_update(SDL_Surface *atlas) {
+    u32 color_key;
+    const bool has_key = !SDL_GetColorKey(atlas, &color_key);
+
+    if(SDL_MUSTLOCK(atlas))
+        SDL_LockSurface(atlas);
+
+    for(u32 id = 0; id < 256; id++) {
+        const u32 x0 = (id % 16) * SPRITE_SIZE;
+        const u32 y0 = (id / 16) * SPRITE_SIZE;
+
+        u8 *mask = masks[id][0];
+        for(u32 y = 0; y < SPRITE_SIZE; y++) {
+            mask[y] = 0;
+            for(u32 x = 0; x < SPRITE_SIZE; x++) {
+                u32 pixel = read_pixel(atlas, x0 + x, y0 + y);
+                if(has_key && pixel == color_key)
+                    continue;
+
+                u8 r, g, b, a;
+                SDL_GetRGBA(pixel, atlas->format, &r, &g, &b, &a);
+                if(a != 0)
+                    mask[y] |= 0x80 >> x;
+            }
+        }
+
+        for(u32 t = 1; t < TRANSFORM_COUNT; t++)
+            transform(mask, t, masks[id][t]);
+    }
+
+    if(SDL_MUSTLOCK(atlas))
+        SDL_UnlockSurface(atlas);
+}
+
+const u8 *mask_get(u8 id, u8 rot, bool h_flip, bool v_flip) {
+    return masks[id][transform_index(rot, h_flip, v_flip)];
+}
+
+bool mask_overlap(const struct mask_Sprite *a,
+                  const struct mask_Sprite *b) {
+    // position of 'b' relative to 'a'
+    const i64 dx = (i64) b->x - a->x;
+    const i64 dy = (i64) b->y - a->y;
+
+    if(dx <= -SPRITE_SIZE || dx >= SPRITE_SIZE ||
+       dy <= -SPRITE_SIZE || dy >= SPRITE_SIZE)
+        return false;
+
+    const u8 *mask_a = mask_get(a->id, a->rot, a->h_flip, a->v_flip);
+    const u8 *mask_b = mask_get(b->id, b->rot, b->h_flip, b->v_flip);
+
+    // rows of 'a' that are also rows of 'b'
+    const i32 y0 = (dy > 0) ? dy : 0;
+    const i32 y1 = (dy < 0) ? SPRITE_SIZE + dy : SPRITE_SIZE;
+
+    for(i32 y = y0; y < y1; y++) {
+        // move the row of 'b' to the columns of 'a'
+        u32 row_b = mask_b[y - dy];
+        if(dx >= 0)
+            row_b >>= dx;
+        else
+            row_b <<= -dx;
+
+        if(mask_a[y] & row_b)
+            return true;
+    }
+    return false;
+}
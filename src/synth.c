@@ -0,0 +1,408 @@
+/* Copyright 2024 Vulcalien
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#include "synth.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+
+#include <SDL.h>
+
+// Software synthesizer with a few oscillator voices, each one with a
+// simple step sequencer. Voices are rendered into a mono buffer of
+// 32 bit samples, which is then added to the (already mixed) output
+// stream with saturation.
+
+// amplitude of a single voice at full volume: four voices can play
+// together without clipping
+#define VOICE_AMPLITUDE (4096)
+
+// frames rendered at once
+#define MIX_BUFFER_SIZE (1024)
+
+struct synth_Voice {
+    struct synth_Instrument instrument;
+
+    u32 phase;
+    u32 phase_step;
+
+    // frames until the note ends (0 = silent)
+    u32 frames_left;
+
+    // noise generator
+    u16 lfsr;
+
+    // sequencer
+    u8 pattern[SYNTH_PATTERN_MAX];
+    u32 pattern_len; // 0 = no pattern
+    u32 pattern_pos;
+    u32 step_frames;
+    u32 step_frames_left;
+    bool loop;
+};
+
+static SDL_SpinLock lock = 0;
+
+static struct synth_Voice voices[SYNTH_VOICES];
+
+static i32 output_frequency = 0;
+static i32 output_channels  = 0;
+
+static u32 phase_steps[SYNTH_NOTE_COUNT];
+
+static i8 wavetable[SYNTH_WAVETABLE_SIZE] = {
+    // sine-like default
+     0,  24,  48,  70,  90, 106, 117, 125,
+   127, 125, 117, 106,  90,  70,  48,  24,
+     0, -24, -48, -70, -90,-106,-117,-125,
+  -127,-125,-117,-106, -90, -70, -48, -24
+};
+
+static i32 mix_buffer[MIX_BUFFER_SIZE];
+
+void synth_set_format(i32 frequency, u16 format, i32 channels) {
+    SDL_AtomicLock(&lock);
+
+    if(format != AUDIO_S16SYS || frequency <= 0) {
+        fputs("Synth: unsupported audio format\n", stderr);
+        output_frequency = 0;
+    } else {
+        output_frequency = frequency;
+        output_channels  = channels;
+
+        // note 0 is C-1 (8.18 Hz): each semitone multiplies the
+        // frequency by the twelfth root of 2
+        double note_frequency = 8.175798915643707;
+        for(u32 i = 0; i < SYNTH_NOTE_COUNT; i++) {
+            double step = note_frequency * 4294967296.0 / frequency;
+            if(step > 2147483647.0)
+                step = 2147483647.0;
+
+            phase_steps[i] = step;
+            note_frequency *= 1.0594630943592953;
+        }
+    }
+
+    for(u32 i = 0; i < SYNTH_VOICES; i++) {
+        voices[i].frames_left = 0;
+        voices[i].pattern_len = 0;
+    }
+
+    SDL_AtomicUnlock(&lock);
+}
+
+static void sequencer_step(struct synth_Voice *voice) {
+    if(voice->pattern_pos >= voice->pattern_len) {
+        if(!voice->loop) {
+            voice->pattern_len = 0;
+            voice->frames_left = 0;
+            return;
+        }
+        voice->pattern_pos = 0;
+    }
+
+    u8 note = voice->pattern[voice->pattern_pos];
+    voice->pattern_pos++;
+
+    voice->step_frames_left = voice->step_frames;
+
+    if(note == SYNTH_REST) {
+        voice->frames_left = 0;
+    } else if(note != SYNTH_HOLD) {
+        voice->phase_step  = phase_steps[note];
+        voice->frames_left = UINT32_MAX;
+    }
+}
+
+// The loops are kept free of branches, except for the noise generator,
+// so that the compiler can vectorize them.
+static void render_wave(struct synth_Voice *voice, i32 *mix, u32 frames) {
+    const i32 amplitude = VOICE_AMPLITUDE * voice->instrument.volume /
+                          SYNTH_MAX_VOLUME;
+
+    u32 phase = voice->phase;
+    const u32 step = voice->phase_step;
+
+    switch(voice->instrument.waveform) {
+        case SYNTH_SQUARE: {
+            static const u32 duty_thresholds[4] = {
+                1u << 29, 1u << 30, 1u << 31, 3u << 30
+            };
+            const u32 duty = duty_thresholds[voice->instrument.duty & 3];
+
+            for(u32 i = 0; i < frames; i++) {
+                mix[i] += (phase < duty) ? amplitude : -amplitude;
+                phase += step;
+            }
+            break;
+        }
+        case SYNTH_TRIANGLE:
+            for(u32 i = 0; i < frames; i++) {
+                // fold the phase into a value from 0 to 65535
+                i32 p = phase >> 15;
+                p = (p < 65536) ? p : 131071 - p;
+
+                mix[i] += (p - 32768) * amplitude / 32768;
+                phase += step;
+            }
+            break;
+        case SYNTH_NOISE: {
+            u16 lfsr = voice->lfsr;
+            for(u32 i = 0; i < frames; i++) {
+                u32 old_phase = phase;
+                phase += step;
+
+                // clock the generator once per period
+                if(phase < old_phase) {
+                    u16 bit = (lfsr ^ (lfsr >> 1)) & 1;
+                    lfsr = (lfsr >> 1) | (bit << 14);
+                }
+                mix[i] += (lfsr & 1) ? amplitude : -amplitude;
+            }
+            voice->lfsr = lfsr;
+            break;
+        }
+        case SYNTH_WAVE:
+            for(u32 i = 0; i < frames; i++) {
+                mix[i] += wavetable[phase >> 27] * amplitude / 128;
+                phase += step;
+            }
+            break;
+    }
+
+    voice->phase = phase;
+}
+
+static void render_voice(struct synth_Voice *voice, i32 *mix, u32 frames) {
+    u32 done = 0;
+    while(done < frames) {
+        bool has_pattern = (voice->pattern_len != 0);
+
+        if(has_pattern && voice->step_frames_left == 0) {
+            sequencer_step(voice);
+            has_pattern = (voice->pattern_len != 0);
+        }
+
+        u32 n = frames - done;
+        if(has_pattern && n > voice->step_frames_left)
+            n = voice->step_frames_left;
+
+        if(voice->frames_left != 0) {
+            if(n > voice->frames_left)
+                n = voice->frames_left;
+
+            render_wave(voice, mix + done, n);
+            voice->frames_left -= n;
+        } else if(!has_pattern) {
+            // nothing left to play
+            break;
+        }
+
+        if(has_pattern)
+            voice->step_frames_left -= n;
+        done += n;
+    }
+}
+
+void synth_render(u8 *stream, u32 len) {
+    SDL_AtomicLock(&lock);
+
+    if(output_frequency == 0)
+        goto exit;
+
+    // skip everything if all voices are silent
+    bool active = false;
+    for(u32 v = 0; v < SYNTH_VOICES; v++) {
+        if(voices[v].frames_left != 0 || voices[v].pattern_len != 0) {
+            active = true;
+            break;
+        }
+    }
+    if(!active)
+        goto exit;
+
+    Sint16 *samples = (Sint16 *) stream;
+    u32 frames = len / (sizeof(Sint16) * output_channels);
+
+    while(frames > 0) {
+        u32 n = frames < MIX_BUFFER_SIZE ? frames : MIX_BUFFER_SIZE;
+
+        memset(mix_buffer, 0, n * sizeof(i32));
+        for(u32 v = 0; v < SYNTH_VOICES; v++)
+            render_voice(&voices[v], mix_buffer, n);
+
+        // add the mono buffer to each channel, with saturation
+        for(u32 i = 0; i < n; i++) {
+            for(u32 c = 0; c < output_channels; c++) {
+                i32 sample = *samples + mix_buffer[i];
+
+                if(sample > INT16_MAX)
+                    sample = INT16_MAX;
+                else if(sample < INT16_MIN)
+                    sample = INT16_MIN;
+
+                *samples = sample;
+                samples++;
+            }
+        }
+        frames -= n;
+    }
+
+    exit:
+    SDL_AtomicUnlock(&lock);
+}
+
+static u32 ticks_to_frames(u32 ticks) {
+    u32 frames = (u64) ticks * output_frequency / TPS;
+    return frames != 0 ? frames : 1;
+}
+
+int synth_note(u32 voice, u32 note, u32 length,
+               const struct synth_Instrument *instrument) {
+    if(voice >= SYNTH_VOICES || note >= SYNTH_NOTE_COUNT)
+        return -1;
+
+    SDL_AtomicLock(&lock);
+
+    struct synth_Voice *v = &voices[voice];
+    v->instrument  = *instrument;
+    v->phase_step  = phase_steps[note];
+    v->frames_left = ticks_to_frames(length);
+    v->pattern_len = 0;
+
+    if(v->lfsr == 0)
+        v->lfsr = 0x7fff;
+
+    SDL_AtomicUnlock(&lock);
+    return 0;
+}
+
+int synth_pattern(u32 voice, const char *notes, u32 step, bool loop,
+                  const struct synth_Instrument *instrument) {
+    if(voice >= SYNTH_VOICES || step == 0)
+        return -1;
+
+    // parse the notes before locking
+    u8 pattern[SYNTH_PATTERN_MAX];
+    u32 pattern_len = 0;
+
+    for(u32 i = 0; notes[i] != '\0';) {
+        if(isspace((unsigned char) notes[i])) {
+            i++;
+            continue;
+        }
+
+        u32 len = 0;
+        while(notes[i + len] != '\0' &&
+              !isspace((unsigned char) notes[i + len]))
+            len++;
+
+        if(pattern_len == SYNTH_PATTERN_MAX)
+            return -2;
+
+        if(len == 1 && notes[i] == '-') {
+            pattern[pattern_len] = SYNTH_REST;
+        } else if(len == 1 && notes[i] == '.') {
+            pattern[pattern_len] = SYNTH_HOLD;
+        } else {
+            i32 note = synth_parse_note(notes + i, len);
+            if(note < 0)
+                return -3;
+            pattern[pattern_len] = note;
+        }
+        pattern_len++;
+        i += len;
+    }
+
+    SDL_AtomicLock(&lock);
+
+    struct synth_Voice *v = &voices[voice];
+    v->instrument = *instrument;
+
+    memcpy(v->pattern, pattern, pattern_len * sizeof(u8));
+    v->pattern_len = pattern_len;
+    v->pattern_pos = 0;
+
+    v->step_frames      = ticks_to_frames(step);
+    v->step_frames_left = 0;
+    v->loop = loop;
+
+    v->frames_left = 0;
+    if(v->lfsr == 0)
+        v->lfsr = 0x7fff;
+
+    SDL_AtomicUnlock(&lock);
+    return 0;
+}
+
+void synth_stop(i32 voice) {
+    SDL_AtomicLock(&lock);
+    for(u32 i = 0; i < SYNTH_VOICES; i++) {
+        if(voice < 0 || (u32) voice == i) {
+            voices[i].frames_left = 0;
+            voices[i].pattern_len = 0;
+        }
+    }
+    SDL_AtomicUnlock(&lock);
+}
+
+void synth_set_wavetable(const u8 *samples) {
+    SDL_AtomicLock(&lock);
+    for(u32 i = 0; i < SYNTH_WAVETABLE_SIZE; i++)
+        wavetable[i] = ((samples[i] & 0xf) - 8) * 16;
+    SDL_AtomicUnlock(&lock);
+}
+
+i32 synth_parse_note(const char *name, u32 len) {
+    // semitones of A, B, C, D, E, F, G relative to C
+    static const i32 semitones[7] = { 9, 11, 0, 2, 4, 5, 7 };
+
+    if(len < 2)
+        return -1;
+
+    char letter = toupper((unsigned char) name[0]);
+    if(letter < 'A' || letter > 'G')
+        return -1;
+
+    i32 note = semitones[letter - 'A'];
+    u32 i = 1;
+
+    if(name[i] == '#') {
+        note++;
+        i++;
+    } else if(name[i] == 'b') {
+        note--;
+        i++;
+    }
+
+    // octave: from -1 to 9
+    bool negative = false;
+    if(i < len && name[i] == '-') {
+        negative = true;
+        i++;
+    }
+    if(i + 1 != len || !isdigit((unsigned char) name[i]))
+        return -1;
+
+    i32 octave = name[i] - '0';
+    if(negative)
+        octave = -octave;
+
+    note += (octave + 1) * 12;
+    if(note < 0 || note >= SYNTH_NOTE_COUNT)
+        return -1;
+    return note;
+}
@@ -15,11 +15,14 @@
  */
 #include "terminal.h"
 
+#include "compile-options.h"
 #include "display.h"
 #include "shell-commands.h"
+#include "lua-engine.h"
 #include "data-structs/char-queue.h"
 #include "data-structs/circular-list.h"
 
+#include <stdio.h>
 #include <string.h>
 
 #include <SDL.h>
@@ -35,10 +38,23 @@
 #define CHARS_IN_ROW\
     ((DISPLAY_WIDTH - 2) / (CHAR_WIDTH + LETTER_SPACING))
 
-#define ANIMATION_DELAY (25)
+// cursor blinking period, in milliseconds
+#define ANIMATION_DELAY (25 * 1000 / TPS)
 
 #define MAX_LINE_LEN (127)
 
+// maximum time spent processing the buffers in one tick
+#define TICK_TIME_BUDGET_US (4000)
+
+// characters dequeued at once from the output buffer
+#define OUTPUT_BATCH_SIZE (256)
+
+#define SCROLLBACK_DEFAULT_ROWS (2048)
+#define SCROLLBACK_MAX_ROWS     (65536)
+
+#define BUFFER_INITIAL_SIZE (4096)
+#define BUFFER_MAX_SIZE     (1024 * 1024)
+
 static struct {
     char *text;
     u32 len;
@@ -51,16 +67,33 @@ static struct {
     } type;
 } active_line;
 
-struct Row {
-    char text[CHARS_IN_ROW + 1];
-    u32 color;
-};
-
 static i32 scroll_position = 0;
-static i32 cursor_animation_ticks = 0;
-
-// closed rows
-static struct CircularList *closed_rows;
+// the cursor blinks only when the terminal is idle
+static bool cursor_idle = false;
+static u32 cursor_animation_start = 0;
+
+// The rows are drawn into 'screen_texture' only when something changes,
+// while the cursor is drawn on top of it every frame.
+static SDL_Texture *screen_texture = NULL;
+static bool screen_texture_failed = false;
+static bool screen_changed = true;
+static u32  screen_generation = 0;
+
+// row in which the cursor is drawn (-1 = not visible)
+static i32 cursor_row = -1;
+
+#ifdef TERMINAL_TYPING_EFFECT
+    // number of output characters already processed, but not shown yet
+    static u32 hidden_chars = 0;
+#endif
+
+// Closed rows are stored in a preallocated ring, with the colors in a
+// parallel array. Row 0 is the newest one.
+static char (*rows_text)[CHARS_IN_ROW + 1] = NULL;
+static u32 *rows_color = NULL;
+static u32 rows_size  = 0;
+static u32 rows_count = 0;
+static u32 rows_head  = 0;
 
 // command history
 static struct CircularList *command_history;
@@ -70,6 +103,8 @@ static i32 history_index = -1;
 static struct CharQueue *user_buffer;
 static struct CharQueue *output_buffer;
 
+u32 terminal_error_count = 0;
+
 static void terminal_set_scroll(i32 scroll);
 
 static void terminal_execute(void);
@@ -79,11 +114,12 @@ static void allocate_active_line(void);
 int terminal_init(void) {
     allocate_active_line();
 
-    closed_rows     = circularlist_create(2048);
+    if(terminal_set_scrollback(SCROLLBACK_DEFAULT_ROWS))
+        return -1;
     command_history = circularlist_create(1024);
 
-    user_buffer   = charqueue_create(4096);
-    output_buffer = charqueue_create(4096);
+    user_buffer   = charqueue_create(BUFFER_INITIAL_SIZE);
+    output_buffer = charqueue_create(BUFFER_INITIAL_SIZE);
 
     return 0;
 }
@@ -91,57 +127,99 @@ int terminal_init(void) {
 void terminal_destroy(void) {
     free(active_line.text);
 
-    circularlist_destroy(closed_rows, free);
+    free(rows_text);
+    free(rows_color);
     circularlist_destroy(command_history, free);
 
     charqueue_destroy(user_buffer);
     charqueue_destroy(output_buffer);
+
+    if(screen_texture)
+        SDL_DestroyTexture(screen_texture);
 }
 
-static void close_active_line(void) {
-    // split and save the active line into closed_rows
-    struct Row *current_row = calloc(1, sizeof(struct Row));
-    for(u32 i = 0; i < active_line.len; i++) {
-        if(i % CHARS_IN_ROW == 0) {
-            if(i > 0)
-                circularlist_add(closed_rows, current_row, free);
-            current_row = calloc(1, sizeof(struct Row));
-
-            switch(active_line.type) {
-                case LINE_TYPE_NORMAL:
-                    current_row->color = TERM_COLOR_NORMAL;
-                    break;
-                case LINE_TYPE_ERROR:
-                    current_row->color = TERM_COLOR_ERROR;
-                    break;
-                case LINE_TYPE_INPUT:
-                    current_row->color = TERM_COLOR_INPUT;
-                    break;
-            }
-        }
-        current_row->text[i % CHARS_IN_ROW] = active_line.text[i];
+int terminal_set_scrollback(u32 rows) {
+    if(rows == 0 || rows > SCROLLBACK_MAX_ROWS)
+        return -1;
+
+    char (*new_text)[CHARS_IN_ROW + 1] = malloc(
+        rows * sizeof(*new_text)
+    );
+    u32 *new_color = malloc(rows * sizeof(u32));
+    if(!new_text || !new_color) {
+        free(new_text);
+        free(new_color);
+        return -2;
     }
-    circularlist_add(closed_rows, current_row, free);
+
+    // keep the newest rows, in the same order
+    u32 new_count = rows_count < rows ? rows_count : rows;
+    for(u32 i = 0; i < new_count; i++) {
+        u32 old_pos = (rows_head + rows_size - i) % rows_size;
+        u32 new_pos = new_count - 1 - i;
+
+        memcpy(new_text[new_pos], rows_text[old_pos], sizeof(*new_text));
+        new_color[new_pos] = rows_color[old_pos];
+    }
+
+    free(rows_text);
+    free(rows_color);
+
+    rows_text  = new_text;
+    rows_color = new_color;
+    rows_size  = rows;
+    rows_count = new_count;
+    rows_head  = (new_count == 0) ? rows - 1 : new_count - 1;
+
+    screen_changed = true;
+    return 0;
 }
 
-void terminal_tick(void) {
-    char c;
+// Appends a row, overwriting the oldest one if the ring is full.
+// Returns the text of the new row, which is initially empty.
+static char *add_row(u32 color) {
+    rows_head = (rows_head + 1) % rows_size;
+    if(rows_count < rows_size)
+        rows_count++;
 
-    if(!charqueue_is_empty(output_buffer)) {
-        c = charqueue_dequeue(output_buffer);
-        if(active_line.type == LINE_TYPE_INPUT)
-            active_line.type = LINE_TYPE_NORMAL;
-    } else if(!charqueue_is_empty(user_buffer)) {
-        c = charqueue_dequeue(user_buffer);
-        active_line.type = LINE_TYPE_INPUT;
-    } else {
-        // all buffers are empty
-        cursor_animation_ticks++;
-        return;
+    memset(rows_text[rows_head], '\0', sizeof(*rows_text));
+    rows_color[rows_head] = color;
+    return rows_text[rows_head];
+}
+
+// 'index' must be lower than 'rows_count'
+static inline u32 row_position(u32 index) {
+    return (rows_head + rows_size - index) % rows_size;
+}
+
+static void close_active_line(void) {
+    u32 color = TERM_COLOR_NORMAL;
+    switch(active_line.type) {
+        case LINE_TYPE_NORMAL:
+            color = TERM_COLOR_NORMAL;
+            break;
+        case LINE_TYPE_ERROR:
+            color = TERM_COLOR_ERROR;
+            break;
+        case LINE_TYPE_INPUT:
+            color = TERM_COLOR_INPUT;
+            break;
     }
 
-    cursor_animation_ticks = 0;
+    // split and save the active line into the closed rows
+    u32 i = 0;
+    do {
+        u32 len = active_line.len - i;
+        if(len > CHARS_IN_ROW)
+            len = CHARS_IN_ROW;
+
+        char *row = add_row(color);
+        memcpy(row, active_line.text + i, len);
+        i += len;
+    } while(i < active_line.len);
+}
 
+static void process_char(char c) {
     if(c == '\n') {
         close_active_line();
 
@@ -259,23 +337,123 @@ void terminal_tick(void) {
             active_line.text[active_line.len] = '\0';
         }
     }
+}
+
+void terminal_tick(void) {
+    const u64 start_time = SDL_GetPerformanceCounter();
+    const u64 time_budget = SDL_GetPerformanceFrequency() *
+                            TICK_TIME_BUDGET_US / 1000000;
+
+    bool processed = false;
+
+    // If a command starts the engine, stop processing: the remaining
+    // input will be processed after the engine stops.
+    while(!engine_running) {
+        if(!charqueue_is_empty(output_buffer)) {
+            char batch[OUTPUT_BATCH_SIZE];
+            u32 count = charqueue_dequeue_bulk(
+                output_buffer, batch, OUTPUT_BATCH_SIZE
+            );
+
+            if(active_line.type == LINE_TYPE_INPUT)
+                active_line.type = LINE_TYPE_NORMAL;
+
+            for(u32 i = 0; i < count; i++)
+                process_char(batch[i]);
+
+            #ifdef TERMINAL_TYPING_EFFECT
+                hidden_chars += count;
+            #endif
+        } else if(!charqueue_is_empty(user_buffer)) {
+            // user input is processed one character at a time, since
+            // it can execute commands
+            char c = charqueue_dequeue(user_buffer);
+            active_line.type = LINE_TYPE_INPUT;
+
+            process_char(c);
+        } else {
+            // all buffers are empty
+            break;
+        }
+        processed = true;
+
+        if(SDL_GetPerformanceCounter() - start_time >= time_budget)
+            break;
+    }
+
+    #ifdef TERMINAL_TYPING_EFFECT
+        // reveal at least two characters per tick, more if there are
+        // many hidden characters
+        if(hidden_chars > 0) {
+            u32 amount = 2 + hidden_chars / 8;
+            hidden_chars = (hidden_chars > amount) ? hidden_chars - amount : 0;
+
+            screen_changed = true;
+        }
+    #endif
+
+    if(!processed) {
+        if(!cursor_idle) {
+            cursor_idle = true;
+            cursor_animation_start = SDL_GetTicks();
+        }
+        return;
+    }
+    cursor_idle = false;
+    screen_changed = true;
 
-    const i32 closed_rows_count = circularlist_count(closed_rows);
-    terminal_set_scroll(closed_rows_count - ROWS_IN_DISPLAY + 2);
+    terminal_set_scroll((i32) rows_count - ROWS_IN_DISPLAY + 2);
 }
 
-void terminal_render(void) {
+static void draw_rows(void) {
     display_clear(0x000000);
 
+    // rows with index lower than 'hidden_row' are not drawn, while
+    // 'hidden_row' is drawn without its last 'hidden_row_chars' chars
+    i32 hidden_row = -1;
+    u32 hidden_row_chars = 0;
+    u32 active_line_len = active_line.len;
+
+    #ifdef TERMINAL_TYPING_EFFECT
+        if(hidden_chars > 0 && active_line.type != LINE_TYPE_INPUT) {
+            u32 remaining = hidden_chars;
+
+            u32 n = remaining < active_line_len ? remaining : active_line_len;
+            active_line_len -= n;
+            remaining -= n;
+
+            for(u32 i = 0; remaining > 0 && i < rows_count; i++) {
+                u32 len = strlen(rows_text[row_position(i)]);
+
+                hidden_row = i;
+                if(remaining < len) {
+                    hidden_row_chars = remaining;
+                    break;
+                }
+                remaining -= len;
+                hidden_row_chars = len;
+            }
+        }
+    #endif
+
     u32 drawn_lines = 0;
 
-    const i32 closed_rows_count = circularlist_count(closed_rows);
-    for(i32 i = closed_rows_count - scroll_position; i >= 0; i--) {
-        struct Row *row = circularlist_get(closed_rows, i);
-        if(!row)
+    for(i32 i = (i32) rows_count - scroll_position; i >= 0; i--) {
+        if((u32) i >= rows_count)
             continue;
+
+        if(i < hidden_row)
+            break;
+
+        const u32 pos = row_position(i);
+
+        char text[CHARS_IN_ROW + 1];
+        strcpy(text, rows_text[pos]);
+        if(i == hidden_row)
+            text[strlen(text) - hidden_row_chars] = '\0';
+
         display_write(
-            row->text, row->color,
+            text, rows_color[pos],
             1, 1 + (CHAR_HEIGHT + LINE_SPACING) * drawn_lines,
             1, 0xff
         );
@@ -285,7 +463,7 @@ void terminal_render(void) {
             break;
     }
 
-    if(drawn_lines < ROWS_IN_DISPLAY) {
+    if(drawn_lines < ROWS_IN_DISPLAY && hidden_row < 0) {
         u32 color;
         switch(active_line.type) {
             case LINE_TYPE_NORMAL:
@@ -298,41 +476,115 @@ void terminal_render(void) {
                 color = TERM_COLOR_INPUT;
                 break;
         }
+        char text[MAX_LINE_LEN + 1];
+        strcpy(text, active_line.text);
+        text[active_line_len] = '\0';
+
         display_write(
-            active_line.text, color,
+            text, color,
             1, 1 + (CHAR_HEIGHT + LINE_SPACING) * drawn_lines,
             1, 0xff
         );
 
-        if((active_line.type == LINE_TYPE_INPUT ||
-            cursor_animation_ticks != 0) &&
-           cursor_animation_ticks / ANIMATION_DELAY % 2 == 0) {
-            display_write(
-                "_", CURSOR_COLOR,
-                1 + (CHAR_WIDTH + LETTER_SPACING) * active_line.cursor_pos,
-                1 + (CHAR_HEIGHT + LINE_SPACING) * drawn_lines,
-                1, 0xff
-            );
+        cursor_row = drawn_lines;
+    } else {
+        cursor_row = -1;
+    }
+}
+
+void terminal_render(void) {
+    if(!screen_texture && !screen_texture_failed) {
+        screen_texture = display_create_target();
+        screen_texture_failed = (screen_texture == NULL);
+    }
+
+    if(screen_texture) {
+        if(screen_changed || screen_generation != display_target_generation) {
+            display_set_target(screen_texture);
+            draw_rows();
+            display_set_target(NULL);
+
+            screen_changed = false;
+            screen_generation = display_target_generation;
         }
+        display_draw_target(screen_texture);
+    } else {
+        // the render target is not available: draw directly
+        draw_rows();
+    }
+
+    if(cursor_row >= 0 &&
+       (active_line.type == LINE_TYPE_INPUT ||
+        cursor_idle) &&
+       (!cursor_idle ||
+        (SDL_GetTicks() - cursor_animation_start) / ANIMATION_DELAY % 2 == 0)) {
+        display_write(
+            "_", CURSOR_COLOR,
+            1 + (CHAR_WIDTH + LETTER_SPACING) * active_line.cursor_pos,
+            1 + (CHAR_HEIGHT + LINE_SPACING) * cursor_row,
+            1, 0xff
+        );
     }
 }
 
-void terminal_receive_input(const char *c) {
-    for(u32 i = 0; c[i] != '\0'; i++) {
-        if(charqueue_is_full(user_buffer))
-            break;
-        charqueue_enqueue(user_buffer, c[i]);
+// Makes sure 'queue' can hold 'len' more characters, growing it if
+// necessary. Returns how many characters can be enqueued.
+static u32 reserve_space(struct CharQueue *queue, u32 len) {
+    u32 size  = charqueue_size(queue);
+    u32 count = charqueue_count(queue);
+
+    if(size - count < len && size < BUFFER_MAX_SIZE) {
+        u32 new_size = size;
+        while(new_size - count < len && new_size < BUFFER_MAX_SIZE)
+            new_size *= 2;
+        if(new_size > BUFFER_MAX_SIZE)
+            new_size = BUFFER_MAX_SIZE;
+
+        if(!charqueue_resize(queue, new_size))
+            size = new_size;
+    }
+
+    if(size - count < len) {
+        fprintf(
+            stderr,
+            "Terminal: buffer full, %u characters discarded\n",
+            len - (size - count)
+        );
+        return size - count;
     }
+    return len;
+}
+
+u32 terminal_idle_time(void) {
+    if(!cursor_idle ||
+       !charqueue_is_empty(output_buffer) ||
+       !charqueue_is_empty(user_buffer))
+        return 0;
+
+    #ifdef TERMINAL_TYPING_EFFECT
+        if(hidden_chars > 0)
+            return 0;
+    #endif
+
+    // wait until the cursor has to blink
+    u32 elapsed = SDL_GetTicks() - cursor_animation_start;
+    return ANIMATION_DELAY - elapsed % ANIMATION_DELAY;
+}
+
+void terminal_receive_input(const char *c) {
+    u32 len = reserve_space(user_buffer, strlen(c));
+    charqueue_enqueue_bulk(user_buffer, c, len);
 }
 
 static void terminal_set_scroll(i32 scroll) {
-    const i32 closed_rows_count = circularlist_count(closed_rows);
-    if(scroll > (closed_rows_count) - ROWS_IN_DISPLAY + 2)
-        scroll = closed_rows_count - ROWS_IN_DISPLAY + 2;
+    if(scroll > (i32) rows_count - ROWS_IN_DISPLAY + 2)
+        scroll = (i32) rows_count - ROWS_IN_DISPLAY + 2;
 
     if(scroll < 0)
         scroll = 0;
 
+    if(scroll != scroll_position)
+        screen_changed = true;
     scroll_position = scroll;
 }
 
@@ -345,37 +597,56 @@ void terminal_clear(void) {
     active_line.len = 0;
     active_line.cursor_pos = 0;
 
-    circularlist_clear(closed_rows);
+    rows_count = 0;
 
     scroll_position = 0;
+    screen_changed = true;
+
+    #ifdef TERMINAL_TYPING_EFFECT
+        hidden_chars = 0;
+    #endif
 }
 
 void terminal_write(const char *text, bool is_error) {
-    bool should_write_err_flag = is_error;
-    bool is_last_char = false;
-    for(i32 i = 0; !is_last_char; i++) {
-        if(charqueue_is_full(output_buffer))
-            break;
+    if(is_error)
+        terminal_error_count++;
 
-        char c;
-        if(should_write_err_flag) {
-            should_write_err_flag = false;
-            i--;
+    if(batch_mode) {
+        FILE *stream = is_error ? stderr : stdout;
+        fputs(text, stream);
+        fputc('\n', stream);
+        return;
+    }
+
+    if(!is_error) {
+        u32 len = strlen(text);
+        u32 space = reserve_space(output_buffer, len + 1);
 
-            c = '\x0b';
+        if(space > len) {
+            charqueue_enqueue_bulk(output_buffer, text, len);
+            charqueue_enqueue(output_buffer, '\n');
         } else {
-            c = text[i];
+            charqueue_enqueue_bulk(output_buffer, text, space);
         }
+        return;
+    }
 
-        if(c == '\0') {
-            c = '\n';
-            is_last_char = true;
-        } else if(c == '\n') {
-            if(is_error)
-                should_write_err_flag = true;
-        }
+    // error lines: each line is preceded by the error line indicator
+    while(true) {
+        const char *line_end = strchr(text, '\n');
+        u32 len = line_end ? (u32) (line_end - text) : strlen(text);
+
+        // indicator + text + newline
+        if(reserve_space(output_buffer, len + 2) < len + 2)
+            break;
+
+        charqueue_enqueue(output_buffer, '\x0b');
+        charqueue_enqueue_bulk(output_buffer, text, len);
+        charqueue_enqueue(output_buffer, '\n');
 
-        charqueue_enqueue(output_buffer, c);
+        if(!line_end)
+            break;
+        text = line_end + 1;
     }
 }
 